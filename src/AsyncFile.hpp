@@ -0,0 +1,777 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <fstream>
+#include <streambuf>
+#include <algorithm>
+#include <condition_variable>
+#include "BitmapPlusPlus.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef IORING_FEAT_RW_CUR_POS
+#define AFFINE_IO_URING
+#endif
+#endif
+
+/*
+ * Image file I/O in large chunks with many requests in flight, behind the
+ * istream/ostream interface the bitmap codecs read and write rows through.
+ * Requests go to io_uring (raw syscalls, no liburing) where the kernel
+ * allows it, and to a few pread/pwrite threads otherwise. Standard input and
+ * output, shared memory and tiled images keep their own paths.
+ */
+
+enum class IOBackend
+{
+    Auto,    // io_uring, or threads when it is unavailable
+    Uring,   // io_uring or fail
+    Threads, // pread/pwrite worker threads
+    Stream   // std::fstream, one blocking call per row
+};
+
+struct FileIOOptions
+{
+    IOBackend backend = IOBackend::Auto;
+    // Bypasses the page cache; quietly buffered where the file system refuses
+    bool direct = false;
+    // Bytes per request (a multiple of 4 KB), 0 for 64 KB buffered (the
+    // chunk stays in cache between the codec's copy and the kernel's) and
+    // 256 KB direct; and requests in flight
+    std::size_t chunk = 0;
+    unsigned depth = 16;
+};
+
+// Used by affine::load and affine::save; set it once at startup
+inline FileIOOptions &defaultFileIO()
+{
+    static FileIOOptions options;
+    return options;
+}
+
+// "auto", "uring", "threads" or "stream"
+inline IOBackend parseIOBackend(const std::string &name)
+{
+    if (name == "auto")
+        return IOBackend::Auto;
+    if (name == "uring")
+        return IOBackend::Uring;
+    if (name == "threads")
+        return IOBackend::Threads;
+    if (name == "stream")
+        return IOBackend::Stream;
+
+    throw bmp::Exception("Invalid I/O backend " + name);
+}
+
+#ifndef _WIN32
+
+// Reads or writes of whole buffers at file offsets, completed in any order
+class IOQueue
+{
+public:
+    struct Completion
+    {
+        std::uint64_t tag;
+        std::int64_t result; // bytes transferred or -errno
+    };
+
+    virtual ~IOQueue() = default;
+
+    // Queues a request; at most depth of them may be outstanding
+    virtual void submit(bool write, int fd, void *data, std::size_t size, std::uint64_t offset, std::uint64_t tag) = 0;
+
+    // Waits for the next finished request
+    virtual Completion wait() = 0;
+
+    virtual const char *name() const = 0;
+};
+
+class ThreadIOQueue : public IOQueue
+{
+public:
+    explicit ThreadIOQueue(unsigned depth)
+    {
+        unsigned threads = std::max(1u, std::min(depth, 4u));
+
+        for (unsigned i = 0; i < threads; ++i)
+            workers.emplace_back([this]
+                                 { run(); });
+    }
+
+    ~ThreadIOQueue() override
+    {
+        {
+            const std::unique_lock<std::mutex> lock(mutex);
+            stopped = true;
+        }
+
+        changed.notify_all();
+
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    void submit(bool write, int fd, void *data, std::size_t size, std::uint64_t offset, std::uint64_t tag) override
+    {
+        {
+            const std::unique_lock<std::mutex> lock(mutex);
+            requests.push_back({write, fd, data, size, offset, tag});
+        }
+
+        changed.notify_all();
+    }
+
+    Completion wait() override
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        changed.wait(lock, [this]
+                     { return !completions.empty(); });
+
+        Completion completion = completions.front();
+        completions.pop_front();
+        return completion;
+    }
+
+    const char *name() const override { return "threads"; }
+
+private:
+    struct Request
+    {
+        bool write;
+        int fd;
+        void *data;
+        std::size_t size;
+        std::uint64_t offset;
+        std::uint64_t tag;
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true)
+        {
+            changed.wait(lock, [this]
+                         { return stopped || !requests.empty(); });
+
+            if (requests.empty())
+                return;
+
+            Request request = requests.front();
+            requests.pop_front();
+
+            lock.unlock();
+
+            ssize_t result;
+
+            do
+                result = request.write ? pwrite(request.fd, request.data, request.size, request.offset)
+                                       : pread(request.fd, request.data, request.size, request.offset);
+            while (result < 0 && errno == EINTR);
+
+            std::int64_t code = result < 0 ? -errno : result;
+
+            lock.lock();
+
+            completions.push_back({request.tag, code});
+            changed.notify_all();
+        }
+    }
+
+    std::deque<Request> requests;
+    std::deque<Completion> completions;
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool stopped = false;
+    std::vector<std::thread> workers;
+};
+
+#ifdef AFFINE_IO_URING
+
+/*
+ * io_uring through the raw syscalls and mapped rings. Requests are queued in
+ * the submission ring and handed to the kernel in one io_uring_enter, which
+ * also waits, when no completion is ready. Kernels before 5.6 (no
+ * IORING_OP_READ/WRITE) and sandboxes that filter the syscalls make the
+ * constructor throw, so callers can fall back to threads.
+ */
+class UringIOQueue : public IOQueue
+{
+public:
+    explicit UringIOQueue(unsigned depth)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+
+        ring = (int)syscall(__NR_io_uring_setup, std::max(depth, 1u), &params);
+
+        if (ring < 0)
+            throw bmp::Exception(std::string("io_uring_setup: ") + std::strerror(errno));
+
+        if (!(params.features & IORING_FEAT_RW_CUR_POS))
+        {
+            ::close(ring);
+            throw bmp::Exception("io_uring: kernel without IORING_OP_READ");
+        }
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+
+        if (single)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+
+        sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        cq_ring = single ? sq_ring
+                         : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                ring, IORING_OFF_SQES));
+
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            unmap();
+            throw bmp::Exception("io_uring: failed to map rings");
+        }
+
+        char *sq = static_cast<char *>(sq_ring),
+             *cq = static_cast<char *>(cq_ring);
+
+        sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    }
+
+    ~UringIOQueue() override
+    {
+        unmap();
+    }
+
+    void submit(bool write, int fd, void *data, std::size_t size, std::uint64_t offset, std::uint64_t tag) override
+    {
+        unsigned tail = *sq_tail,
+                 index = tail & sq_mask;
+
+        io_uring_sqe &sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = (std::uint64_t)(std::uintptr_t)data;
+        sqe.len = (std::uint32_t)size;
+        sqe.off = offset;
+        sqe.user_data = tag;
+
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted;
+    }
+
+    Completion wait() override
+    {
+        while (true)
+        {
+            unsigned head = *cq_head;
+
+            if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            {
+                const io_uring_cqe &cqe = cqes[head & cq_mask];
+                Completion completion{cqe.user_data, cqe.res};
+
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                return completion;
+            }
+
+            int submitted = (int)syscall(__NR_io_uring_enter, ring, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+            if (submitted < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                throw bmp::Exception(std::string("io_uring_enter: ") + std::strerror(errno));
+            }
+
+            unsubmitted -= submitted;
+        }
+    }
+
+    const char *name() const override { return "uring"; }
+
+private:
+    void unmap()
+    {
+        if (sqes && sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        if (cq_ring && cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_size);
+        if (sq_ring && sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_size);
+
+        ::close(ring);
+    }
+
+    int ring;
+    void *sq_ring = nullptr,
+         *cq_ring = nullptr;
+    io_uring_sqe *sqes = nullptr;
+    io_uring_cqe *cqes;
+    std::size_t sq_size,
+        cq_size,
+        sqes_size;
+    unsigned *sq_tail,
+        *sq_array,
+        *cq_head,
+        *cq_tail;
+    unsigned sq_mask,
+        cq_mask,
+        unsubmitted = 0;
+};
+
+#endif
+
+// The queue of the given backend; Auto falls back to threads
+inline std::unique_ptr<IOQueue> makeIOQueue(IOBackend backend, unsigned depth)
+{
+#ifdef AFFINE_IO_URING
+    if (backend == IOBackend::Auto || backend == IOBackend::Uring)
+    {
+        try
+        {
+            return std::unique_ptr<IOQueue>(new UringIOQueue(depth));
+        }
+        catch (const bmp::Exception &)
+        {
+            if (backend == IOBackend::Uring)
+                throw;
+        }
+    }
+#else
+    if (backend == IOBackend::Uring)
+        throw bmp::Exception("io_uring is not available on this platform");
+#endif
+
+    return std::unique_ptr<IOQueue>(new ThreadIOQueue(depth));
+}
+
+/*
+ * Stream buffer over an IOQueue: reading keeps depth chunks read ahead of
+ * the position, writing hands each filled chunk to the queue and goes on
+ * filling the next. Reads may seek (the codecs skip to the pixel data);
+ * writes are sequential and reach the file by close(). Chunk buffers and
+ * offsets are 4 KB aligned, as O_DIRECT requires; the final partial chunk
+ * of a write is written with O_DIRECT cleared.
+ */
+class AsyncFileBuf : public std::streambuf
+{
+public:
+    AsyncFileBuf(const std::string &filename, std::ios::openmode mode,
+                 const FileIOOptions &options = defaultFileIO())
+        : writing(mode & std::ios::out), slots(std::max(1u, options.depth))
+    {
+        int flags = writing ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+
+#ifdef O_DIRECT
+        if (options.direct)
+        {
+            fd = ::open(filename.c_str(), flags | O_DIRECT, 0644);
+            direct = fd >= 0;
+        }
+#endif
+
+        if (fd < 0)
+            fd = ::open(filename.c_str(), flags, 0644);
+
+        if (fd < 0)
+            return;
+
+        chunk = options.chunk ? options.chunk : direct ? 256 << 10 : 64 << 10;
+        chunk = std::max<std::size_t>(4096, chunk / 4096 * 4096);
+
+        void *memory = nullptr;
+
+        if (posix_memalign(&memory, 4096, chunk * slots.size()) != 0)
+            throw std::bad_alloc();
+
+        buffers.reset(static_cast<char *>(memory));
+
+        for (std::size_t i = 0; i < slots.size(); ++i)
+            slots[i].data = buffers.get() + chunk * i;
+
+        queue = makeIOQueue(options.backend, slots.size());
+
+        if (writing)
+            setp(slots[0].data, slots[0].data + chunk);
+        else
+        {
+            struct stat st;
+
+            if (fstat(fd, &st) == 0)
+                file_size = st.st_size;
+
+            start(0);
+        }
+    }
+
+    ~AsyncFileBuf() override
+    {
+        close();
+    }
+
+    AsyncFileBuf(const AsyncFileBuf &) = delete;
+    AsyncFileBuf &operator=(const AsyncFileBuf &) = delete;
+
+    bool isOpen() const { return fd >= 0; }
+
+    // Waits for the requests in flight and, when writing, writes the rest;
+    // false if any request failed
+    bool close()
+    {
+        if (fd < 0)
+            return error.empty();
+
+        drain();
+
+        if (writing && error.empty())
+        {
+            std::size_t rest = pptr() - pbase();
+
+#ifdef O_DIRECT
+            if (direct && rest % 4096)
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+#endif
+
+            transfer(pbase(), rest, write_offset);
+            setp(nullptr, nullptr);
+        }
+
+        ::close(fd);
+        fd = -1;
+        queue.reset();
+
+        return error.empty();
+    }
+
+    // First failure, empty if none
+    const std::string &failure() const { return error; }
+
+    const char *backend() const { return queue ? queue->name() : "none"; }
+
+protected:
+    int_type underflow() override
+    {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+
+        while (error.empty())
+        {
+            // Releases the chunk just read for the next read ahead
+            if (current >= 0)
+            {
+                slots[current].queued = false;
+                fetch(slots[current]);
+                current = -1;
+                head = (head + 1) % slots.size();
+            }
+
+            Slot &slot = slots[head];
+
+            if (!slot.queued)
+                break;
+
+            complete(slot);
+
+            std::size_t size = slot.result > 0 ? slot.result : 0;
+            current = head;
+            current_offset = slot.offset;
+
+            if (skip < size)
+            {
+                setg(slot.data, slot.data + skip, slot.data + size);
+                skip = 0;
+                return traits_type::to_int_type(*gptr());
+            }
+
+            skip -= std::min<std::size_t>(skip, size);
+        }
+
+        setg(nullptr, nullptr, nullptr);
+        return traits_type::eof();
+    }
+
+    int_type overflow(int_type c) override
+    {
+        if (fd < 0 || !error.empty())
+            return traits_type::eof();
+
+        if (pptr() == epptr())
+        {
+            Slot &slot = slots[current_write];
+
+            slot.offset = write_offset;
+            slot.size = chunk;
+            slot.busy = true;
+            queue->submit(true, fd, slot.data, chunk, write_offset, current_write);
+            write_offset += chunk;
+
+            current_write = (current_write + 1) % slots.size();
+
+            if (slots[current_write].busy)
+                complete(slots[current_write]);
+
+            setp(slots[current_write].data, slots[current_write].data + chunk);
+        }
+
+        if (!error.empty())
+            return traits_type::eof();
+
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+
+        return traits_type::not_eof(c);
+    }
+
+    pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode) override
+    {
+        if (writing || fd < 0)
+            return pos_type(off_type(-1));
+
+        std::uint64_t position = current >= 0 ? current_offset + (gptr() - eback()) : start_offset;
+
+        if (dir == std::ios::beg)
+            position = off;
+        else if (dir == std::ios::cur)
+            position += off;
+        else
+            position = file_size + off;
+
+        // Within the chunk at hand, or a fresh read ahead from there
+        if (current >= 0 && position >= current_offset && position < current_offset + (egptr() - eback()))
+            setg(eback(), eback() + (position - current_offset), egptr());
+        else if (off != 0 || dir != std::ios::cur)
+            start(position);
+
+        return pos_type(off_type(position));
+    }
+
+    pos_type seekpos(pos_type position, std::ios::openmode which) override
+    {
+        return seekoff(off_type(position), std::ios::beg, which);
+    }
+
+private:
+    struct Slot
+    {
+        char *data;
+        std::uint64_t offset;
+        std::size_t size;
+        std::int64_t result;
+        // In flight; and, reading, holding a chunk of the read ahead not yet consumed
+        bool busy = false,
+             queued = false;
+    };
+
+    struct Free
+    {
+        void operator()(char *p) const { std::free(p); }
+    };
+
+    // Starts reading ahead from the chunk holding position
+    void start(std::uint64_t position)
+    {
+        drain();
+
+        setg(nullptr, nullptr, nullptr);
+        current = -1;
+        head = 0;
+        start_offset = position;
+        read_offset = position / chunk * chunk;
+        skip = position - read_offset;
+
+        for (auto &slot : slots)
+        {
+            slot.queued = false;
+            fetch(slot);
+        }
+    }
+
+    // Queues the next chunk of the read ahead into slot
+    void fetch(Slot &slot)
+    {
+        if (read_offset >= file_size || !error.empty())
+            return;
+
+        slot.offset = read_offset;
+        slot.size = chunk;
+        slot.busy = slot.queued = true;
+        queue->submit(false, fd, slot.data, chunk, read_offset, &slot - slots.data());
+        read_offset += chunk;
+    }
+
+    // Waits for the slot's request, finishing short transfers synchronously
+    void complete(Slot &slot)
+    {
+        while (slot.busy)
+        {
+            IOQueue::Completion completion = queue->wait();
+            Slot &done = slots[completion.tag];
+
+            done.busy = false;
+            done.result = completion.result;
+        }
+
+        if (slot.result < 0)
+        {
+            fail(-slot.result);
+            return;
+        }
+
+        std::size_t expected = writing ? slot.size : std::min<std::uint64_t>(slot.size, file_size - slot.offset);
+
+        if ((std::size_t)slot.result < expected)
+            slot.result += transfer(slot.data + slot.result, expected - slot.result, slot.offset + slot.result);
+    }
+
+    void drain()
+    {
+        for (auto &slot : slots)
+            complete(slot);
+    }
+
+    // Blocking pread/pwrite of the whole range; returns the bytes moved
+    std::size_t transfer(char *data, std::size_t size, std::uint64_t offset)
+    {
+        std::size_t done = 0;
+
+        while (done < size)
+        {
+            ssize_t result = writing ? pwrite(fd, data + done, size - done, offset + done)
+                                     : pread(fd, data + done, size - done, offset + done);
+
+            if (result < 0 && errno == EINTR)
+                continue;
+
+            if (result < 0)
+            {
+                fail(errno);
+                break;
+            }
+
+            if (result == 0)
+                break;
+
+            done += result;
+        }
+
+        return done;
+    }
+
+    void fail(int code)
+    {
+        if (error.empty())
+            error = std::strerror(code);
+    }
+
+    bool writing,
+        direct = false;
+    int fd = -1;
+    std::size_t chunk = 0;
+    std::vector<Slot> slots;
+    std::unique_ptr<char, Free> buffers;
+    std::unique_ptr<IOQueue> queue;
+    std::string error;
+
+    // Reading: slots are consumed in ring order from head, current is the
+    // slot exposed as the get area
+    std::uint64_t file_size = 0,
+                  read_offset = 0,
+                  start_offset = 0,
+                  current_offset = 0;
+    std::size_t skip = 0,
+                head = 0;
+    long current = -1;
+
+    // Writing: slot being filled and the file offset of its first byte
+    std::size_t current_write = 0;
+    std::uint64_t write_offset = 0;
+};
+
+#endif
+
+// Bitmap load/save through defaultFileIO()
+template <class Bitmap>
+void loadBitmap(Bitmap &bitmap, const std::string &filename)
+{
+#ifndef _WIN32
+    if (defaultFileIO().backend != IOBackend::Stream)
+    {
+        AsyncFileBuf buffer(filename, std::ios::in);
+
+        if (!buffer.isOpen())
+            throw bmp::Exception("Bitmap::Load(\"" + filename + "\"): Failed to load bitmap pixels from file.");
+
+        std::istream is(&buffer);
+        bitmap.load(is, filename);
+
+        if (!buffer.close())
+            throw bmp::Exception("Bitmap::Load(\"" + filename + "\"): " + buffer.failure());
+
+        return;
+    }
+#endif
+
+    bitmap.load(filename);
+}
+
+template <class Bitmap>
+void saveBitmap(const Bitmap &bitmap, const std::string &filename)
+{
+#ifndef _WIN32
+    if (defaultFileIO().backend != IOBackend::Stream)
+    {
+        AsyncFileBuf buffer(filename, std::ios::out);
+
+        if (!buffer.isOpen())
+            throw bmp::Exception("Bitmap::Save(\"" + filename + "\"): Failed to save pixels to file.");
+
+        std::ostream os(&buffer);
+        bitmap.save(os, bmp::detail::format_from_extension(filename));
+
+        if (!buffer.close())
+            throw bmp::Exception("Bitmap::Save(\"" + filename + "\"): " + buffer.failure());
+
+        return;
+    }
+#endif
+
+    bitmap.save(filename);
+}
@@ -9,18 +9,31 @@
 #include <string>    // std::string
 #include <cstring>   // std::memcmp
 #include <exception> // std::exception
+#include <limits>    // std::numeric_limits
+#include <type_traits> // std::is_same_v
+#include <cctype>    // std::tolower
+#include <istream>   // std::istream
+#include <utility>   // std::forward
+#include <memory_resource> // std::pmr::memory_resource
 
 namespace bmp
 {
-  // Magic number for Bitmap .bmp 24 bpp files (24/8 = 3 = rgb colors only)
+  // Magic number for Bitmap .bmp files
   static constexpr const std::uint16_t BITMAP_BUFFER_MAGIC = 0x4D42;
 
+  // Compression types used by 24 and 32 bpp bitmaps
+  static constexpr const std::uint32_t BITMAP_BI_RGB = 0;
+  static constexpr const std::uint32_t BITMAP_BI_BITFIELDS = 3;
+
+  // Color space tag written to BITMAPV4HEADER ('sRGB')
+  static constexpr const std::uint32_t BITMAP_LCS_SRGB = 0x73524742;
+
 #pragma pack(push, 1)
   struct BitmapHeader
   {
     /* Bitmap file header structure */
     std::uint16_t magic;       /* Magic number for file always BM which is 0x4D42 */
-    std::uint32_t file_size;   /* Size of file */
+    std::uint32_t file_size;   /* Size of file, 0 past 4 GB */
     std::uint16_t reserved1;   /* Reserved */
     std::uint16_t reserved2;   /* Reserved */
     std::uint32_t offset_bits; /* Offset to bitmap data */
@@ -31,7 +44,7 @@ namespace bmp
     std::uint16_t planes;            /* Number of color planes */
     std::uint16_t bits_per_pixel;    /* Number of bits per pixel */
     std::uint32_t compression;       /* Type of compression to use */
-    std::uint32_t size_image;        /* Size of image data */
+    std::uint32_t size_image;        /* Size of image data, 0 past 4 GB */
     std::int32_t x_pixels_per_meter; /* X pixels per meter */
     std::int32_t y_pixels_per_meter; /* Y pixels per meter */
     std::uint32_t clr_used;          /* Number of colors used */
@@ -39,28 +52,160 @@ namespace bmp
   };
   static_assert(sizeof(BitmapHeader) == 54, "Bitmap header size must be 54 bytes");
 
+  struct BitmapV4Extension
+  {
+    /* Fields following BITMAPINFOHEADER in a BITMAPV4HEADER */
+    std::uint32_t red_mask;       /* Red channel bit mask */
+    std::uint32_t green_mask;     /* Green channel bit mask */
+    std::uint32_t blue_mask;      /* Blue channel bit mask */
+    std::uint32_t alpha_mask;     /* Alpha channel bit mask */
+    std::uint32_t cs_type;        /* Color space type */
+    std::int32_t endpoints[9];    /* CIEXYZTRIPLE of color space endpoints */
+    std::uint32_t gamma_red;      /* Red gamma */
+    std::uint32_t gamma_green;    /* Green gamma */
+    std::uint32_t gamma_blue;     /* Blue gamma */
+  };
+  static_assert(sizeof(BitmapV4Extension) == 68, "Bitmap V4 header extension size must be 68 bytes");
+
+  /*
+   * Pixel types. Every type exposes its channel type and count, whether the
+   * last channel is (straight) alpha, and indexed channel access so kernels can
+   * be written once and unrolled per type at compile time.
+   */
+  struct Gray8
+  {
+    using channel_type = std::uint8_t;
+    static constexpr const int channels = 1;
+    static constexpr const bool has_alpha = false;
+
+    std::uint8_t v; /* Luminance value */
+
+    constexpr Gray8() noexcept : v(0) {}
+
+    explicit constexpr Gray8(std::uint8_t value) noexcept : v(value) {}
+
+    constexpr std::uint8_t &operator[](const int) noexcept { return v; }
+
+    constexpr const std::uint8_t &operator[](const int) const noexcept { return v; }
+
+    constexpr bool operator==(const Gray8 other) const noexcept { return v == other.v; }
+
+    constexpr bool operator!=(const Gray8 other) const noexcept { return not((*this) == other); }
+  };
+
+  struct Gray16
+  {
+    using channel_type = std::uint16_t;
+    static constexpr const int channels = 1;
+    static constexpr const bool has_alpha = false;
+
+    std::uint16_t v; /* Luminance value */
+
+    constexpr Gray16() noexcept : v(0) {}
+
+    explicit constexpr Gray16(std::uint16_t value) noexcept : v(value) {}
+
+    constexpr std::uint16_t &operator[](const int) noexcept { return v; }
+
+    constexpr const std::uint16_t &operator[](const int) const noexcept { return v; }
+
+    constexpr bool operator==(const Gray16 other) const noexcept { return v == other.v; }
+
+    constexpr bool operator!=(const Gray16 other) const noexcept { return not((*this) == other); }
+  };
+
+  struct RGB8
+  {
+    using channel_type = std::uint8_t;
+    static constexpr const int channels = 3;
+    static constexpr const bool has_alpha = false;
+
+    std::uint8_t r; /* Red value */
+    std::uint8_t g; /* Green value */
+    std::uint8_t b; /* Blue value */
+
+    constexpr RGB8() noexcept : r(0), g(0), b(0) {}
+
+    constexpr RGB8(std::uint8_t red, std::uint8_t green, std::uint8_t blue) noexcept : r(red), g(green), b(blue) {}
+
+    constexpr std::uint8_t &operator[](const int i) noexcept { return i == 0 ? r : i == 1 ? g : b; }
+
+    constexpr const std::uint8_t &operator[](const int i) const noexcept { return i == 0 ? r : i == 1 ? g : b; }
+
+    constexpr bool operator==(const RGB8 other) const noexcept
+    {
+      return r == other.r and g == other.g and b == other.b;
+    }
+
+    constexpr bool operator!=(const RGB8 other) const noexcept { return not((*this) == other); }
+  };
+
+  struct RGB16
+  {
+    using channel_type = std::uint16_t;
+    static constexpr const int channels = 3;
+    static constexpr const bool has_alpha = false;
+
+    std::uint16_t r; /* Red value */
+    std::uint16_t g; /* Green value */
+    std::uint16_t b; /* Blue value */
+
+    constexpr RGB16() noexcept : r(0), g(0), b(0) {}
+
+    constexpr RGB16(std::uint16_t red, std::uint16_t green, std::uint16_t blue) noexcept : r(red), g(green), b(blue) {}
+
+    constexpr std::uint16_t &operator[](const int i) noexcept { return i == 0 ? r : i == 1 ? g : b; }
+
+    constexpr const std::uint16_t &operator[](const int i) const noexcept { return i == 0 ? r : i == 1 ? g : b; }
+
+    constexpr bool operator==(const RGB16 other) const noexcept
+    {
+      return r == other.r and g == other.g and b == other.b;
+    }
+
+    constexpr bool operator!=(const RGB16 other) const noexcept { return not((*this) == other); }
+  };
+
   struct Pixel
   {
-    std::uint8_t r; /* Blue value */
+    using channel_type = std::uint8_t;
+    static constexpr const int channels = 4;
+    static constexpr const bool has_alpha = true;
+
+    std::uint8_t r; /* Red value */
     std::uint8_t g; /* Green value */
-    std::uint8_t b; /* Red value */
+    std::uint8_t b; /* Blue value */
+    std::uint8_t a; /* Alpha value (straight, 255 = opaque) */
 
-    constexpr Pixel() noexcept : r(0), g(0), b(0) {}
+    constexpr Pixel() noexcept : r(0), g(0), b(0), a(0) {}
 
     explicit constexpr Pixel(const std::int32_t rgb) noexcept : r((rgb >> 16) & 0xff), g((rgb >> 8) & 0xff),
-                                                                b((rgb >> 0x0) & 0xff) {}
+                                                                b((rgb >> 0x0) & 0xff), a(0xff) {}
+
+    constexpr Pixel(std::uint8_t red, std::uint8_t green, std::uint8_t blue) noexcept : r(red), g(green), b(blue), a(0xff) {}
+
+    constexpr Pixel(std::uint8_t red, std::uint8_t green, std::uint8_t blue, std::uint8_t alpha) noexcept
+        : r(red), g(green), b(blue), a(alpha) {}
+
+    constexpr std::uint8_t &operator[](const int i) noexcept { return i == 0 ? r : i == 1 ? g : i == 2 ? b : a; }
 
-    constexpr Pixel(std::uint8_t red, std::uint8_t green, std::uint8_t blue) noexcept : r(red), g(green), b(blue) {}
+    constexpr const std::uint8_t &operator[](const int i) const noexcept { return i == 0 ? r : i == 1 ? g : i == 2 ? b : a; }
 
     constexpr bool operator==(const Pixel other) const noexcept
     {
-      return r == other.r and g == other.g and b == other.b;
+      return r == other.r and g == other.g and b == other.b and a == other.a;
     }
 
     constexpr bool operator!=(const Pixel other) const noexcept { return not((*this) == other); }
   };
 
-  static_assert(sizeof(Pixel) == 3, "Bitmap Pixel size must be 3 bytes");
+  using RGBA8 = Pixel;
+
+  static_assert(sizeof(Gray8) == 1, "Gray8 size must be 1 byte");
+  static_assert(sizeof(Gray16) == 2, "Gray16 size must be 2 bytes");
+  static_assert(sizeof(RGB8) == 3, "RGB8 size must be 3 bytes");
+  static_assert(sizeof(RGB16) == 6, "RGB16 size must be 6 bytes");
+  static_assert(sizeof(Pixel) == 4, "Bitmap Pixel size must be 4 bytes");
 #pragma pack(pop)
 
   static constexpr const Pixel Aqua{std::uint8_t(0), std::uint8_t(255), std::uint8_t(255)};
@@ -97,6 +242,7 @@ namespace bmp
   static constexpr const Pixel White{std::uint8_t(255), std::uint8_t(255), std::uint8_t(255)};
   static constexpr const Pixel Wheat{std::uint8_t(245), std::uint8_t(222), std::uint8_t(179)};
   static constexpr const Pixel Yellow{std::uint8_t(255), std::uint8_t(255), std::uint8_t(0)};
+  static constexpr const Pixel Transparent{std::uint8_t(0), std::uint8_t(0), std::uint8_t(0), std::uint8_t(0)};
 
   class Exception : public std::runtime_error
   {
@@ -104,18 +250,430 @@ namespace bmp
     explicit Exception(const std::string &message) : std::runtime_error(message) {}
   };
 
-  class Bitmap
+  /**
+   *	Widens a channel value to the 16 bit range
+   */
+  template <class T>
+  [[nodiscard]] constexpr std::uint32_t channel_to_16(const T value) noexcept
+  {
+    if constexpr (sizeof(T) == 1)
+      return value * 257u;
+    else
+      return value;
+  }
+
+  /**
+   *	Narrows a 16 bit range value to a channel value
+   */
+  template <class T>
+  [[nodiscard]] constexpr T channel_from_16(const std::uint32_t value) noexcept
+  {
+    if constexpr (sizeof(T) == 1)
+      return static_cast<T>((value * 255u + 32767u) / 65535u);
+    else
+      return static_cast<T>(value);
+  }
+
+  /**
+   *	Converts a pixel to another pixel type. Channels are rescaled to the target
+   *	depth, gray is replicated to RGB, RGB is reduced to BT.601 luminance and
+   *	alpha is flattened over black when the target has no alpha channel.
+   */
+  template <class To, class From>
+  [[nodiscard]] constexpr To convert_pixel(const From &from) noexcept
+  {
+    if constexpr (std::is_same_v<To, From>)
+      return from;
+    else
+    {
+      std::uint32_t c[4] = {};
+      for (int i = 0; i < 3; ++i)
+        c[i] = channel_to_16(from[From::channels >= 3 ? i : 0]);
+      c[3] = From::has_alpha ? channel_to_16(from[3]) : 65535u;
+
+      if constexpr (!To::has_alpha)
+      {
+        for (int i = 0; i < 3; ++i)
+          c[i] = (c[i] * c[3] + 32767u) / 65535u;
+      }
+
+      To to;
+      if constexpr (To::channels == 1)
+        to[0] = channel_from_16<typename To::channel_type>((299u * c[0] + 587u * c[1] + 114u * c[2] + 500u) / 1000u);
+      else
+      {
+        for (int i = 0; i < To::channels; ++i)
+          to[i] = channel_from_16<typename To::channel_type>(c[i]);
+      }
+      return to;
+    }
+  }
+
+  enum class FileFormat
+  {
+    BMP, /* Windows bitmap: 8 bpp gray palette, 24 bpp and 32 bpp */
+    PNM  /* Netpbm binary graymap/pixmap (P5/P6), 8 or 16 bits per channel */
+  };
+
+  /**
+   *	Layout of an image file as reported by bmp::probe
+   */
+  struct ImageInfo
+  {
+    FileFormat format;
+    std::int32_t width;
+    std::int32_t height;
+    int channels;  /* 1 gray, 3 rgb, 4 rgba */
+    int bit_depth; /* Bits per channel, 8 or 16 */
+  };
+
+  namespace detail
+  {
+    /**
+     *	Extracts an 8 bit channel from a 32 bpp pixel given its bit mask
+     */
+    class ChannelMask
+    {
+    public:
+      explicit ChannelMask(const std::uint32_t mask) noexcept : m_mask(mask), m_shift(0), m_max(0)
+      {
+        if (mask == 0)
+          return;
+        while (!((mask >> m_shift) & 1))
+          ++m_shift;
+        m_max = mask >> m_shift;
+      }
+
+      std::uint8_t operator()(const std::uint32_t value) const noexcept
+      {
+        if (m_max == 0)
+          return 0xff; // Missing channel (alpha only) is opaque
+        const std::uint32_t channel = (value & m_mask) >> m_shift;
+        // 64 bit, as masks may be up to 32 bits wide
+        return static_cast<std::uint8_t>(m_max == 0xff ? channel : static_cast<std::uint64_t>(channel) * 0xff / m_max);
+      }
+
+    private:
+      std::uint32_t m_mask;
+      std::uint32_t m_shift;
+      std::uint32_t m_max;
+    };
+
+    struct BmpLayout
+    {
+      BitmapHeader header;
+      std::uint32_t masks[4];   /* 32 bpp channel masks (r, g, b, a) */
+      std::vector<RGB8> palette; /* 8 bpp color table */
+      bool gray_palette;
+    };
+
+    struct PnmLayout
+    {
+      char kind; /* '5' graymap, '6' pixmap */
+      std::int32_t width;
+      std::int32_t height;
+      std::uint32_t max_value;
+    };
+
+    /**
+     *	Reads the headers of a bitmap, leaving the stream at the pixel data
+     *   @throws bmp::Exception on unsupported layouts
+     */
+    inline BmpLayout read_bmp_layout(std::istream &is, const std::string &filename)
+    {
+      BmpLayout layout{};
+      is.read(reinterpret_cast<char *>(&layout.header), sizeof(BitmapHeader));
+      const BitmapHeader &header = layout.header;
+
+      if (!is || header.magic != BITMAP_BUFFER_MAGIC)
+        throw Exception("Bitmap::Load(\"" + filename + "\"): Unrecognized file format.");
+
+      if (header.bits_per_pixel != 8 && header.bits_per_pixel != 24 && header.bits_per_pixel != 32)
+        throw Exception("Bitmap::Load(\"" + filename + "\"): Only 8, 24 and 32 bits per pixel bitmaps supported.");
+
+      if (header.compression != BITMAP_BI_RGB &&
+          !(header.compression == BITMAP_BI_BITFIELDS && header.bits_per_pixel == 32))
+        throw Exception("Bitmap::Load(\"" + filename + "\"): Compressed bitmaps are not supported.");
+
+      if (header.width <= 0 || header.height <= 0)
+        throw Exception("Bitmap::Load(\"" + filename + "\"): Only bottom-up bitmaps supported.");
+
+      // Channel masks of 32 bpp pixels (BI_RGB stores BGRX/BGRA)
+      layout.masks[0] = 0x00FF0000;
+      layout.masks[1] = 0x0000FF00;
+      layout.masks[2] = 0x000000FF;
+      layout.masks[3] = 0xFF000000;
+      if (header.compression == BITMAP_BI_BITFIELDS)
+      {
+        // Masks directly follow the 40 byte info header; alpha only from V3 headers on
+        is.read(reinterpret_cast<char *>(layout.masks), header.size >= 56 ? 16 : 12);
+        if (header.size < 56)
+          layout.masks[3] = 0;
+      }
+
+      if (header.bits_per_pixel == 8)
+      {
+        if (header.clr_used > 256)
+          throw Exception("Bitmap::Load(\"" + filename + "\"): Invalid color table size.");
+
+        const std::uint32_t colors = header.clr_used ? header.clr_used : 256;
+        std::vector<std::uint8_t> table(static_cast<std::size_t>(colors) * 4);
+        is.seekg(14 + static_cast<std::streamoff>(header.size), std::ios::beg);
+        if (!is.read(reinterpret_cast<char *>(table.data()), table.size()))
+          throw Exception("Bitmap::Load(\"" + filename + "\"): Failed to read color table.");
+
+        layout.palette.resize(256);
+        layout.gray_palette = true;
+        for (std::uint32_t i = 0; i < colors; ++i)
+        {
+          layout.palette[i] = RGB8(table[i * 4 + 2], table[i * 4 + 1], table[i * 4]);
+          layout.gray_palette &= table[i * 4] == table[i * 4 + 1] && table[i * 4 + 1] == table[i * 4 + 2];
+        }
+      }
+
+      is.seekg(header.offset_bits, std::ios::beg);
+      return layout;
+    }
+
+    /**
+     *	Skips whitespace and comments of a netpbm header
+     */
+    inline void skip_pnm_space(std::istream &is)
+    {
+      while (is)
+      {
+        const int c = is.peek();
+        if (c == '#')
+        {
+          while (is && is.get() != '\n')
+            ;
+        }
+        else if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+          is.get();
+        else
+          break;
+      }
+    }
+
+    /**
+     *	Reads the header of a binary netpbm file, leaving the stream at the pixel data
+     *   @throws bmp::Exception on unsupported layouts
+     */
+    inline PnmLayout read_pnm_layout(std::istream &is, const std::string &filename)
+    {
+      PnmLayout layout{};
+      char magic[2] = {};
+      is.read(magic, 2);
+      if (!is || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6'))
+        throw Exception("Bitmap::Load(\"" + filename + "\"): Only binary PGM/PPM (P5/P6) supported.");
+      layout.kind = magic[1];
+
+      skip_pnm_space(is);
+      is >> layout.width;
+      skip_pnm_space(is);
+      is >> layout.height;
+      skip_pnm_space(is);
+      is >> layout.max_value;
+      is.get(); // Single whitespace before the raster
+
+      if (!is || layout.width <= 0 || layout.height <= 0 || layout.max_value == 0 || layout.max_value > 65535)
+        throw Exception("Bitmap::Load(\"" + filename + "\"): Invalid netpbm header.");
+      return layout;
+    }
+
+    /**
+     *	Returns PNM for .pgm/.ppm/.pnm file names, BMP otherwise
+     */
+    inline FileFormat format_from_extension(const std::string &filename)
+    {
+      const std::size_t dot = filename.find_last_of('.');
+      std::string extension = dot == std::string::npos ? "" : filename.substr(dot + 1);
+      std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c)
+                     { return static_cast<char>(std::tolower(c)); });
+      return (extension == "pgm" || extension == "ppm" || extension == "pnm") ? FileFormat::PNM : FileFormat::BMP;
+    }
+  }
+
+  /**
+   *	Reads only the header of an image stream to find its native pixel layout
+   *   @throws bmp::Exception on error
+   */
+  inline ImageInfo probe(std::istream &is, const std::string &filename)
+  {
+    ImageInfo info{};
+    if (is.peek() == 'P')
+    {
+      const detail::PnmLayout layout = detail::read_pnm_layout(is, filename);
+      info.format = FileFormat::PNM;
+      info.width = layout.width;
+      info.height = layout.height;
+      info.channels = layout.kind == '5' ? 1 : 3;
+      info.bit_depth = layout.max_value > 255 ? 16 : 8;
+    }
+    else
+    {
+      const detail::BmpLayout layout = detail::read_bmp_layout(is, filename);
+      info.format = FileFormat::BMP;
+      info.width = layout.header.width;
+      info.height = layout.header.height;
+      info.channels = layout.header.bits_per_pixel == 32 ? 4 : layout.header.bits_per_pixel == 24 ? 3
+                                                           : layout.gray_palette                    ? 1
+                                                                                                    : 3;
+      info.bit_depth = 8;
+    }
+    return info;
+  }
+
+  /**
+   *	Reads only the header of an image file to find its native pixel layout
+   *   @throws bmp::Exception on error
+   */
+  inline ImageInfo probe(const std::string &filename)
+  {
+    std::ifstream ifs{filename, std::ios::binary};
+    if (!ifs)
+      throw Exception("Bitmap::Load(\"" + filename + "\"): Failed to load bitmap pixels from file.");
+
+    return probe(ifs, filename);
+  }
+
+  /**
+   *	Memory of bitmap pixels and file I/O buffers comes from this resource unless a
+   *	bitmap is given its own; nullptr (the default) means operator new. Set it once,
+   *	before creating bitmaps, e.g. to a huge page allocator or a recycling pool.
+   */
+  inline std::pmr::memory_resource *&default_pixel_resource() noexcept
+  {
+    static std::pmr::memory_resource *resource = nullptr;
+    return resource;
+  }
+
+  /**
+   *	BMP files larger than this many bytes are written in the large-file variant,
+   *	with 0 in the 32 bit file_size and size_image fields. Defaults to the largest
+   *	size those fields hold; lowering it lets tests write the variant cheaply.
+   */
+  inline std::uint64_t &large_file_threshold() noexcept
+  {
+    static std::uint64_t threshold = 0xFFFFFFFFu;
+    return threshold;
+  }
+
+  /**
+   *	Allocator of bitmap pixels, drawing from a memory resource (see
+   *	default_pixel_resource). Bitmaps constructed with bmp::uninitialized skip the
+   *	zero fill, so their pages are first touched by whoever writes the pixels (the
+   *	render workers, which places them on the workers' NUMA nodes). The mode stays
+   *	with the bitmap, including pixels added by later resizes.
+   */
+  template <class T>
+  struct PixelAllocator
+  {
+    using value_type = T;
+
+    template <class U>
+    struct rebind
+    {
+      using other = PixelAllocator<U>;
+    };
+
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    bool initialize = true;
+    std::pmr::memory_resource *resource = default_pixel_resource();
+
+    PixelAllocator() noexcept = default;
+
+    explicit PixelAllocator(const bool initialize, std::pmr::memory_resource *resource = default_pixel_resource()) noexcept
+        : initialize(initialize), resource(resource) {}
+
+    template <class U>
+    PixelAllocator(const PixelAllocator<U> &other) noexcept : initialize(other.initialize), resource(other.resource) {}
+
+    [[nodiscard]] T *allocate(const std::size_t n)
+    {
+      if (resource)
+        return static_cast<T *>(resource->allocate(n * sizeof(T), alignof(T)));
+
+      return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *p, const std::size_t n) noexcept
+    {
+      if (resource)
+        resource->deallocate(p, n * sizeof(T), alignof(T));
+      else
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <class U>
+    void construct(U *p)
+    {
+      if (initialize)
+        ::new (static_cast<void *>(p)) U();
+    }
+
+    template <class U, class... Args>
+    void construct(U *p, Args &&...args)
+    {
+      ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+    }
+
+    template <class U>
+    bool operator==(const PixelAllocator<U> &other) const noexcept { return resource == other.resource; }
+
+    template <class U>
+    bool operator!=(const PixelAllocator<U> &other) const noexcept { return resource != other.resource; }
+  };
+
+  struct Uninitialized
+  {
+  };
+
+  static constexpr const Uninitialized uninitialized{};
+
+  // Byte buffer allocated like bitmap pixels
+  using Buffer = std::vector<std::uint8_t, PixelAllocator<std::uint8_t>>;
+
+  /**
+   *	Non-owning view of pixels stored row by row (top row first) with rows
+   *	stride bytes apart, e.g. a Bitmap or a caller's memory buffer
+   */
+  template <class P = Pixel>
+  struct BasicView
+  {
+    using pixel_type = P;
+
+    const std::uint8_t *data;
+    std::int32_t width;
+    std::int32_t height;
+    std::size_t stride;
+
+    [[nodiscard]] const P *row(const std::int32_t y) const noexcept
+    {
+      return reinterpret_cast<const P *>(data + stride * static_cast<std::size_t>(y));
+    }
+
+    [[nodiscard]] const P &operator()(const std::int32_t x, const std::int32_t y) const noexcept { return row(y)[x]; }
+  };
+
+  template <class P = Pixel>
+  class BasicBitmap
   {
   public:
-    std::vector<Pixel> m_pixels;
-    Bitmap() noexcept
+    using Pixels = std::vector<P, PixelAllocator<P>>;
+
+    Pixels m_pixels;
+    BasicBitmap() noexcept
         : m_pixels(),
           m_width(0),
           m_height(0)
     {
     }
 
-    explicit Bitmap(const std::string &filename)
+    explicit BasicBitmap(const std::string &filename)
         : m_pixels(),
           m_width(0),
           m_height(0)
@@ -123,7 +681,7 @@ namespace bmp
       this->load(filename);
     }
 
-    Bitmap(const std::int32_t width, const std::int32_t height)
+    BasicBitmap(const std::int32_t width, const std::int32_t height)
         : m_pixels(static_cast<std::size_t>(width) * static_cast<std::size_t>(height)),
           m_width(width),
           m_height(height)
@@ -132,9 +690,30 @@ namespace bmp
         throw Exception("Bitmap width and height must be > 0");
     }
 
-    Bitmap(const Bitmap &other) = default; // Copy Constructor
+    BasicBitmap(const std::int32_t width, const std::int32_t height, Uninitialized, // Leaves pixels to be written
+                std::pmr::memory_resource *resource = default_pixel_resource())
+        : m_pixels(static_cast<std::size_t>(width) * static_cast<std::size_t>(height), PixelAllocator<P>(false, resource)),
+          m_width(width),
+          m_height(height)
+    {
+      if (width == 0 || height == 0)
+        throw Exception("Bitmap width and height must be > 0");
+    }
+
+    explicit BasicBitmap(const BasicView<P> &view) // Copies the viewed pixels
+        : BasicBitmap(view.width, view.height, uninitialized)
+    {
+      for (std::int32_t y = 0; y < m_height; ++y)
+        std::memcpy(m_pixels.data() + static_cast<std::size_t>(m_width) * y, view.row(y), sizeof(P) * m_width);
+    }
+
+    BasicBitmap(const BasicBitmap &other) = default; // Copy Constructor
+
+    BasicBitmap(BasicBitmap &&other) noexcept = default; // Move Constructor
 
-    virtual ~Bitmap() noexcept
+    BasicBitmap &operator=(BasicBitmap &&other) noexcept = default; // Move assignment operator
+
+    virtual ~BasicBitmap() noexcept
     {
       m_pixels.clear();
     }
@@ -143,7 +722,7 @@ namespace bmp
     /**
      * Draw a line form (x1, y1) to (x2, y2)
      */
-    void draw_line(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, const Pixel color)
+    void draw_line(std::int32_t x1, std::int32_t y1, std::int32_t x2, std::int32_t y2, const P color)
     {
       const std::int32_t dx = std::abs(x2 - x1);
       const std::int32_t dy = std::abs(y2 - y1);
@@ -177,7 +756,7 @@ namespace bmp
      * Draw a filled rect
      */
     void fill_rect(const std::int32_t x, const std::int32_t y, const std::int32_t width, const std::int32_t height,
-                   const Pixel color)
+                   const P color)
     {
       if (!in_bounds(x, y) || !in_bounds(x + width, y + height))
         throw Exception(
@@ -197,7 +776,7 @@ namespace bmp
      * Draw a rect (not filled, border only)
      */
     void draw_rect(const std::int32_t x, const std::int32_t y, const std::int32_t width, const std::int32_t height,
-                   const Pixel color)
+                   const P color)
     {
       if (!in_bounds(x, y) || !in_bounds(x + width, y + height))
         throw Exception(
@@ -222,7 +801,7 @@ namespace bmp
     void draw_triangle(const std::int32_t x1, const std::int32_t y1,
                        const std::int32_t x2, const std::int32_t y2,
                        const std::int32_t x3, const std::int32_t y3,
-                       const Pixel color)
+                       const P color)
     {
       if (!in_bounds(x1, y1) || !in_bounds(x2, y2) || !in_bounds(x3, y3))
         throw Exception("Bitmap::draw_triangle: One or more points are out of bounds");
@@ -238,7 +817,7 @@ namespace bmp
     void fill_triangle(const std::int32_t x1, const std::int32_t y1,
                        const std::int32_t x2, const std::int32_t y2,
                        const std::int32_t x3, const std::int32_t y3,
-                       const Pixel color)
+                       const P color)
     {
       if (!in_bounds(x1, y1) || !in_bounds(x2, y2) || !in_bounds(x3, y3))
         throw Exception("Bitmap::fill_triangle: One or more points are out of bounds");
@@ -299,7 +878,7 @@ namespace bmp
      * Draw a circle with a given center and radius
      */
     void draw_circle(const std::int32_t center_x, const std::int32_t center_y, const std::int32_t radius,
-                     const Pixel color)
+                     const P color)
     {
       if (!in_bounds(center_x - radius, center_y - radius) || !in_bounds(center_x + radius, center_y + radius))
         throw Exception("Bitmap::draw_circle: Circle exceeds bounds");
@@ -340,7 +919,7 @@ namespace bmp
      * Fill a circle with a given center and radius
      */
     void fill_circle(const std::int32_t center_x, const std::int32_t center_y, const std::int32_t radius,
-                     const Pixel color)
+                     const P color)
     {
       if (!in_bounds(center_x - radius, center_y - radius) || !in_bounds(center_x + radius, center_y + radius))
         throw Exception("Bitmap::fill_circle: Circle exceeds bounds");
@@ -384,7 +963,7 @@ namespace bmp
     /**
      *	Get pixel at position x,y
      */
-    Pixel &get(const std::int32_t x, const std::int32_t y)
+    P &get(const std::int32_t x, const std::int32_t y)
     {
       if (!in_bounds(x, y))
         throw Exception("Bitmap::Get(" + std::to_string(x) + ", " + std::to_string(y) + "): x,y out of bounds");
@@ -394,7 +973,7 @@ namespace bmp
     /**
      *	Get const pixel at position x,y
      */
-    const Pixel &get(const std::int32_t x, const std::int32_t y) const
+    const P &get(const std::int32_t x, const std::int32_t y) const
     {
       if (!in_bounds(x, y))
         throw Exception("Bitmap::Get(" + std::to_string(x) + ", " + std::to_string(y) + "): x,y out of bounds");
@@ -411,37 +990,46 @@ namespace bmp
      */
     std::int32_t height() const noexcept { return m_height; }
 
+    /**
+     *	Returns a view of the Bitmap pixels
+     */
+    BasicView<P> view() const noexcept
+    {
+      return {reinterpret_cast<const std::uint8_t *>(m_pixels.data()), m_width, m_height,
+              sizeof(P) * static_cast<std::size_t>(m_width)};
+    }
+
     /**
      *	Clears Bitmap pixels with an rgb color
      */
-    void clear(const Pixel pixel = Black)
+    void clear(const P pixel = P())
     {
       std::fill(m_pixels.begin(), m_pixels.end(), pixel);
     }
 
   public: /* Operators */
-    const Pixel &operator[](const std::size_t i) const { return m_pixels[i]; }
+    const P &operator[](const std::size_t i) const { return m_pixels[i]; }
 
-    Pixel &operator[](const std::size_t i) { return m_pixels[i]; }
+    P &operator[](const std::size_t i) { return m_pixels[i]; }
 
     bool operator!() const noexcept { return (m_pixels.empty()) || (m_width == 0) || (m_height == 0); }
 
     explicit operator bool() const noexcept { return !(*this); }
 
-    bool operator==(const Bitmap &image) const
+    bool operator==(const BasicBitmap &image) const
     {
       if (this != &image)
       {
         return (m_width == image.m_width) &&
                (m_height == image.m_height) &&
-               (std::memcmp(m_pixels.data(), image.m_pixels.data(), sizeof(Pixel) * m_pixels.size()) == 0);
+               (std::memcmp(m_pixels.data(), image.m_pixels.data(), sizeof(P) * m_pixels.size()) == 0);
       }
       return true;
     }
 
-    bool operator!=(const Bitmap &image) const { return !(*this == image); }
+    bool operator!=(const BasicBitmap &image) const { return !(*this == image); }
 
-    Bitmap &operator=(const Bitmap &image) // Move assignment operator
+    BasicBitmap &operator=(const BasicBitmap &image) // Copy assignment operator
     {
       if (this != &image)
       {
@@ -453,28 +1041,28 @@ namespace bmp
     }
 
   public: /** foreach iterators access */
-    std::vector<Pixel>::iterator begin() noexcept { return m_pixels.begin(); }
+    typename Pixels::iterator begin() noexcept { return m_pixels.begin(); }
 
-    std::vector<Pixel>::iterator end() noexcept { return m_pixels.end(); }
+    typename Pixels::iterator end() noexcept { return m_pixels.end(); }
 
-    std::vector<Pixel>::const_iterator cbegin() const noexcept { return m_pixels.cbegin(); }
+    typename Pixels::const_iterator cbegin() const noexcept { return m_pixels.cbegin(); }
 
-    std::vector<Pixel>::const_iterator cend() const noexcept { return m_pixels.cend(); }
+    typename Pixels::const_iterator cend() const noexcept { return m_pixels.cend(); }
 
-    std::vector<Pixel>::reverse_iterator rbegin() noexcept { return m_pixels.rbegin(); }
+    typename Pixels::reverse_iterator rbegin() noexcept { return m_pixels.rbegin(); }
 
-    std::vector<Pixel>::reverse_iterator rend() noexcept { return m_pixels.rend(); }
+    typename Pixels::reverse_iterator rend() noexcept { return m_pixels.rend(); }
 
-    std::vector<Pixel>::const_reverse_iterator crbegin() const noexcept { return m_pixels.crbegin(); }
+    typename Pixels::const_reverse_iterator crbegin() const noexcept { return m_pixels.crbegin(); }
 
-    std::vector<Pixel>::const_reverse_iterator crend() const noexcept { return m_pixels.crend(); }
+    typename Pixels::const_reverse_iterator crend() const noexcept { return m_pixels.crend(); }
 
   public: /* Modifiers */
     /**
      *	Sets rgb color to pixel at position x,y
      *   @throws bmp::Exception on error
      */
-    void set(const std::int32_t x, const std::int32_t y, const Pixel color)
+    void set(const std::int32_t x, const std::int32_t y, const P color)
     {
       if (!in_bounds(x, y))
       {
@@ -484,124 +1072,338 @@ namespace bmp
     }
 
     /**
-     *	Saves Bitmap pixels into a file
+     *	Saves Bitmap pixels into a file. The format follows the extension
+     *	(.pgm/.ppm/.pnm write binary netpbm, anything else BMP) and the depth
+     *	follows the pixel type: gray writes an 8 bpp gray palette, RGB 24 bpp and
+     *	RGBA 32 bpp with a BITMAPV4HEADER. BMP has no 16 bit channels, so 16 bit
+     *	pixels are narrowed there; netpbm has no alpha, so it is flattened.
+     *	BMP files past 4 GB store 0 in the 32 bit file_size and size_image
+     *	fields; load() takes every size from width, height and depth.
      *   @throws bmp::Exception on error
      */
-    void save(const std::string &filename)
+    void save(const std::string &filename) const
+    {
+      // Save bitmap to output file
+      if (std::ofstream ofs{filename, std::ios::binary})
+      {
+        save(ofs, detail::format_from_extension(filename));
+
+        // Close File
+        ofs.close();
+      }
+      else
+        throw Exception("Bitmap::Save(\"" + filename + "\"): Failed to save pixels to file.");
+    }
+
+    /**
+     *	Writes Bitmap pixels to a stream in the given file format
+     *   @throws bmp::Exception on error
+     */
+    void save(std::ostream &os, const FileFormat format) const
+    {
+      if (format == FileFormat::PNM)
+        save_pnm(os);
+      else
+        save_bmp(os);
+
+      if (!os)
+        throw Exception("Bitmap::Save(): Failed to write pixels to stream.");
+    }
+
+    /**
+     *	Loads Bitmap from file (BMP 8/24/32 bpp or binary PGM/PPM), converting
+     *	from the file's native layout to the pixel type P
+     *   @throws bmp::Exception on error
+     */
+    void load(const std::string &filename)
+    {
+      if (std::ifstream ifs{filename, std::ios::binary})
+      {
+        load(ifs, filename);
+
+        // Close file
+        ifs.close();
+      }
+      else
+        throw Exception("Bitmap::Load(\"" + filename + "\"): Failed to load bitmap pixels from file.");
+    }
+
+    /**
+     *	Loads Bitmap from a seekable stream holding a whole image file;
+     *	filename only names the source in error messages
+     *   @throws bmp::Exception on error
+     */
+    void load(std::istream &is, const std::string &filename)
+    {
+      m_pixels.clear();
+
+      if (is.peek() == 'P')
+        load_pnm(is, filename);
+      else
+        load_bmp(is, filename);
+    }
+
+    /**
+     *	Returns a copy of the image with every pixel converted to Q
+     */
+    template <class Q>
+    BasicBitmap<Q> convert() const
+    {
+      BasicBitmap<Q> result(m_width, m_height, uninitialized);
+      std::transform(m_pixels.cbegin(), m_pixels.cend(), result.m_pixels.begin(), [](const P &pixel)
+                     { return convert_pixel<Q>(pixel); });
+      return result;
+    }
+
+    /**
+     *	Headers (and gray palette) of a BMP file of this pixel type; the
+     *	bottom-up rows of bmp_row_size() bytes follow them
+     */
+    static Buffer bmp_header(const std::int32_t width, const std::int32_t height)
     {
-      // Calculate row and bitmap size
-      const std::int32_t row_size = m_width * 3 + m_width % 4;
-      const std::uint32_t bitmap_size = row_size * m_height;
+      constexpr const std::uint16_t bits_per_pixel = sizeof(StoredBmp) * 8;
+
+      // Calculate row, header and bitmap size
+      const std::uint64_t bitmap_size = bmp_row_size(width) * static_cast<std::uint64_t>(height);
+      const std::uint32_t header_size = sizeof(BitmapHeader) + (P::has_alpha ? sizeof(BitmapV4Extension) : 0);
+      const std::uint32_t palette_size = P::channels == 1 ? 256 * 4 : 0;
+
+      // Large file variant: sizes past the 32 bit fields are written as 0
+      const bool large = bitmap_size + header_size + palette_size > large_file_threshold();
 
       // Construct bitmap header
       BitmapHeader header{};
       /* Bitmap file header structure */
       header.magic = BITMAP_BUFFER_MAGIC;
-      header.file_size = bitmap_size + sizeof(BitmapHeader);
+      header.file_size = large ? 0 : static_cast<std::uint32_t>(bitmap_size + header_size + palette_size);
       header.reserved1 = 0;
       header.reserved2 = 0;
-      header.offset_bits = sizeof(BitmapHeader);
+      header.offset_bits = header_size + palette_size;
       /* Bitmap file info structure */
-      header.size = 40;
-      header.width = m_width;
-      header.height = m_height;
+      header.size = header_size - 14;
+      header.width = width;
+      header.height = height;
       header.planes = 1;
-      header.bits_per_pixel = sizeof(Pixel) * 8; // 24bpp
-      header.compression = 0;
-      header.size_image = bitmap_size;
+      header.bits_per_pixel = bits_per_pixel;
+      header.compression = P::has_alpha ? BITMAP_BI_BITFIELDS : BITMAP_BI_RGB;
+      header.size_image = large ? 0 : static_cast<std::uint32_t>(bitmap_size);
       header.x_pixels_per_meter = 0;
       header.y_pixels_per_meter = 0;
-      header.clr_used = 0;
+      header.clr_used = P::channels == 1 ? 256 : 0;
       header.clr_important = 0;
 
-      // Save bitmap to output file
-      if (std::ofstream ofs{filename, std::ios::binary})
+      Buffer result(header_size + palette_size);
+      std::memcpy(result.data(), &header, sizeof(BitmapHeader));
+      if constexpr (P::has_alpha)
       {
-        // Write Header
-        ofs.write(reinterpret_cast<const char *>(&header), sizeof(BitmapHeader));
-
-        // Write Pixels
-        std::vector<std::uint8_t> line(row_size);
-        for (std::int32_t y = m_height - 1; y >= 0; --y)
+        BitmapV4Extension extension{};
+        extension.red_mask = 0x00FF0000;
+        extension.green_mask = 0x0000FF00;
+        extension.blue_mask = 0x000000FF;
+        extension.alpha_mask = 0xFF000000;
+        extension.cs_type = BITMAP_LCS_SRGB;
+        std::memcpy(result.data() + sizeof(BitmapHeader), &extension, sizeof(BitmapV4Extension));
+      }
+      if constexpr (P::channels == 1)
+      {
+        for (std::uint32_t i = 0; i < 256; ++i)
         {
-          std::size_t i = 0;
-          for (std::int32_t x = 0; x < m_width; ++x)
-          {
-            const Pixel &color = m_pixels[IX(x, y)];
-            line[i++] = color.b;
-            line[i++] = color.g;
-            line[i++] = color.r;
-          }
-          ofs.write(reinterpret_cast<const char *>(line.data()), line.size());
+          const std::uint8_t entry[4] = {std::uint8_t(i), std::uint8_t(i), std::uint8_t(i), 0};
+          std::memcpy(result.data() + header_size + i * 4, entry, sizeof(entry));
         }
-
-        // Close File
-        ofs.close();
       }
-      else
-        throw Exception("Bitmap::Save(\"" + filename + "\"): Failed to save pixels to file.");
+      return result;
     }
 
     /**
-     *	Loads Bitmap from file
-     *   @throws bmp::Exception on error
+     *	Bytes of one stored BMP row, padded to 4 bytes
      */
-    void load(const std::string &filename)
+    static std::uint64_t bmp_row_size(const std::int32_t width)
     {
-      m_pixels.clear();
+      return ((static_cast<std::uint64_t>(width) * sizeof(StoredBmp) * 8 + 31) / 32) * 4;
+    }
 
-      if (std::ifstream ifs{filename, std::ios::binary})
+    /**
+     *	Stores width pixels as one BMP row into line (bmp_row_size() bytes)
+     */
+    static void encode_bmp_row(const P *pixels, const std::int32_t width, std::uint8_t *line)
+    {
+      std::size_t i = 0;
+      for (std::int32_t x = 0; x < width; ++x)
       {
-        // Read Header
-        std::unique_ptr<BitmapHeader> header(new BitmapHeader());
-        ifs.read(reinterpret_cast<char *>(header.get()), sizeof(BitmapHeader));
-
-        // Check if Bitmap file is valid
-        if (header->magic != BITMAP_BUFFER_MAGIC)
+        const StoredBmp color = convert_pixel<StoredBmp>(pixels[x]);
+        if constexpr (StoredBmp::channels == 1)
+          line[i++] = color.v;
+        else
         {
-          ifs.close();
-          throw Exception("Bitmap::Load(\"" + filename + "\"): Unrecognized file format.");
-        }
-        // Check if the Bitmap file has 24 bits per pixel (for now supporting only 24bpp bitmaps)
-        if (header->bits_per_pixel != 24)
-        {
-          ifs.close();
-          throw Exception("Bitmap::Load(\"" + filename + "\"): Only 24 bits per pixel bitmaps supported.");
+          line[i++] = color.b;
+          line[i++] = color.g;
+          line[i++] = color.r;
+          if constexpr (StoredBmp::has_alpha)
+            line[i++] = color.a;
         }
+      }
+      // Padding
+      while (i % 4)
+        line[i++] = 0;
+    }
 
-        auto offset = header->offset_bits - 54;
+  private: /* File formats */
+    // Gray is stored with a gray palette, 16 bit channels are narrowed
+    using StoredBmp = std::conditional_t<P::channels == 1, Gray8, std::conditional_t<P::channels == 3, RGB8, Pixel>>;
 
-        ifs.seekg(offset, std::ios::cur);
+    void save_bmp(std::ostream &os) const
+    {
+      // Write Header
+      const Buffer header = bmp_header(m_width, m_height);
+      os.write(reinterpret_cast<const char *>(header.data()), header.size());
 
-        // Set width & height
-        m_width = header->width;
-        m_height = header->height;
+      // Write Pixels
+      Buffer line(bmp_row_size(m_width));
+      for (std::int32_t y = m_height - 1; y >= 0; --y)
+      {
+        encode_bmp_row(&m_pixels[IX(0, y)], m_width, line.data());
+        os.write(reinterpret_cast<const char *>(line.data()), line.size());
+      }
+    }
 
-        // Resize pixels size
-        m_pixels.resize(static_cast<std::size_t>(m_width) * static_cast<std::size_t>(m_height), Black);
+    void save_pnm(std::ostream &os) const
+    {
+      constexpr const bool wide = sizeof(typename P::channel_type) == 2;
+      using Stored = std::conditional_t<P::channels == 1,
+                                        std::conditional_t<wide, Gray16, Gray8>,
+                                        std::conditional_t<wide, RGB16, RGB8>>;
+
+      const std::string header = std::string(Stored::channels == 1 ? "P5\n" : "P6\n") +
+                                 std::to_string(m_width) + " " + std::to_string(m_height) + "\n" +
+                                 (wide ? "65535\n" : "255\n");
+      os.write(header.data(), header.size());
+
+      // Write Pixels (top-down, 16 bit samples are big-endian)
+      Buffer line(static_cast<std::size_t>(m_width) * sizeof(Stored));
+      for (std::int32_t y = 0; y < m_height; ++y)
+      {
+        std::size_t i = 0;
+        for (std::int32_t x = 0; x < m_width; ++x)
+        {
+          const Stored color = convert_pixel<Stored>(m_pixels[IX(x, y)]);
+          for (int c = 0; c < Stored::channels; ++c)
+          {
+            if constexpr (wide)
+              line[i++] = static_cast<std::uint8_t>(color[c] >> 8);
+            line[i++] = static_cast<std::uint8_t>(color[c] & 0xff);
+          }
+        }
+        os.write(reinterpret_cast<const char *>(line.data()), line.size());
+      }
+    }
 
-        // Read Bitmap pixels
-        const std::int32_t row_size = m_width * 3 + m_width % 4;
-        std::vector<std::uint8_t> line(row_size);
-        for (std::int32_t y = m_height - 1; y >= 0; --y)
+    void load_bmp(std::istream &is, const std::string &filename)
+    {
+      const detail::BmpLayout layout = detail::read_bmp_layout(is, filename);
+      const BitmapHeader &header = layout.header;
+
+      // Set width & height
+      m_width = header.width;
+      m_height = header.height;
+
+      // Resize pixels size
+      m_pixels.resize(static_cast<std::size_t>(m_width) * static_cast<std::size_t>(m_height));
+
+      // Many writers leave the reserved byte of BI_RGB pixels zeroed
+      const bool reserved_alpha = header.compression == BITMAP_BI_RGB;
+      const detail::ChannelMask r(layout.masks[0]), g(layout.masks[1]), b(layout.masks[2]),
+          a(reserved_alpha && !P::has_alpha ? 0 : layout.masks[3]);
+      std::uint8_t alpha_seen = 0;
+
+      // Read Bitmap pixels
+      const std::uint64_t row_size = ((static_cast<std::uint64_t>(m_width) * header.bits_per_pixel + 31) / 32) * 4;
+      Buffer line(row_size);
+      for (std::int32_t y = m_height - 1; y >= 0; --y)
+      {
+        is.read(reinterpret_cast<char *>(line.data()), line.size());
+        std::size_t i = 0;
+        switch (header.bits_per_pixel)
         {
-          ifs.read(reinterpret_cast<char *>(line.data()), line.size());
-          std::size_t i = 0;
+        case 8:
           for (std::int32_t x = 0; x < m_width; ++x)
           {
-            Pixel color{};
-            color.b = line[i++];
-            color.g = line[i++];
-            color.r = line[i++];
-            m_pixels[IX(x, y)] = color; // this->Set(x, y, color);
+            const RGB8 &entry = layout.palette[line[i++]];
+            m_pixels[IX(x, y)] = layout.gray_palette ? convert_pixel<P>(Gray8(entry.r)) : convert_pixel<P>(entry);
           }
+          break;
+        case 24:
+          for (std::int32_t x = 0; x < m_width; ++x, i += 3)
+            m_pixels[IX(x, y)] = convert_pixel<P>(RGB8(line[i + 2], line[i + 1], line[i]));
+          break;
+        default:
+          for (std::int32_t x = 0; x < m_width; ++x, i += 4)
+          {
+            const std::uint32_t value = line[i] | (line[i + 1] << 8) | (line[i + 2] << 16) |
+                                        (static_cast<std::uint32_t>(line[i + 3]) << 24);
+            const Pixel color(r(value), g(value), b(value), a(value));
+            alpha_seen |= color.a;
+            m_pixels[IX(x, y)] = convert_pixel<P>(color);
+          }
+          break;
         }
+      }
 
-        // Close file
-        ifs.close();
+      // An all-zero reserved byte means the image is opaque
+      if constexpr (P::has_alpha)
+      {
+        if (header.bits_per_pixel == 32 && reserved_alpha && alpha_seen == 0)
+        {
+          for (P &pixel : m_pixels)
+            pixel[P::channels - 1] = std::numeric_limits<typename P::channel_type>::max();
+        }
       }
+    }
+
+    void load_pnm(std::istream &is, const std::string &filename)
+    {
+      const detail::PnmLayout layout = detail::read_pnm_layout(is, filename);
+
+      // Set width & height
+      m_width = layout.width;
+      m_height = layout.height;
+
+      // Resize pixels size
+      m_pixels.resize(static_cast<std::size_t>(m_width) * static_cast<std::size_t>(m_height));
+
+      if (layout.kind == '5')
+        layout.max_value > 255 ? load_pnm_rows<Gray16>(is, layout) : load_pnm_rows<Gray8>(is, layout);
       else
-        throw Exception("Bitmap::Load(\"" + filename + "\"): Failed to load bitmap pixels from file.");
+        layout.max_value > 255 ? load_pnm_rows<RGB16>(is, layout) : load_pnm_rows<RGB8>(is, layout);
+    }
+
+    template <class Native>
+    void load_pnm_rows(std::istream &is, const detail::PnmLayout &layout)
+    {
+      using channel_type = typename Native::channel_type;
+      constexpr const bool wide = sizeof(channel_type) == 2;
+      constexpr const std::uint32_t max_value = std::numeric_limits<channel_type>::max();
+
+      Buffer line(static_cast<std::size_t>(m_width) * sizeof(Native));
+      for (std::int32_t y = 0; y < m_height; ++y)
+      {
+        is.read(reinterpret_cast<char *>(line.data()), line.size());
+        std::size_t i = 0;
+        for (std::int32_t x = 0; x < m_width; ++x)
+        {
+          Native color;
+          for (int c = 0; c < Native::channels; ++c)
+          {
+            std::uint32_t value = line[i++];
+            if constexpr (wide)
+              value = (value << 8) | line[i++];
+            if (layout.max_value != max_value)
+              value = std::min(value, layout.max_value) * max_value / layout.max_value;
+            color[c] = static_cast<channel_type>(value);
+          }
+          m_pixels[IX(x, y)] = convert_pixel<P>(color);
+        }
+      }
     }
 
   private: /* Utils */
@@ -625,4 +1427,10 @@ namespace bmp
     std::int32_t m_width;
     std::int32_t m_height;
   };
+
+  using Bitmap = BasicBitmap<Pixel>;
+  using GrayBitmap8 = BasicBitmap<Gray8>;
+  using GrayBitmap16 = BasicBitmap<Gray16>;
+  using RGBBitmap8 = BasicBitmap<RGB8>;
+  using RGBBitmap16 = BasicBitmap<RGB16>;
 }
\ No newline at end of file
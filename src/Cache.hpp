@@ -0,0 +1,303 @@
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#endif
+#include "Job.hpp"
+#include "SharedImage.hpp"
+
+namespace fs = std::filesystem;
+
+// 64-bit hash of data, four independent lanes of 8-byte words so it runs at
+// memory speed; not cryptographic
+inline std::uint64_t hashBytes(const void *data, std::size_t size, std::uint64_t seed = 0)
+{
+    const std::uint64_t prime = 0x9e3779b97f4a7c15ull;
+    const std::uint8_t *bytes = static_cast<const std::uint8_t *>(data);
+
+    auto mix = [](std::uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        return h ^ (h >> 33);
+    };
+
+    std::uint64_t lanes[4] = {seed, seed + prime, seed ^ 0x5bd1e995, seed - prime};
+    std::size_t i = 0;
+
+    for (; i + 32 <= size; i += 32)
+    {
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            std::uint64_t word;
+            std::memcpy(&word, bytes + i + 8 * lane, 8);
+            lanes[lane] = (lanes[lane] ^ word) * prime;
+            lanes[lane] = lanes[lane] << 31 | lanes[lane] >> 33;
+        }
+    }
+
+    std::uint64_t h = size;
+
+    for (int lane = 0; lane < 4; ++lane)
+        h = mix(h ^ lanes[lane]);
+
+    for (; i < size; ++i)
+        h = (h ^ bytes[i]) * prime;
+
+    return mix(h);
+}
+
+/*
+ * On-disk cache of rendered outputs, keyed by the input file's contents and
+ * everything that determines the pixels of the result: the inverse matrix,
+ * translation, output window, pixel format, device and filter. A hit copies
+ * the stored output without loading or rendering anything. Entries beyond
+ * the size limit are evicted least recently used first. Lifetime hit and
+ * miss counts are kept in the "stats" file of the directory.
+ */
+class ResultCache
+{
+public:
+    ResultCache(const std::string &directory, std::uint64_t limit)
+        : directory(directory), limit(limit)
+    {
+        fs::create_directories(directory);
+    }
+
+    // Only files are cached; streams, shared images and pyramids bypass the cache
+    static bool cacheable(const Job &job)
+    {
+        auto file = [](const std::string &name)
+        { return name != "-" && !affine::isSharedImage(name); };
+
+        return file(job.input) && file(job.output) && !affine::isPyramid(job.output) && !job.shards && !job.merge;
+    }
+
+    // Key of the job's result; the device must already be resolved by
+    // tuneJob, so an auto job keys the device that actually renders it
+    std::string key(const Job &job, const affine::Affine &transform, affine::PixelFormat format) const
+    {
+        std::ifstream ifs(job.input, std::ios::binary);
+
+        if (!ifs)
+            throw bmp::Exception("Failed to read " + job.input);
+
+        std::vector<char> buffer(1 << 20);
+        std::uint64_t content = 0;
+
+        while (ifs.read(buffer.data(), buffer.size()) || ifs.gcount())
+            content = hashBytes(buffer.data(), ifs.gcount(), content);
+
+        // Canonical text of the render parameters: -0 and rounding noise of
+        // equivalent step chains map to the same key
+        std::ostringstream os;
+        os << std::hex << content << std::dec << std::setprecision(12)
+           << ' ' << affine::pixelFormatName(format) << " device" << job.device << " bilinear"
+           << (job.linear ? " linear " : " ") << affine::edgeModeName(job.edge) << " border";
+
+        for (int c = 0; c < bmp::Pixel::channels; ++c)
+            os << ' ' << (int)job.border[c];
+
+        for (const auto &row : inverseMatrix(transform.matrix))
+        {
+            for (double value : row)
+                os << ' ' << (std::abs(value) < 1e-12 ? 0.0 : value);
+        }
+
+        os << ' ' << transform.x << ' ' << transform.y
+           << " roi " << job.roi.x << ',' << job.roi.y << ',' << job.roi.width << ',' << job.roi.height;
+
+        affine::PostProcess post = jobPost(job);
+
+        if (post.active())
+        {
+            os << " post";
+
+            for (const auto &row : post.matrix)
+            {
+                for (double value : row)
+                    os << ' ' << (std::abs(value) < 1e-12 ? 0.0 : value);
+            }
+
+            os << " sharpen " << post.sharpen;
+        }
+
+        std::string text = os.str(),
+                    extension = fs::path(job.output).extension().string();
+
+        char name[17];
+        std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)hashBytes(text.data(), text.size()));
+
+        return name + extension;
+    }
+
+    // Copies a cached result to output; false on a miss
+    bool fetch(const std::string &key, const std::string &output)
+    {
+        fs::path entry = fs::path(directory) / key;
+        std::error_code error;
+
+        fs::copy_file(entry, output, fs::copy_options::overwrite_existing, error);
+
+        record(!error);
+
+        if (error)
+            return false;
+
+        // Recently used entries are evicted last
+        fs::last_write_time(entry, fs::file_time_type::clock::now(), error);
+        return true;
+    }
+
+    // Stores a rendered output file, then evicts down to the size limit
+    void store(const std::string &key, const std::string &output)
+    {
+        fs::path entry = fs::path(directory) / key,
+                 temporary = temporaryName(entry);
+
+        std::error_code error;
+
+        // Renamed into place so concurrent jobs never see a partial entry
+        if (fs::copy_file(output, temporary, fs::copy_options::overwrite_existing, error))
+            fs::rename(temporary, entry, error);
+
+        if (error)
+            fs::remove(temporary, error);
+
+        evict();
+    }
+
+    std::int64_t hits = 0,
+                 misses = 0,
+                 total_hits = 0,
+                 total_misses = 0;
+
+private:
+    static fs::path temporaryName(const fs::path &path)
+    {
+        return path.string() + ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    }
+
+    // Adds the lookup to the lifetime counts. The read-modify-write holds an
+    // exclusive flock on the file, so concurrent jobs sharing the directory
+    // all count; without flock (Windows) concurrent updates may be lost
+    void record(bool hit)
+    {
+        (hit ? hits : misses) += 1;
+
+        fs::path path = fs::path(directory) / "stats";
+
+        auto parse = [this](std::istream &is)
+        {
+            std::string name;
+            std::int64_t value;
+
+            while (is >> name >> value)
+                (name == "hits" ? total_hits : total_misses) = value;
+        };
+
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (fd < 0)
+            return;
+
+        // Closing the file releases the lock
+        struct Close
+        {
+            int fd;
+            ~Close() { ::close(fd); }
+        } close_stats{fd};
+
+        if (flock(fd, LOCK_EX) < 0)
+            return;
+
+        char text[128];
+        ssize_t size = pread(fd, text, sizeof(text), 0);
+        std::istringstream is(std::string(text, std::max<ssize_t>(size, 0)));
+        parse(is);
+
+        (hit ? total_hits : total_misses) += 1;
+
+        std::string counts = "hits " + std::to_string(total_hits) + "\nmisses " + std::to_string(total_misses) + "\n";
+
+        // Failures only cost the counts, never the render
+        if (pwrite(fd, counts.data(), counts.size(), 0) != (ssize_t)counts.size() || ftruncate(fd, counts.size()) < 0)
+            return;
+#else
+        {
+            std::ifstream ifs(path);
+            parse(ifs);
+        }
+
+        (hit ? total_hits : total_misses) += 1;
+
+        fs::path temporary = temporaryName(path);
+
+        {
+            std::ofstream ofs(temporary);
+            ofs << "hits " << total_hits << "\nmisses " << total_misses << "\n";
+        }
+
+        std::error_code error;
+        fs::rename(temporary, path, error);
+#endif
+    }
+
+    void evict()
+    {
+        struct Entry
+        {
+            fs::path path;
+            fs::file_time_type used;
+            std::uint64_t size;
+        };
+
+        std::vector<Entry> entries;
+        std::uint64_t total = 0;
+        std::error_code error;
+
+        for (const auto &item : fs::directory_iterator(directory, error))
+        {
+            std::string name = item.path().filename().string();
+
+            if (!item.is_regular_file(error) || name == "stats" || name.find(".tmp") != std::string::npos)
+                continue;
+
+            Entry entry{item.path(), item.last_write_time(error), item.file_size(error)};
+            total += entry.size;
+            entries.push_back(entry);
+        }
+
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+                  { return a.used < b.used; });
+
+        for (const auto &entry : entries)
+        {
+            if (total <= limit)
+                break;
+
+            if (fs::remove(entry.path, error))
+                total -= entry.size;
+        }
+    }
+
+    std::string directory;
+    std::uint64_t limit;
+};
@@ -1,181 +1,662 @@
+#pragma once
+
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <iostream>
 #include <vector>
 #include <math.h>
+#include <cmath>
 #include <algorithm>
 #include "BitmapPlusPlus.hpp"
+#include "matrix.hpp"
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <exception>
 #include <iomanip>
+#include <memory>
 #include "OpenGL.hpp"
-
-void printProgress(const double progress)
+#include "Stats.hpp"
+#include "Progress.hpp"
+#include "ThreadPool.hpp"
+#include "Numa.hpp"
+#include "PostProcess.hpp"
+
+// Source is a bmp::BasicView or any image addressed the same way, such as SwizzledImage
+template <class Source, class P = typename Source::pixel_type>
+P samplePixel(const Source &input, int x, int y, const P &border = P())
 {
-    std::cout << "[";
-    int pos = 100 * progress;
-    for (int i = 0; i < 100; ++i)
-    {
-        if (i < pos)
-            std::cout << "=";
-        else if (i == pos)
-            std::cout << ">";
-        else
-            std::cout << " ";
-    }
-    std::cout << "] " << std::setprecision(1) << int(progress * 1000) / 10.0 << std::fixed << " %\r";
-    std::cout.flush();
+    if (x < 0 || x >= input.width || y < 0 || y >= input.height)
+        return border;
+
+    return input(x, y);
 }
 
-std::mutex mutex;
+/*
+ * Edge policies of CPURender: where the taps of samples outside the source
+ * land. ConstantEdge reads the border colour there (and fills output pixels
+ * mapped wholly outside with it); the others fold the tap back into the
+ * source, so every output pixel is sampled.
+ */
+struct ConstantEdge
+{
+    static constexpr bool constant = true;
+
+    static int index(int i, int) { return i; }
+};
+
+struct ClampEdge
+{
+    static constexpr bool constant = false;
+
+    static int index(int i, int n) { return std::min(std::max(i, 0), n - 1); }
+};
+
+struct WrapEdge
+{
+    static constexpr bool constant = false;
+
+    static int index(int i, int n)
+    {
+        int m = i % n;
+        return m < 0 ? m + n : m;
+    }
+};
+
+// Reflects about the edges, repeating the edge pixel (GL_MIRRORED_REPEAT)
+struct MirrorEdge
+{
+    static constexpr bool constant = false;
+
+    static int index(int i, int n)
+    {
+        int m = WrapEdge::index(i, 2 * n);
+        return m < n ? m : 2 * n - 1 - m;
+    }
+};
+
+/*
+ * sRGB transfer function as tables, so linear light blending costs two
+ * lookups per channel instead of two pow calls: 8-bit encoded values to
+ * 16-bit linear light, and 12-bit linear light back to 8-bit encoded values
+ * (every 8-bit value survives the round trip).
+ */
+struct SRGBTables
+{
+    std::uint16_t decode[256];
+    std::uint8_t encode[4096];
+
+    SRGBTables()
+    {
+        for (int v = 0; v < 256; ++v)
+        {
+            double c = v / 255.0,
+                   linear = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+
+            decode[v] = (std::uint16_t)(linear * 65535 + 0.5);
+        }
+
+        for (int i = 0; i < 4096; ++i)
+        {
+            double linear = i / 4095.0,
+                   c = linear <= 0.0031308 ? linear * 12.92 : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+
+            encode[i] = (std::uint8_t)(c * 255 + 0.5);
+        }
+    }
 
-bmp::Pixel bilinearInterpolation(
-    const bmp::Pixel &p1,
-    const bmp::Pixel &p2,
-    const bmp::Pixel &p3,
-    const bmp::Pixel &p4,
+    // Linear light in the 16-bit range to an encoded value
+    std::uint8_t toEncoded(double linear) const
+    {
+        return encode[std::min(4095, (int)(linear * (4095.0 / 65535) + 0.5))];
+    }
+};
+
+inline const SRGBTables srgb_tables;
+
+// With linear, 8-bit colour channels are taken as sRGB and blended in linear
+// light; alpha and 16-bit channels are blended as they are
+template <bool linear = false, class P>
+P bilinearInterpolation(
+    const P &p1,
+    const P &p2,
+    const P &p3,
+    const P &p4,
     double d1,
     double d2,
     double d3,
     double d4)
 {
-    bmp::Pixel result;
+    P result;
+
+    if constexpr (linear && sizeof(typename P::channel_type) == 1)
+    {
+        constexpr int colors = P::has_alpha ? P::channels - 1 : P::channels;
+        const std::uint16_t *decode = srgb_tables.decode;
+
+        double w1 = d1, w2 = d2, w3 = d3, w4 = d4,
+               alpha = 1;
+
+        if constexpr (P::has_alpha)
+        {
+            constexpr int a = P::channels - 1;
+
+            w1 *= p1[a], w2 *= p2[a], w3 *= p3[a], w4 *= p4[a];
+            alpha = w1 + w2 + w3 + w4;
+
+            if (alpha <= 0)
+                return result;
+
+            result[a] = alpha + 0.5;
+        }
+
+        for (int c = 0; c < colors; ++c)
+        {
+            double value = decode[p1[c]] * w1 + decode[p2[c]] * w2 + decode[p3[c]] * w3 + decode[p4[c]] * w4;
+            result[c] = srgb_tables.toEncoded(value / alpha);
+        }
+    }
+    else if constexpr (P::has_alpha)
+    {
+        constexpr int a = P::channels - 1;
+
+        double w1 = d1 * p1[a],
+               w2 = d2 * p2[a],
+               w3 = d3 * p3[a],
+               w4 = d4 * p4[a],
+               alpha = w1 + w2 + w3 + w4;
 
-    result.r = p1.r * d1 + p2.r * d2 + p3.r * d3 + p4.r * d4;
-    result.g = p1.g * d1 + p2.g * d2 + p3.g * d3 + p4.g * d4;
-    result.b = p1.b * d1 + p2.b * d2 + p3.b * d3 + p4.b * d4;
+        if (alpha <= 0)
+            return result;
+
+        for (int c = 0; c < a; ++c)
+            result[c] = (p1[c] * w1 + p2[c] * w2 + p3[c] * w3 + p4[c] * w4) / alpha + 0.5;
+
+        result[a] = alpha + 0.5;
+    }
+    else
+    {
+        for (int c = 0; c < P::channels; ++c)
+            result[c] = p1[c] * d1 + p2[c] * d2 + p3[c] * d3 + p4[c] * d4 + 0.5;
+    }
 
     return result;
 }
 
-bmp::Bitmap CPURender(int width, int height,
-                      int new_width, int new_height,
-                      int x_offset, int y_offset,
-                      std::vector<std::vector<double>> invMatrix,
-                      bmp::Bitmap input,
-                      int threads_number)
+/*
+ * Source coordinates of a row of canvas pixels under a projective inverse
+ * matrix, without a divide per pixel. Rows are cut into spans on a fixed
+ * grid of canvas columns, and coordinates are exact at both ends of a span;
+ * its midpoint is divided too, and when the straight line between the ends
+ * is within tolerance of it the rest of the span is interpolated, otherwise
+ * both halves are subdivided. The curve of a projective row is a hyperbola
+ * branch, bent one way only, so the midpoint bounds the error. As the spans
+ * do not depend on the pixels asked for, tiles and windows of a canvas get
+ * the same coordinates as the whole. Pixels beyond the horizon (w <= 0) get
+ * NaN coordinates.
+ */
+class PerspectiveRow
 {
-    bmp::Bitmap output(new_width, new_height);
+public:
+    explicit PerspectiveRow(const std::vector<std::vector<double>> &invMatrix, double tolerance = 1.0 / 128)
+        : m(invMatrix), tolerance(tolerance)
+    {
+    }
+
+    // Fills xs and ys (sample coordinates, minus the half pixel) for the
+    // count pixels of canvas row y starting at canvas column first
+    void fill(int first, int y, int count, double *xs, double *ys)
+    {
+        this->first = first;
+        this->last = first + count - 1;
+        this->y = y + 0.5;
+        this->xs = xs, this->ys = ys;
 
-    int chunk_size = ceil(new_width / (double)threads_number);
+        int start = (int)std::floor((double)first / SPAN) * SPAN;
+        Sample left = exact(start);
+
+        for (; start <= last; start += SPAN)
+        {
+            Sample right = exact(start + SPAN);
+
+            subdivide(start, left, start + SPAN, right);
+            left = right;
+        }
+    }
 
-    std::vector<std::thread> threads(threads_number);
+    std::int64_t divides = 0;
 
-    double progress = 0;
-    int checkpoint = (int)ceil(new_width / 100.0);
+private:
+    static constexpr int SPAN = 64;
 
-    for (int i = 0; i < threads_number; ++i)
+    struct Sample
     {
-        threads[i] = std::thread(
-            [=, &output, &progress] // prettier-ignore
-            {                       // prettier-ignore
-                try
-                {
-                    std::vector<std::vector<double>> transformed_coord;
-                    for (int new_x = i * chunk_size; new_x < std::min((i + 1) * chunk_size, new_width); ++new_x)
+        double x,
+            y;
+    };
+
+    Sample exact(int column)
+    {
+        double x = column + 0.5,
+               u = x * m[0][0] + y * m[1][0] + m[2][0],
+               v = x * m[0][1] + y * m[1][1] + m[2][1],
+               w = x * m[0][2] + y * m[1][2] + m[2][2];
+
+        ++divides;
+
+        if (w <= 0)
+            return {NAN, NAN};
+
+        double r = 1 / w;
+        Sample sample = {u * r - 0.5, v * r - 0.5};
+
+        store(column, sample);
+        return sample;
+    }
+
+    void store(int column, const Sample &sample)
+    {
+        if (column >= first && column <= last)
+        {
+            xs[column - first] = sample.x;
+            ys[column - first] = sample.y;
+        }
+    }
+
+    static Sample line(int a, const Sample &left, int b, const Sample &right, int column)
+    {
+        double t = (double)(column - a) / (b - a);
+
+        return {left.x + (right.x - left.x) * t, left.y + (right.y - left.y) * t};
+    }
+
+    // Fills the columns strictly between a and b that were asked for
+    void subdivide(int a, const Sample &left, int b, const Sample &right)
+    {
+        if (b - a < 2 || a + 1 > last || b - 1 < first)
+            return;
+
+        int mid = a + (b - a) / 2;
+        Sample exact_mid = exact(mid),
+               line_mid = line(a, left, b, right, mid);
+
+        // NaN ends (the horizon) fail the test and are divided pixel by pixel
+        if (std::abs(exact_mid.x - line_mid.x) <= tolerance && std::abs(exact_mid.y - line_mid.y) <= tolerance)
+        {
+            for (int column = std::max(a + 1, first); column <= std::min(b - 1, last); ++column)
+            {
+                if (column != mid)
+                    store(column, column < mid ? line(a, left, mid, exact_mid, column)
+                                               : line(mid, exact_mid, b, right, column));
+            }
+
+            return;
+        }
+
+        subdivide(a, left, mid, exact_mid);
+        subdivide(mid, exact_mid, b, right);
+    }
+
+    const std::vector<std::vector<double>> &m;
+    double tolerance,
+        y = 0;
+    int first = 0,
+        last = 0;
+    double *xs = nullptr,
+           *ys = nullptr;
+};
+
+template <class Edge = ConstantEdge, bool linear = false, class Source, class P = typename Source::pixel_type>
+bmp::BasicBitmap<P> CPURender(int width, int height,
+                              int new_width, int new_height,
+                              int x_offset, int y_offset,
+                              std::vector<std::vector<double>> invMatrix,
+                              const Source &input,
+                              int threads_number,
+                              Stats *stats = nullptr,
+                              Progress::Callback on_progress = printProgress,
+                              int tile_size = 64,
+                              ThreadPool *pool = nullptr,
+                              bool numa = false,
+                              P border = P(),
+                              const affine::PostProcess &post = affine::PostProcess(),
+                              Bounds canvas = Bounds())
+{
+    // Every pixel is written below, background included, so each page is
+    // first touched by the worker rendering it
+    bmp::BasicBitmap<P> output(new_width, new_height, bmp::uninitialized);
+
+    int tiles_x = ceil(new_width / (double)tile_size),
+        tiles_y = ceil(new_height / (double)tile_size);
+    std::int64_t tiles_count = (std::int64_t)tiles_x * tiles_y;
+
+    std::atomic<std::int64_t> next_tile(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    bool projective = isProjective(invMatrix);
+
+    // Affine rows: source x and y at a column are the row terms plus column
+    // times the first row of the inverse, summed as multiplyMatrices does
+    const double m00 = invMatrix[0][0], m01 = invMatrix[0][1],
+                 m10 = invMatrix[1][0], m11 = invMatrix[1][1],
+                 m20 = invMatrix[2][0], m21 = invMatrix[2][1];
+
+    affine::PostKernel<P> kernel(post);
+
+    // Sharpening renders the pixels around each tile again for their
+    // neighbours, up to the edges of the whole canvas (or of the window where
+    // it reaches beyond), so windows of a canvas match the whole. Output
+    // columns and rows of those edges:
+    if (!canvas.width)
+        canvas = {new_width, new_height, x_offset, y_offset};
+
+    int canvas_left = std::min(canvas.x_offset - x_offset, 0),
+        canvas_top = std::min(canvas.y_offset - y_offset, 0),
+        canvas_right = std::max(canvas.x_offset + canvas.width - x_offset, new_width),
+        canvas_bottom = std::max(canvas.y_offset + canvas.height - y_offset, new_height);
+
+    Progress progress((std::int64_t)new_width * new_height, threads_number, on_progress);
+
+    parallelRun(pool, threads_number,
+                [=, &input, &output, &next_tile, &progress, &error, &error_mutex](int i) // prettier-ignore
+                {                                                                        // prettier-ignore
+                    // With numa, worker i renders the contiguous band i of tile
+                    // rows on node i % nodes, whichever pool thread runs it, so
+                    // the output pages it first touches are on that node.
+                    // Otherwise workers take the next tile as they free up
+                    std::int64_t band_first = (std::int64_t)tiles_y * i / threads_number * tiles_x,
+                                 band_last = (std::int64_t)tiles_y * (i + 1) / threads_number * tiles_x;
+
+                    if (numa)
+                        pinToNode(i);
+
+                    double thread_wall = stats ? wallTime() : 0,
+                           thread_cpu = stats ? threadCpuTime() : 0;
+
+                    std::vector<double> tile_times;
+                    std::int64_t tiles_done = 0,
+                                 pixels = 0,
+                                 skipped = 0;
+
+                    // Source coordinates of one row of a tile, and the tile with
+                    // the pixels around it when sharpening
+                    std::vector<double> xs(tile_size + 2),
+                        ys(tile_size + 2);
+                    std::vector<P> block(kernel.sharpens() ? (tile_size + 2) * (tile_size + 2) : 0);
+                    PerspectiveRow perspective(invMatrix);
+
+                    // Resamples columns [first, last) of output row new_y, handing
+                    // each pixel to put along with whether it fell outside
+                    auto renderRow = [&](int new_y, int first, int last, auto put)
                     {
-                        for (int new_y = 0; new_y < new_height; ++new_y)
+                        if (projective)
+                            perspective.fill(first + x_offset, new_y + y_offset, last - first, xs.data(), ys.data());
+                        else
                         {
-                            transformed_coord = {{(double)(new_x + x_offset), (double)(new_y + y_offset), 1}};
+                            double row_y = new_y + y_offset + 0.5,
+                                   row_x = row_y * m10,
+                                   row_v = row_y * m11,
+                                   column = first + x_offset + 0.5;
+
+                            for (int i = 0; i < last - first; ++i, column += 1)
+                            {
+                                xs[i] = column * m00 + row_x + m20 - 0.5;
+                                ys[i] = column * m01 + row_v + m21 - 0.5;
+                            }
+                        }
 
-                            auto coord = multiplyMatrices(transformed_coord, invMatrix);
+                        for (int new_x = first; new_x < last; ++new_x)
+                        {
+                            double x = xs[new_x - first],
+                                   y = ys[new_x - first];
 
-                            double x = coord[0][0],
-                                   y = coord[0][1];
+                            // Written so that NaN, beyond the horizon of a perspective, is
+                            // outside too; folding edges give up far from the source
+                            bool outside = Edge::constant ? !(x > -1 && x < width && y > -1 && y < height)
+                                                          : !(std::abs(x) < 1e9 && std::abs(y) < 1e9);
 
-                            if (x < 0 || x >= width || y < 0 || y >= height)
+                            if (outside)
+                            {
+                                put(new_x, border, true);
                                 continue;
+                            }
 
                             int ix = std::floor(x),
                                 iy = std::floor(y);
 
-                            auto p1 = input.get(ix, iy),
-                                 p2 = input.get(ix + (ix < width - 1), iy),
-                                 p3 = input.get(ix, iy + (iy < height - 1)),
-                                 p4 = input.get(ix + (ix < width - 1), iy + (iy < height - 1));
+                            P p1, p2, p3, p4;
+
+                            if constexpr (Edge::constant)
+                            {
+                                p1 = samplePixel(input, ix, iy, border);
+                                p2 = samplePixel(input, ix + 1, iy, border);
+                                p3 = samplePixel(input, ix, iy + 1, border);
+                                p4 = samplePixel(input, ix + 1, iy + 1, border);
+                            }
+                            else
+                            {
+                                int left = Edge::index(ix, width),
+                                    right = Edge::index(ix + 1, width),
+                                    top = Edge::index(iy, height),
+                                    bottom = Edge::index(iy + 1, height);
+
+                                p1 = input(left, top);
+                                p2 = input(right, top);
+                                p3 = input(left, bottom);
+                                p4 = input(right, bottom);
+                            }
 
                             double t = x - ix,
                                    u = y - iy,
                                    d1 = (1 - t) * (1 - u),
                                    d2 = t * (1 - u),
-                                   d3 = t * u,
-                                   d4 = (1 - t) * u;
-
-                            auto pixel = bilinearInterpolation(p1, p2, p3, p4,
-                                                               d1, d2, d3, d4);
+                                   d3 = (1 - t) * u,
+                                   d4 = t * u;
 
-                            output.set(new_x, new_y, pixel);
+                            put(new_x, bilinearInterpolation<linear>(p1, p2, p3, p4, d1, d2, d3, d4), false);
                         }
+                    };
 
-                        progress += 1.0 / new_width;
-
-                        if (new_x % checkpoint == 0)
+                    try
+                    {
+                        for (std::int64_t tile = numa ? band_first : next_tile++; tile < (numa ? band_last : tiles_count);
+                             tile = numa ? tile + 1 : next_tile++)
                         {
-                            const std::unique_lock<std::mutex> lock(mutex);
-                            printProgress(progress);
+                            double tile_start = stats ? wallTime() : 0;
+
+                            int x0 = (int)(tile % tiles_x) * tile_size,
+                                y0 = (int)(tile / tiles_x) * tile_size,
+                                x1 = std::min(x0 + tile_size, new_width),
+                                y1 = std::min(y0 + tile_size, new_height);
+
+                            if (!kernel.sharpens() && !kernel.colors())
+                            {
+                                for (int new_y = y0; new_y < y1; ++new_y)
+                                    renderRow(new_y, x0, x1, [&](int new_x, const P &pixel, bool outside)
+                                              {
+                                                  output.set(new_x, new_y, pixel);
+                                                  skipped += outside; });
+                            }
+                            else if (!kernel.sharpens())
+                            {
+                                for (int new_y = y0; new_y < y1; ++new_y)
+                                    renderRow(new_y, x0, x1, [&](int new_x, const P &pixel, bool outside)
+                                              {
+                                                  output.set(new_x, new_y, kernel.color(pixel));
+                                                  skipped += outside; });
+                            }
+                            else
+                            {
+                                // The tile and its neighbours within the canvas
+                                int bx0 = std::max(x0 - 1, canvas_left),
+                                    by0 = std::max(y0 - 1, canvas_top),
+                                    bx1 = std::min(x1 + 1, canvas_right),
+                                    by1 = std::min(y1 + 1, canvas_bottom),
+                                    stride = bx1 - bx0;
+
+                                for (int new_y = by0; new_y < by1; ++new_y)
+                                {
+                                    bool counted = new_y >= y0 && new_y < y1;
+
+                                    renderRow(new_y, bx0, bx1, [&](int new_x, const P &pixel, bool outside)
+                                              {
+                                                  block[(new_y - by0) * stride + new_x - bx0] = pixel;
+                                                  skipped += outside && counted && new_x >= x0 && new_x < x1; });
+                                }
+
+                                const P *neighbours[9];
+
+                                for (int new_y = y0; new_y < y1; ++new_y)
+                                {
+                                    for (int new_x = x0; new_x < x1; ++new_x)
+                                    {
+                                        for (int i = 0; i < 9; ++i)
+                                        {
+                                            int nx = std::min(std::max(new_x + i % 3 - 1, bx0), bx1 - 1),
+                                                ny = std::min(std::max(new_y + i / 3 - 1, by0), by1 - 1);
+
+                                            neighbours[i] = &block[(ny - by0) * stride + nx - bx0];
+                                        }
+
+                                        P pixel = kernel.sharpen(neighbours);
+
+                                        output.set(new_x, new_y, kernel.colors() ? kernel.color(pixel) : pixel);
+                                    }
+                                }
+                            }
+
+                            pixels += (std::int64_t)(x1 - x0) * (y1 - y0);
+                            ++tiles_done;
+
+                            if (stats)
+                                tile_times.push_back(wallTime() - tile_start);
+
+                            progress.add(i, (std::int64_t)(x1 - x0) * (y1 - y0));
                         }
                     }
-                }
-                catch (const std::runtime_error &e)
-                {
-                    std::cout << e.what() << std::endl;
-                }
-            });
-    }
+                    catch (...)
+                    {
+                        const std::unique_lock<std::mutex> lock(error_mutex);
+                        if (!error)
+                            error = std::current_exception();
+                        next_tile = tiles_count;
+                    }
+
+                    if (stats)
+                    {
+                        stats->addThread({i, wallTime() - thread_wall, threadCpuTime() - thread_cpu, tiles_done, pixels},
+                                         tile_times);
+                        stats->count("pixels_rendered", pixels - skipped);
+                        stats->count("pixels_skipped_out_of_bounds", skipped);
 
-    for (auto &t : threads)
-        t.join();
+                        if (projective)
+                            stats->count("perspective_divides", perspective.divides);
+                    }
+                });
 
-    printProgress(1);
+    progress.finish();
 
-    std::cout << std::endl;
+    if (error)
+        std::rethrow_exception(error);
 
     return output;
 }
 
-bmp::Bitmap GPURender(int width, int height,
-                      int new_width, int new_height,
-                      int x_offset, int y_offset,
-                      std::vector<std::vector<double>> invMatrix,
-                      bmp::Bitmap input)
+template <class P>
+bmp::BasicBitmap<P> GPURender(int width, int height,
+                              int new_width, int new_height,
+                              int x_offset, int y_offset,
+                              std::vector<std::vector<double>> invMatrix,
+                              const bmp::BasicView<P> &input,
+                              Stats *stats = nullptr,
+                              GPUContext *context = nullptr,
+                              bool upload = true,
+                              int edge = 0,
+                              P border = P(),
+                              bool linear = false,
+                              const affine::PostProcess &post = affine::PostProcess(),
+                              Bounds canvas = Bounds())
 {
-    init(new_width, new_height);
+    std::unique_ptr<GPUContext> owned;
+
+    if (!context)
+    {
+        Stats::Scope scope(stats, "gpu_init");
+
+        owned.reset(new GPUContext());
+        context = owned.get();
+    }
+
+    // A fresh context has no source texture to reuse
+    upload |= (bool)owned;
+
+    GPUContext::Lock lock(*context);
+
+    // 8-bit colour is decoded by sRGB textures where GL has them, by the
+    // shader for gray; 16-bit channels are linear already
+    int mode = 0;
 
-    GLuint VAO, VBO, EBO;
+    if (linear && sizeof(typename P::channel_type) == 1)
+        mode = GLPixelFormat<P>::srgb_internal_format ? 1 : 2;
 
-    createBuffers(&VAO, &VBO, &EBO);
+    // Neighbours of sharpened pixels, as in CPURender
+    if (!canvas.width)
+        canvas = {new_width, new_height, x_offset, y_offset};
 
-    GLuint VertexShader, FragmentShader;
-    GLint PositionAttribute;
+    int left = std::min(canvas.x_offset, x_offset),
+        top = std::min(canvas.y_offset, y_offset);
 
-    GLuint ShaderProgram = createShader(&VertexShader, &FragmentShader, &PositionAttribute);
+    canvas = {std::max(canvas.x_offset + canvas.width, x_offset + new_width) - left,
+              std::max(canvas.y_offset + canvas.height, y_offset + new_height) - top,
+              left, top};
 
-    configureShader(width, height, x_offset, y_offset,
-                    invMatrix, input, ShaderProgram);
+    context->target(new_width, new_height,
+                    mode == 1 ? GLPixelFormat<P>::srgb_target_format : GLPixelFormat<P>::target_format);
 
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glVertexAttribPointer(PositionAttribute, 2, GL_FLOAT, GL_FALSE, 0, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(context->ShaderProgram);
+    glBindVertexArray(context->VAO);
 
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    {
+        Stats::Scope scope(stats, "gpu_upload");
+
+        configureShader(width, height, x_offset, y_offset,
+                        invMatrix, input, context->ShaderProgram, context->source, upload, edge, border, mode,
+                        post, canvas);
+
+        if (stats)
+            glFinish();
+    }
+
+    {
+        Stats::Scope scope(stats, "gpu_draw");
 
-    int buffer_width = ceil(new_width / 4.0) * 4,
-        buffer_height = ceil(new_height / 4.0) * 4;
+        glBindBuffer(GL_ARRAY_BUFFER, context->VBO);
+        glVertexAttribPointer(context->PositionAttribute, 2, GL_FLOAT, GL_FALSE, 0, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    bmp::Bitmap output(buffer_width, buffer_height);
-    auto pixels = reinterpret_cast<unsigned char *>(output.m_pixels.data());
-    glReadPixels(0, 0, buffer_width, buffer_height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+        if (mode == 1)
+            glEnable(GL_FRAMEBUFFER_SRGB);
 
-    glDeleteProgram(ShaderProgram);
-    glDeleteShader(FragmentShader);
-    glDeleteShader(VertexShader);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
-    glDeleteBuffers(1, &EBO);
-    glDeleteBuffers(1, &VBO);
-    glDeleteVertexArrays(1, &VAO);
+        glDisable(GL_FRAMEBUFFER_SRGB);
 
-    glfwTerminate();
+        if (stats)
+            glFinish();
+    }
+
+    bmp::BasicBitmap<P> output(new_width, new_height, bmp::uninitialized);
+
+    {
+        Stats::Scope scope(stats, "gpu_readback");
+
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, new_width, new_height,
+                     GLPixelFormat<P>::format, GLPixelFormat<P>::type,
+                     (GLvoid *)output.m_pixels.data());
+    }
 
     return output;
 }
\ No newline at end of file
@@ -0,0 +1,430 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <math.h>
+#include <boost/program_options.hpp>
+#include "matrix.hpp"
+#include "affine.hpp"
+#include "AsyncFile.hpp"
+
+/*
+ * Command line of a single transform, shared by affine_transform and the
+ * transform server so that both accept exactly the same options. Invalid
+ * options are reported by throwing bmp::Exception (or po::error).
+ */
+struct Job
+{
+    std::string input,
+        output,
+        format = "auto",
+        layout = "rows",
+        stats;
+
+    double angle = 0,
+           horizontal_scale = 1,
+           vertical_scale = 1,
+           scale = 1,
+           horizontal_skew = 0,
+           vertical_skew = 0;
+
+    bool horizontal_flip = false,
+         vertical_flip = false,
+         alpha = false,
+         quiet = false,
+         help = false,
+         threads_given = false,
+         numa = false,
+         hugepages = false,
+         linear = false,
+         direct_io = false;
+
+    // Backend of image file reads and writes
+    IOBackend io = IOBackend::Auto;
+
+    // 2x3 (or 3x3 perspective) matrix given with --matrix, empty otherwise
+    std::vector<double> matrix;
+
+    // Steps given with --step, applied after the options above
+    std::vector<std::string> steps;
+
+    // Sequence mode: frame count with parameter sweeps, or a file of per-frame steps
+    int frames = 0;
+    std::vector<std::string> sweeps;
+    std::string sequence;
+
+    // Output window given with --roi, empty for the whole canvas
+    affine::Region roi;
+
+    // Band shard of shards rendered with --shard, or the shards count to
+    // assemble with --merge
+    int shard = 0,
+        shards = 0,
+        merge = 0;
+
+    // Samples outside the source, and the colour of the constant edge
+    affine::EdgeMode edge = affine::EdgeMode::Constant;
+    bmp::Pixel border = bmp::Transparent;
+
+    // Post-processing of the rendered pixels: 3x4 colour matrix given with
+    // --color-matrix (empty otherwise), then grayscale, brightness and
+    // contrast; sharpening comes before all of them
+    std::vector<double> color_matrix;
+    bool grayscale = false;
+    double brightness = 0,
+           contrast = 1,
+           sharpen = 0;
+
+    // Result cache directory and its size limit in megabytes
+    std::string cache;
+    int cache_size = 1024;
+
+    int x = 0,
+        y = 0,
+        device = 1,         // 0 chooses automatically
+        threads_number = 0; // 0 chooses automatically
+};
+
+namespace po = boost::program_options;
+
+inline std::vector<po::option> ignore_numbers(std::vector<std::string> &args)
+{
+    std::vector<po::option> result;
+    int pos = 0;
+    while (!args.empty())
+    {
+        const auto &arg = args[0];
+        double num;
+        if (boost::conversion::try_lexical_convert(arg, num))
+        {
+            result.push_back(po::option());
+            po::option &opt = result.back();
+
+            opt.position_key = pos++;
+            opt.value.push_back(arg);
+            opt.original_tokens.push_back(arg);
+
+            args.erase(args.begin());
+        }
+        else
+            break;
+    }
+
+    return result;
+}
+
+inline po::options_description jobOptions()
+{
+    po::options_description desc("Allowed options");
+    desc
+        .add_options()                                                                                                        // prettier-ignore
+        ("help,h", "produce help message")                                                                                    // prettier-ignore
+        ("angle,a", po::value<double>()->default_value(0), "rotation angle")                                                  // prettier-ignore
+        ("hsc", po::value<double>()->default_value(1), "horizontal scale factor")                                             // prettier-ignore
+        ("vsc", po::value<double>()->default_value(1), "vertical scale factor")                                               // prettier-ignore
+        ("scale,s", po::value<double>(), "scale factor (overrides hsc and vsc)")                                              // prettier-ignore
+        ("hsk", po::value<double>()->default_value(0), "horizontal skew angle")                                               // prettier-ignore
+        ("vsk", po::value<double>()->default_value(0), "vertical skew angle")                                                 // prettier-ignore
+        ("xtranslate,x", po::value<int>()->default_value(0), "x translate")                                                   // prettier-ignore
+        ("ytranslate,y", po::value<int>()->default_value(0), "y translate")                                                   // prettier-ignore
+        ("hf", "horizontal flip")                                                                                             // prettier-ignore
+        ("vf", "vertical flip")                                                                                               // prettier-ignore
+        ("alpha", "keep alpha channel (32 bpp output with transparent borders)")                                              // prettier-ignore
+        ("format,f", po::value<std::string>()->default_value("auto"), "pixel format: auto, gray8, gray16, rgb8, rgb16, rgba8") // prettier-ignore
+        ("matrix,m", po::value<std::vector<double>>()->multitoken(), "transformation matrix, 2x3 or 3x3 perspective (overrides all options)") // prettier-ignore
+        ("step", po::value<std::vector<std::string>>()->composing(),                                                          // prettier-ignore
+         "transform step applied after the options above, repeatable: rotate:A, scale:S[:V], skew:H[:V], "                    // prettier-ignore
+         "translate:X[:Y], hflip, vflip, matrix:a:b:x:c:d:y[:g:h:i] (the chain is folded into one matrix)")                           // prettier-ignore
+        ("frames", po::value<int>(), "sequence mode: render this many frames, varying the --sweep parameters")                 // prettier-ignore
+        ("sweep", po::value<std::vector<std::string>>()->composing(),                                                         // prettier-ignore
+         "sequence parameter range, repeatable: P:FROM:TO with P one of angle, scale, hsc, vsc, hsk, vsk, x, y")              // prettier-ignore
+        ("sequence", po::value<std::string>(), "sequence mode: file with the steps (or 2x3/3x3 matrix) of one frame per line")     // prettier-ignore
+        ("roi", po::value<std::string>(), "render only the output window X,Y,W,H of the transformed image")                  // prettier-ignore
+        ("shard", po::value<std::string>(), "render only band I/N of the output into a shard file, named like a sequence frame") // prettier-ignore
+        ("merge", po::value<int>(), "assemble the output BMP from this many shard files named by the input pattern")    // prettier-ignore
+        ("device,d", po::value<std::string>()->default_value("1"), "render device: 1) CPU 2) GPU auto) fastest on this machine") // prettier-ignore
+        ("threads,t", po::value<std::string>()->default_value("auto"), "threads count or auto (only for CPU rendering)")        // prettier-ignore
+        ("cache", po::value<std::string>(), "reuse results of identical jobs stored in this directory")                      // prettier-ignore
+        ("cache-size", po::value<int>()->default_value(1024), "result cache size limit in megabytes")                        // prettier-ignore
+        ("edge", po::value<std::string>()->default_value("constant"), "samples outside the image: constant, clamp, wrap, mirror") // prettier-ignore
+        ("border", po::value<std::string>(), "colour R,G,B[,A] (0-255) of the constant edge, transparent black by default") // prettier-ignore
+        ("color-matrix", po::value<std::vector<double>>()->multitoken(), "3x4 colour matrix r r r o g g g o b b b o applied to rendered pixels, offsets 0-1") // prettier-ignore
+        ("grayscale", "convert rendered pixels to gray")                                                                      // prettier-ignore
+        ("brightness", po::value<double>()->default_value(0), "brightness added to rendered pixels, -1 to 1")              // prettier-ignore
+        ("contrast", po::value<double>()->default_value(1), "contrast factor of rendered pixels around mid gray")           // prettier-ignore
+        ("sharpen", po::value<double>()->default_value(0), "3x3 unsharp amount applied to rendered pixels")                // prettier-ignore
+        ("linear", "interpolate 8-bit colour in linear light (gamma-correct) instead of sRGB values")                         // prettier-ignore
+        ("layout", po::value<std::string>()->default_value("rows"), "source order for CPU renders: rows, blocks, morton")     // prettier-ignore
+        ("numa", "pin render threads to NUMA nodes so output pages are allocated where they are written")                     // prettier-ignore
+        ("hugepages", "allocate images 64-byte aligned, large ones on transparent huge pages")                              // prettier-ignore
+        ("io", po::value<std::string>()->default_value("auto"), "image file I/O: auto, uring, threads, stream")              // prettier-ignore
+        ("direct-io", "read and write image files with O_DIRECT, bypassing the page cache")                                  // prettier-ignore
+        ("quiet,q", "do not report render progress")                                                                          // prettier-ignore
+        ("stats", po::value<std::string>()->implicit_value("-"), "write stage timings and counters as JSON (stdout or file)"); // prettier-ignore
+
+    return desc;
+}
+
+// Parses the arguments following the program name
+inline Job parseJob(const std::vector<std::string> &args)
+{
+    po::options_description hidden;
+    hidden.add_options()                           // prettier-ignore
+        ("input-file", po::value<std::string>())   // prettier-ignore
+        ("output-file", po::value<std::string>()); // prettier-ignore
+
+    po::options_description options;
+    options.add(jobOptions());
+    options.add(hidden);
+
+    po::positional_options_description positional;
+    positional.add("input-file", 1);
+    positional.add("output-file", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(args)
+                  .extra_style_parser(ignore_numbers)
+                  .allow_unregistered()
+                  .options(options)
+                  .positional(positional)
+                  .run(),
+              vm);
+
+    po::notify(vm);
+
+    Job job;
+
+    if (vm.count("help"))
+    {
+        job.help = true;
+        return job;
+    }
+
+    if (!vm.count("input-file"))
+        throw bmp::Exception("Provide input file");
+
+    if (!vm.count("output-file"))
+        throw bmp::Exception("Provide output file");
+
+    job.input = vm["input-file"].as<std::string>();
+    job.output = vm["output-file"].as<std::string>();
+    job.format = vm["format"].as<std::string>();
+    job.layout = vm["layout"].as<std::string>();
+
+    // Validates the layout name
+    affine::parseSourceLayout(job.layout);
+
+    if (vm.count("stats"))
+        job.stats = vm["stats"].as<std::string>();
+
+    job.angle = vm["angle"].as<double>();
+    job.horizontal_scale = vm["hsc"].as<double>();
+    job.vertical_scale = vm["vsc"].as<double>();
+    job.horizontal_skew = vm["hsk"].as<double>();
+    job.vertical_skew = vm["vsk"].as<double>();
+
+    if (vm.count("scale"))
+        job.scale = job.horizontal_scale = job.vertical_scale = vm["scale"].as<double>();
+
+    if (vm.count("matrix"))
+        job.matrix = vm["matrix"].as<std::vector<double>>();
+
+    if (vm.count("step"))
+        job.steps = vm["step"].as<std::vector<std::string>>();
+
+    if (vm.count("frames"))
+        job.frames = vm["frames"].as<int>();
+
+    if (vm.count("sweep"))
+        job.sweeps = vm["sweep"].as<std::vector<std::string>>();
+
+    if (vm.count("sequence"))
+        job.sequence = vm["sequence"].as<std::string>();
+
+    if (vm.count("roi"))
+    {
+        const std::string &roi = vm["roi"].as<std::string>();
+        char tail;
+
+        if (std::sscanf(roi.c_str(), "%d,%d,%d,%d%c", &job.roi.x, &job.roi.y, &job.roi.width, &job.roi.height, &tail) != 4 ||
+            job.roi.width <= 0 || job.roi.height <= 0)
+            throw bmp::Exception("Invalid region of interest " + roi);
+    }
+
+    if (vm.count("shard"))
+    {
+        const std::string &shard = vm["shard"].as<std::string>();
+        char tail;
+
+        if (std::sscanf(shard.c_str(), "%d/%d%c", &job.shard, &job.shards, &tail) != 2 ||
+            job.shard < 0 || job.shard >= job.shards)
+            throw bmp::Exception("Invalid shard " + shard);
+
+        if (job.output == "-" || affine::isPyramid(job.output) || job.frames || !job.sequence.empty())
+            throw bmp::Exception("Shards are rendered from single images into files");
+    }
+
+    if (vm.count("merge") && (job.merge = vm["merge"].as<int>()) <= 0)
+        throw bmp::Exception("Provide a positive shards count for --merge");
+
+    if (vm.count("color-matrix"))
+        job.color_matrix = vm["color-matrix"].as<std::vector<double>>();
+
+    job.grayscale = vm.count("grayscale");
+    job.brightness = vm["brightness"].as<double>();
+    job.contrast = vm["contrast"].as<double>();
+    job.sharpen = vm["sharpen"].as<double>();
+
+    if (!job.color_matrix.empty() && job.color_matrix.size() != 12)
+        throw bmp::Exception("Colour matrix must have 12 values");
+
+    job.edge = affine::parseEdgeMode(vm["edge"].as<std::string>());
+    job.linear = vm.count("linear");
+
+    if (vm.count("border"))
+    {
+        const std::string &border = vm["border"].as<std::string>();
+        int r, g, b, a = 255;
+        char tail;
+        int count = std::sscanf(border.c_str(), "%d,%d,%d,%d%c", &r, &g, &b, &a, &tail);
+
+        if ((count != 3 && count != 4) || std::min({r, g, b, a}) < 0 || std::max({r, g, b, a}) > 255)
+            throw bmp::Exception("Invalid border colour " + border);
+
+        job.border = bmp::Pixel(r, g, b, a);
+    }
+
+    if (vm.count("cache"))
+        job.cache = vm["cache"].as<std::string>();
+
+    job.cache_size = vm["cache-size"].as<int>();
+
+    if (job.cache_size < 0)
+        throw bmp::Exception("Invalid cache size");
+
+    if (job.frames < 0 || (!job.sweeps.empty() && !job.frames))
+        throw bmp::Exception("Provide a positive frames count for --sweep");
+
+    job.x = vm["xtranslate"].as<int>();
+    job.y = vm["ytranslate"].as<int>();
+    job.horizontal_flip = vm.count("hf");
+    job.vertical_flip = vm.count("vf");
+    job.alpha = vm.count("alpha");
+    job.quiet = vm.count("quiet");
+    job.numa = vm.count("numa");
+    job.hugepages = vm.count("hugepages");
+    job.io = parseIOBackend(vm["io"].as<std::string>());
+    job.direct_io = vm.count("direct-io");
+    // "auto" is stored as 0
+    auto automatic = [&](const char *name)
+    {
+        const std::string &text = vm[name].as<std::string>();
+
+        if (text == "auto")
+            return 0;
+
+        char *end;
+        long value = std::strtol(text.c_str(), &end, 10);
+
+        return text.empty() || *end || value <= 0 ? -1 : (int)value;
+    };
+
+    job.device = automatic("device");
+    job.threads_number = automatic("threads");
+    job.threads_given = job.threads_number > 0;
+
+    if (job.device < 0 || job.device > 2)
+        throw bmp::Exception("Invalid render device");
+
+    if (job.threads_number < 0)
+        throw bmp::Exception("Invalid threads count");
+
+    return job;
+}
+
+// Transform described by the job's matrix or its rotation, scale and skew
+// options, followed by its steps
+inline affine::Affine jobAffine(const Job &job)
+{
+    std::vector<affine::Affine> steps;
+
+    if (job.matrix.empty())
+    {
+        double horizontal_scale = job.horizontal_scale,
+               vertical_scale = job.vertical_scale;
+
+        if (job.horizontal_flip)
+            horizontal_scale *= -1;
+
+        if (job.vertical_flip)
+            vertical_scale *= -1;
+
+        // Validates the skew angles
+        affine::skewing(job.horizontal_skew, job.vertical_skew);
+
+        affine::Affine base;
+        base.matrix = genMatrix(
+            job.angle,
+            horizontal_scale,
+            vertical_scale,
+            job.scale,
+            job.horizontal_skew,
+            job.vertical_skew);
+
+        base.x = job.x;
+        base.y = job.y;
+
+        steps.push_back(base);
+    }
+    else
+        steps.push_back(affine::fromMatrix(job.matrix));
+
+    for (const auto &step : job.steps)
+        steps.push_back(affine::parseStep(step));
+
+    return affine::fold(steps);
+}
+
+// Post-processing described by the job's colour options, in their order
+inline affine::PostProcess jobPost(const Job &job)
+{
+    affine::PostProcess post;
+
+    if (!job.color_matrix.empty())
+        post = affine::colorMatrix(job.color_matrix);
+
+    if (job.grayscale)
+        post = affine::compose(post, affine::grayscale());
+
+    if (job.brightness != 0 || job.contrast != 1)
+        post = affine::compose(post, affine::brightnessContrast(job.brightness, job.contrast));
+
+    post.sharpen = job.sharpen;
+    return post;
+}
+
+// Output window that limits the source pixels read: edges other than the
+// constant one may sample the whole source
+inline affine::Region jobSourceWindow(const Job &job)
+{
+    if (job.edge != affine::EdgeMode::Constant || !job.roi.width)
+        return affine::Region();
+
+    // Sharpening reads the pixels around the window too
+    affine::Region window = job.roi;
+
+    if (job.sharpen != 0)
+        window = {window.x - 1, window.y - 1, window.width + 2, window.height + 2};
+
+    return window;
+}
+
+// Pixel format requested by the job, probing the input file for auto
+inline affine::PixelFormat jobPixelFormat(const Job &job)
+{
+    return job.format == "auto" ? affine::probePixelFormat(job.input, job.alpha)
+                                : affine::parsePixelFormat(job.format);
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include "BitmapPlusPlus.hpp"
+
+/*
+ * LZ4 block format (no frame header): sequences of a token, literals and a
+ * 16-bit match offset. The compressor is the greedy single-probe hash search
+ * of the reference implementation's fast mode, so output is readable by any
+ * LZ4 block decoder.
+ */
+namespace lz4
+{
+    constexpr int MIN_MATCH = 4;
+    constexpr int LAST_LITERALS = 5;
+    constexpr int MATCH_LIMIT = 12;
+    constexpr int HASH_BITS = 12;
+
+    inline std::uint32_t read32(const std::uint8_t *p)
+    {
+        std::uint32_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    inline void writeLength(std::vector<std::uint8_t> &out, std::size_t length)
+    {
+        for (; length >= 255; length -= 255)
+            out.push_back(255);
+
+        out.push_back((std::uint8_t)length);
+    }
+
+    inline std::vector<std::uint8_t> compress(const std::uint8_t *data, std::size_t size)
+    {
+        std::vector<std::uint8_t> out;
+        out.reserve(size + size / 255 + 16);
+
+        std::vector<std::uint32_t> table(1 << HASH_BITS, 0);
+        std::size_t anchor = 0,
+                    pos = 0;
+
+        auto hash = [](std::uint32_t value)
+        { return (value * 2654435761u) >> (32 - HASH_BITS); };
+
+        auto sequence = [&](std::size_t literals_end, std::size_t match_length, std::size_t offset)
+        {
+            std::size_t literals = literals_end - anchor,
+                        token = out.size();
+
+            out.push_back((std::uint8_t)(std::min<std::size_t>(literals, 15) << 4));
+
+            if (literals >= 15)
+                writeLength(out, literals - 15);
+
+            out.insert(out.end(), data + anchor, data + literals_end);
+
+            if (!match_length)
+                return;
+
+            out.push_back(offset & 0xff);
+            out.push_back(offset >> 8);
+
+            std::size_t length = match_length - MIN_MATCH;
+            out[token] |= (std::uint8_t)std::min<std::size_t>(length, 15);
+
+            if (length >= 15)
+                writeLength(out, length - 15);
+        };
+
+        if (size >= MATCH_LIMIT + 1)
+        {
+            std::size_t limit = size - MATCH_LIMIT;
+
+            while (pos < limit)
+            {
+                std::uint32_t value = read32(data + pos);
+                std::uint32_t &slot = table[hash(value)];
+                std::size_t candidate = slot;
+                slot = (std::uint32_t)pos;
+
+                if (candidate >= pos || pos - candidate > 0xffff || read32(data + candidate) != value)
+                {
+                    ++pos;
+                    continue;
+                }
+
+                std::size_t length = MIN_MATCH;
+
+                while (pos + length < size - LAST_LITERALS && data[candidate + length] == data[pos + length])
+                    ++length;
+
+                sequence(pos, length, pos - candidate);
+
+                pos += length;
+                anchor = pos;
+            }
+        }
+
+        sequence(size, 0, 0);
+
+        return out;
+    }
+
+    // Throws for input that does not decode to exactly size bytes
+    inline void decompress(const std::uint8_t *data, std::size_t size, std::uint8_t *out, std::size_t out_size)
+    {
+        const std::uint8_t *end = data + size;
+        std::size_t pos = 0;
+
+        auto length = [&](std::size_t value)
+        {
+            if (value == 15)
+            {
+                std::uint8_t byte;
+
+                do
+                {
+                    if (data >= end)
+                        throw bmp::Exception("Corrupt LZ4 block");
+
+                    byte = *data++;
+                    value += byte;
+                } while (byte == 255);
+            }
+
+            return value;
+        };
+
+        while (data < end)
+        {
+            std::uint8_t token = *data++;
+            std::size_t literals = length(token >> 4);
+
+            if ((std::size_t)(end - data) < literals || out_size - pos < literals)
+                throw bmp::Exception("Corrupt LZ4 block");
+
+            std::memcpy(out + pos, data, literals);
+            data += literals;
+            pos += literals;
+
+            if (data == end)
+                break;
+
+            if (end - data < 2)
+                throw bmp::Exception("Corrupt LZ4 block");
+
+            std::size_t offset = data[0] | data[1] << 8;
+            data += 2;
+
+            std::size_t match = length(token & 15) + MIN_MATCH;
+
+            if (!offset || offset > pos || out_size - pos < match)
+                throw bmp::Exception("Corrupt LZ4 block");
+
+            // Overlapping matches repeat the bytes just written
+            for (std::size_t i = 0; i < match; ++i, ++pos)
+                out[pos] = out[pos - offset];
+        }
+
+        if (pos != out_size)
+            throw bmp::Exception("Corrupt LZ4 block");
+    }
+}
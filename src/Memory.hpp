@@ -0,0 +1,166 @@
+#pragma once
+
+#include <map>
+#include <new>
+#include <iterator>
+#include <mutex>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <memory_resource>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/*
+ * Memory resources for image buffers (see bmp::default_pixel_resource).
+ */
+
+// Cache line aligned blocks; blocks of 2 MB and more are aligned to, and
+// advised as, transparent huge pages, cutting TLB misses of rotated gathers
+class HugePageResource : public std::pmr::memory_resource
+{
+public:
+    static constexpr std::size_t CACHE_LINE = 64;
+    static constexpr std::size_t HUGE_PAGE = 2 << 20;
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        bool huge = bytes >= HUGE_PAGE;
+        alignment = std::max(alignment, huge ? HUGE_PAGE : CACHE_LINE);
+
+#ifdef _WIN32
+        void *p = _aligned_malloc(std::max<std::size_t>(bytes, 1), alignment);
+#else
+        void *p = nullptr;
+
+        if (posix_memalign(&p, alignment, std::max<std::size_t>(bytes, 1)) != 0)
+            p = nullptr;
+
+#ifdef MADV_HUGEPAGE
+        if (p && huge)
+            madvise(p, bytes / HUGE_PAGE * HUGE_PAGE, MADV_HUGEPAGE);
+#endif
+#endif
+
+        if (!p)
+            throw std::bad_alloc();
+
+        return p;
+    }
+
+    void do_deallocate(void *p, std::size_t, std::size_t) override
+    {
+#ifdef _WIN32
+        _aligned_free(p);
+#else
+        std::free(p);
+#endif
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+/*
+ * Keeps freed blocks and hands them out again for requests of the same size,
+ * so batch and server renders of similar images reuse pages that are already
+ * faulted in. At most capacity bytes are kept; beyond that blocks go back to
+ * upstream, largest first. Thread safe.
+ */
+class BufferPool : public std::pmr::memory_resource
+{
+public:
+    explicit BufferPool(std::size_t capacity, std::pmr::memory_resource *upstream = std::pmr::new_delete_resource())
+        : capacity(capacity), upstream(upstream)
+    {
+    }
+
+    ~BufferPool() override
+    {
+        for (const auto &block : free_blocks)
+            upstream->deallocate(block.second, block.first.first, block.first.second);
+    }
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    std::int64_t hits = 0,
+                 misses = 0;
+
+private:
+    using Key = std::pair<std::size_t, std::size_t>; // bytes, alignment
+
+    // Large blocks are kept in 64 KB steps, so images of nearly equal sizes share them
+    static std::size_t bucket(std::size_t bytes)
+    {
+        const std::size_t step = 64 << 10;
+        return bytes < 16 * step ? bytes : (bytes + step - 1) / step * step;
+    }
+
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        bytes = bucket(bytes);
+
+        {
+            const std::unique_lock<std::mutex> lock(mutex);
+
+            auto block = free_blocks.find({bytes, alignment});
+
+            if (block != free_blocks.end())
+            {
+                void *p = block->second;
+                cached -= bytes;
+                free_blocks.erase(block);
+                ++hits;
+                return p;
+            }
+
+            ++misses;
+        }
+
+        return upstream->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+    {
+        bytes = bucket(bytes);
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        free_blocks.emplace(Key(bytes, alignment), p);
+        cached += bytes;
+
+        while (cached > capacity)
+        {
+            auto largest = std::prev(free_blocks.end());
+            Key key = largest->first;
+            void *block = largest->second;
+
+            free_blocks.erase(largest);
+            cached -= key.first;
+
+            lock.unlock();
+            upstream->deallocate(block, key.first, key.second);
+            lock.lock();
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    std::size_t capacity,
+        cached = 0;
+    std::pmr::memory_resource *upstream;
+    std::multimap<Key, void *> free_blocks;
+    std::mutex mutex;
+};
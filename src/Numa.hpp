@@ -0,0 +1,86 @@
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+ * NUMA topology from sysfs, without libnuma. Render workers pinned to nodes
+ * round-robin first-touch the output tiles they render, so the pages of each
+ * tile are allocated on the node that writes them. Everything is a no-op on a
+ * single node machine and outside Linux.
+ */
+
+// CPUs of every online node, parsed from /sys/devices/system/node/node*/cpulist
+inline const std::vector<std::vector<int>> &numaNodes()
+{
+    static const std::vector<std::vector<int>> nodes = []
+    {
+        std::vector<std::vector<int>> result;
+
+#ifdef __linux__
+        for (int node = 0;; ++node)
+        {
+            std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+
+            if (!std::getline(ifs, list))
+                break;
+
+            // Ranges such as "0-7,16-23"
+            std::vector<int> cpus;
+            std::istringstream is(list);
+            std::string range;
+
+            while (std::getline(is, range, ','))
+            {
+                int first, last;
+                char dash;
+                std::istringstream rs(range);
+
+                if (!(rs >> first))
+                    continue;
+
+                last = rs >> dash >> last ? last : first;
+
+                for (int cpu = first; cpu <= last; ++cpu)
+                    cpus.push_back(cpu);
+            }
+
+            if (!cpus.empty())
+                result.push_back(cpus);
+        }
+#endif
+
+        return result;
+    }();
+
+    return nodes;
+}
+
+// Restricts the calling thread to the CPUs of node worker % nodes
+inline void pinToNode(int worker)
+{
+#ifdef __linux__
+    const auto &nodes = numaNodes();
+
+    if (nodes.size() < 2)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (int cpu : nodes[worker % nodes.size()])
+        CPU_SET(cpu, &set);
+
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)worker;
+#endif
+}
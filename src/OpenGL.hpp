@@ -1,7 +1,63 @@
+#pragma once
+
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <iostream>
+#include <vector>
+#include <mutex>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include "BitmapPlusPlus.hpp"
+#include "PostProcess.hpp"
+#include "matrix.hpp"
+
+template <class P>
+struct GLPixelFormat;
+
+template <>
+struct GLPixelFormat<bmp::Gray8>
+{
+    static constexpr GLenum internal_format = GL_R8, target_format = GL_R8,
+                            format = GL_RED, type = GL_UNSIGNED_BYTE;
+    // sRGB texture and target formats that decode and encode in hardware,
+    // 0 where the shader does it or the channels are taken as linear
+    static constexpr GLenum srgb_internal_format = 0, srgb_target_format = 0;
+};
+
+template <>
+struct GLPixelFormat<bmp::Gray16>
+{
+    static constexpr GLenum internal_format = GL_R16, target_format = GL_R16,
+                            format = GL_RED, type = GL_UNSIGNED_SHORT;
+    static constexpr GLenum srgb_internal_format = 0, srgb_target_format = 0;
+};
+
+template <>
+struct GLPixelFormat<bmp::RGB8>
+{
+    static constexpr GLenum internal_format = GL_RGB8, target_format = GL_RGBA8,
+                            format = GL_RGB, type = GL_UNSIGNED_BYTE;
+    static constexpr GLenum srgb_internal_format = GL_SRGB8, srgb_target_format = GL_SRGB8_ALPHA8;
+};
+
+template <>
+struct GLPixelFormat<bmp::RGB16>
+{
+    static constexpr GLenum internal_format = GL_RGB16, target_format = GL_RGBA16,
+                            format = GL_RGB, type = GL_UNSIGNED_SHORT;
+    static constexpr GLenum srgb_internal_format = 0, srgb_target_format = 0;
+};
 
-void PrintShaderInfoLog(GLint const Shader)
+template <>
+struct GLPixelFormat<bmp::RGBA8>
+{
+    static constexpr GLenum internal_format = GL_RGBA8, target_format = GL_RGBA8,
+                            format = GL_RGBA, type = GL_UNSIGNED_BYTE;
+    static constexpr GLenum srgb_internal_format = GL_SRGB8_ALPHA8, srgb_target_format = GL_SRGB8_ALPHA8;
+};
+
+inline void PrintShaderInfoLog(GLint const Shader)
 {
     int InfoLogLength = 0;
     int CharsWritten = 0;
@@ -18,44 +74,7 @@ void PrintShaderInfoLog(GLint const Shader)
     }
 }
 
-void init(int width, int height)
-{
-    glfwInit();
-    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
-    GLFWwindow *window = glfwCreateWindow(width, height, "", NULL, NULL);
-    glfwMakeContextCurrent(window);
-    glewInit();
-
-    GLuint fb;
-
-    GLuint rb;
-
-    GLuint tex;
-
-    glGenFramebuffers(1, &fb);
-
-    glGenRenderbuffers(1, &rb);
-
-    glGenTextures(1, &tex);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, fb);
-
-    glBindRenderbuffer(GL_RENDERBUFFER, rb);
-
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, width, height);
-
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rb);
-
-    glBindTexture(GL_TEXTURE_2D, tex);
-
-    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
-
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
-
-    glViewport(0, 0, width, height);
-}
-
-void createBuffers(GLuint *VAO, GLuint *VBO, GLuint *EBO)
+inline void createBuffers(GLuint *VAO, GLuint *VBO, GLuint *EBO)
 {
     GLfloat const Vertices[] = {
         -1.0f, -1.0f,
@@ -79,7 +98,7 @@ void createBuffers(GLuint *VAO, GLuint *VBO, GLuint *EBO)
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Elements), Elements, GL_STATIC_DRAW);
 }
 
-GLuint createShader(GLuint *VertexShader, GLuint *FragmentShader, GLint *PositionAttribute)
+inline GLuint createShader(GLuint *VertexShader, GLuint *FragmentShader, GLint *PositionAttribute)
 {
     char const *VertexShaderSource = R"GLSL(
 		#version 150
@@ -102,34 +121,134 @@ GLuint createShader(GLuint *VertexShader, GLuint *FragmentShader, GLint *Positio
         uniform float b;
         uniform float c;
         uniform float d;
+        uniform float e;
+        uniform float f;
+        uniform float g;
+        uniform float h;
+        uniform float i;
+        uniform int edge;
+        uniform vec4 border;
+        // Linear light blending: 0 off, 1 by sRGB texture and target, 2 in the shader
+        uniform int linear;
+        // Post-processing as in CPURender: colour rows (0 when the matrix
+        // is the identity), unsharp amount and the canvas its neighbours stay in
+        uniform int colors;
+        uniform vec4 rows[3];
+        uniform float sharpen;
+        uniform vec4 canvas;
+
+        // Same edge policies as CPURender: 0 constant, 1 clamp, 2 wrap, 3 mirror
+        int wrap(int i, int n) {
+            return i - n * int(floor(float(i) / float(n)));
+        }
 
-        vec4 bilinearInterpolation(vec3 p1, vec3 p2, vec3 p3, vec3 p4, float dx, float dy) {
-            vec3 top = mix(p1, p2, dx);
-            vec3 bottom = mix(p3, p4, dx);
-            return vec4(mix(top, bottom, dy), 1);
+        int edgeIndex(int i, int n) {
+            if (edge == 1)
+                return clamp(i, 0, n - 1);
+
+            if (edge == 2)
+                return wrap(i, n);
+
+            int m = wrap(i, 2 * n);
+            return m < n ? m : 2 * n - 1 - m;
+        }
+
+        vec3 decode(vec3 c) {
+            return mix(c / 12.92, pow((c + 0.055) / 1.055, vec3(2.4)), greaterThan(c, vec3(0.04045)));
+        }
+
+        vec3 encode(vec3 c) {
+            return mix(c * 12.92, 1.055 * pow(c, vec3(1 / 2.4)) - 0.055, greaterThan(c, vec3(0.0031308)));
+        }
+
+        vec4 texel(ivec2 xy) {
+            if (edge != 0)
+                xy = ivec2(edgeIndex(xy.x, int(width)), edgeIndex(xy.y, int(height)));
+            else if (xy.x < 0 || xy.y < 0 || xy.x >= int(width) || xy.y >= int(height))
+                return vec4(border.rgb * border.a, border.a);
+
+            vec4 p = texelFetch(image, xy, 0);
+
+            if (linear == 2)
+                p.rgb = decode(p.rgb);
+
+            return vec4(p.rgb * p.a, p.a);
+        }
+
+        vec4 bilinearInterpolation(vec4 p1, vec4 p2, vec4 p3, vec4 p4, float dx, float dy) {
+            vec4 top = mix(p1, p2, dx);
+            vec4 bottom = mix(p3, p4, dx);
+            return mix(top, bottom, dy);
+        }
+
+        // Straight colour of the canvas pixel centred at pixel, as stored:
+        // encoded when blended in linear light and post-processed
+        vec4 render(vec2 pixel, bool encoded)
+        {
+            vec4 color;
+            vec3 coord = vec3(pixel, 1);
+
+            coord *= mat3(a, c, e, b, d, f, g, h, i);
+
+            // Beyond the horizon of a perspective; the divide is a single
+            // reciprocal per fragment, so unlike the CPU it is not spanned
+            if (coord.z <= 0)
+                color = border;
+            else {
+                vec2 xy = coord.xy / coord.z - 0.5;
+                vec2 base = floor(xy);
+                ivec2 tap = ivec2(base);
+
+                vec4 p1 = texel(tap),
+                     p2 = texel(tap + ivec2(1, 0)),
+                     p3 = texel(tap + ivec2(0, 1)),
+                     p4 = texel(tap + ivec2(1, 1));
+
+                vec2 dc = xy - base;
+
+                color = bilinearInterpolation(p1, p2, p3, p4, dc.x, dc.y);
+
+                color = color.a > 0 ? vec4(color.rgb / color.a, color.a) : vec4(0);
+            }
+
+            if (encoded)
+                color.rgb = encode(color.rgb);
+
+            return color;
         }
 
         void main()
         {
-            vec2 new_coord = gl_FragCoord.xy;
+            vec2 pixel = gl_FragCoord.xy + vec2(x_offset, y_offset);
 
-            vec3 coord = vec3(new_coord + vec2(x_offset, y_offset), 1);
+            // sRGB targets encode after the shader, while post-processing
+            // works on encoded values
+            bool post = colors != 0 || sharpen != 0.0,
+                 encoded = linear == 2 || (linear == 1 && post);
 
-            coord *= mat3(a, c, 0, b, d, 0, 0, 0, 1);
+            outColor = render(pixel, encoded);
 
-            if(coord.x > 0 && coord.x < width && coord.y > 0 && coord.y < height) {
-                vec2 xy = vec2(floor(coord.x), floor(coord.y));
-                vec2 size = vec2(width, height);
+            if (sharpen != 0.0) {
+                vec4 centre = vec4(outColor.rgb * outColor.a, outColor.a),
+                     blur = vec4(0);
 
-                vec3 p1 = texture2D(image, xy / size).rgb,
-                     p2 = texture2D(image, (xy + vec2(1, 0)) / size).rgb,
-                     p3 = texture2D(image, (xy + vec2(0, 1)) / size).rgb,
-                     p4 = texture2D(image, (xy + vec2(1, 1)) / size).rgb;
+                for (int dy = -1; dy <= 1; ++dy)
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        vec4 p = render(clamp(pixel + vec2(dx, dy), canvas.xy + 0.5, canvas.zw - 0.5), encoded);
+                        blur += vec4(p.rgb * p.a, p.a) / 9.0;
+                    }
 
-                vec2 dc = coord.xy - xy;
+                vec4 sharp = clamp(centre + sharpen * (centre - blur), 0.0, 1.0);
+                outColor = sharp.a > 0 ? vec4(min(sharp.rgb / sharp.a, 1.0), sharp.a) : vec4(0);
+            }
 
-                outColor = bilinearInterpolation(p1, p2, p3, p4, dc.x, dc.y);
+            if (colors != 0) {
+                vec4 color = vec4(outColor.rgb, 1);
+                outColor.rgb = clamp(vec3(dot(rows[0], color), dot(rows[1], color), dot(rows[2], color)), 0.0, 1.0);
             }
+
+            if (linear == 1 && post)
+                outColor.rgb = decode(outColor.rgb);
         }
     )GLSL";
 
@@ -169,16 +288,24 @@ GLuint createShader(GLuint *VertexShader, GLuint *FragmentShader, GLint *Positio
     return ShaderProgram;
 }
 
+template <class P>
 void configureShader(int width, int height, int x_offset, int y_offset,
                      std::vector<std::vector<double>> invMatrix,
-                     bmp::Bitmap input, GLuint ShaderProgram)
+                     const bmp::BasicView<P> &input, GLuint ShaderProgram, GLuint texture,
+                     bool upload = true, int edge = 0, P border = P(), int linear = 0,
+                     const affine::PostProcess &post = affine::PostProcess(), Bounds canvas = Bounds())
 {
-    GLuint textureID[1];
-    glGenTextures(1, textureID);
+    glBindTexture(GL_TEXTURE_2D, texture);
 
-    glBindTexture(GL_TEXTURE_2D, textureID[0]);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, (GLvoid *)&input.m_pixels[0]);
+    if (upload)
+    {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, input.stride / sizeof(P));
+        glTexImage2D(GL_TEXTURE_2D, 0, linear == 1 ? GLPixelFormat<P>::srgb_internal_format : GLPixelFormat<P>::internal_format, width, height, 0,
+                     GLPixelFormat<P>::format, GLPixelFormat<P>::type, (GLvoid *)input.data);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
 
     GLint imageLoc = glGetUniformLocation(ShaderProgram, "image");
     glUniform1i(imageLoc, 0);
@@ -207,5 +334,188 @@ void configureShader(int width, int height, int x_offset, int y_offset,
     GLint dLoc = glGetUniformLocation(ShaderProgram, "d");
     glUniform1f(dLoc, invMatrix[1][1]);
 
+    GLint eLoc = glGetUniformLocation(ShaderProgram, "e");
+    glUniform1f(eLoc, invMatrix[2][0]);
+
+    GLint fLoc = glGetUniformLocation(ShaderProgram, "f");
+    glUniform1f(fLoc, invMatrix[2][1]);
+
+    GLint gLoc = glGetUniformLocation(ShaderProgram, "g");
+    glUniform1f(gLoc, invMatrix[0][2]);
+
+    GLint hLoc = glGetUniformLocation(ShaderProgram, "h");
+    glUniform1f(hLoc, invMatrix[1][2]);
+
+    GLint iLoc = glGetUniformLocation(ShaderProgram, "i");
+    glUniform1f(iLoc, invMatrix[2][2]);
+
+    GLint edgeLoc = glGetUniformLocation(ShaderProgram, "edge");
+    glUniform1i(edgeLoc, edge);
+
+    // Gray is replicated like the red channel of gray textures; opaque without alpha
+    constexpr float max = std::numeric_limits<typename P::channel_type>::max();
+    float color[4] = {0, 0, 0, 1};
+
+    for (int c = 0; c < 4; ++c)
+    {
+        if (c < 3 || P::has_alpha)
+            color[c] = border[std::min(c, P::channels - 1)] / max;
+    }
+
+    // The border is blended with decoded texels
+    for (int c = 0; c < 3 && linear; ++c)
+        color[c] = color[c] <= 0.04045f ? color[c] / 12.92f : std::pow((color[c] + 0.055f) / 1.055f, 2.4f);
+
+    GLint borderLoc = glGetUniformLocation(ShaderProgram, "border");
+    glUniform4f(borderLoc, color[0], color[1], color[2], color[3]);
+
+    GLint linearLoc = glGetUniformLocation(ShaderProgram, "linear");
+    glUniform1i(linearLoc, linear);
+
+    // Gray textures hold the value in red, where the folded row applies
+    auto rows = affine::channelRows<P>(post);
+    float values[12];
+
+    for (int r = 0; r < 3; ++r)
+    {
+        for (int c = 0; c < 4; ++c)
+            values[r * 4 + c] = rows[r][c];
+    }
+
+    GLint colorsLoc = glGetUniformLocation(ShaderProgram, "colors");
+    glUniform1i(colorsLoc, post.colors());
+
+    GLint rowsLoc = glGetUniformLocation(ShaderProgram, "rows");
+    glUniform4fv(rowsLoc, 3, values);
+
+    GLint sharpenLoc = glGetUniformLocation(ShaderProgram, "sharpen");
+    glUniform1f(sharpenLoc, post.sharpen);
+
+    // Neighbours of sharpened pixels are clamped to it
+    GLint canvasLoc = glGetUniformLocation(ShaderProgram, "canvas");
+    glUniform4f(canvasLoc, canvas.x_offset, canvas.y_offset,
+                canvas.x_offset + canvas.width, canvas.y_offset + canvas.height);
+
     glActiveTexture(GL_TEXTURE0);
-}
\ No newline at end of file
+}
+
+/*
+ * Hidden window with its GL context, compiled shader, quad buffers and render
+ * target, kept between renders. Lock makes the context current on the calling
+ * thread for one render, so renders sharing a context are serialized. GLFW is
+ * initialized and terminated with the context: keep one alive at a time.
+ */
+class GPUContext
+{
+public:
+    class Lock
+    {
+    public:
+        explicit Lock(GPUContext &context) : lock(context.mutex)
+        {
+            glfwMakeContextCurrent(context.window);
+        }
+
+        ~Lock()
+        {
+            glfwMakeContextCurrent(NULL);
+        }
+
+    private:
+        std::unique_lock<std::mutex> lock;
+    };
+
+    GPUContext()
+    {
+        if (!glfwInit())
+            throw bmp::Exception("Failed to initialize GLFW");
+
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        window = glfwCreateWindow(1, 1, "", NULL, NULL);
+
+        if (!window)
+        {
+            glfwTerminate();
+            throw bmp::Exception("Failed to create OpenGL context");
+        }
+
+        glfwMakeContextCurrent(window);
+        glewInit();
+
+        createBuffers(&VAO, &VBO, &EBO);
+
+        ShaderProgram = createShader(&VertexShader, &FragmentShader, &PositionAttribute);
+
+        glGenFramebuffers(1, &framebuffer);
+        glGenRenderbuffers(1, &depth);
+        glGenTextures(1, &source);
+
+        glfwMakeContextCurrent(NULL);
+    }
+
+    ~GPUContext()
+    {
+        glfwMakeContextCurrent(window);
+
+        glDeleteTextures(1, &source);
+        if (color)
+            glDeleteTextures(1, &color);
+        glDeleteRenderbuffers(1, &depth);
+        glDeleteFramebuffers(1, &framebuffer);
+
+        glDeleteProgram(ShaderProgram);
+        glDeleteShader(FragmentShader);
+        glDeleteShader(VertexShader);
+
+        glDeleteBuffers(1, &EBO);
+        glDeleteBuffers(1, &VBO);
+        glDeleteVertexArrays(1, &VAO);
+
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
+
+    GPUContext(const GPUContext &) = delete;
+    GPUContext &operator=(const GPUContext &) = delete;
+
+    // Binds a render target of the given size and format, reallocating only when they change
+    void target(int width, int height, GLenum format)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, width, height);
+
+        if (color && width == target_width && height == target_height && format == target_format)
+            return;
+
+        if (color)
+            glDeleteTextures(1, &color);
+
+        glGenTextures(1, &color);
+
+        glBindRenderbuffer(GL_RENDERBUFFER, depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+
+        glBindTexture(GL_TEXTURE_2D, color);
+        glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+
+        target_width = width;
+        target_height = height;
+        target_format = format;
+    }
+
+    GLuint VAO, VBO, EBO;
+    GLuint VertexShader, FragmentShader;
+    GLint PositionAttribute;
+    GLuint ShaderProgram;
+    GLuint source;
+
+private:
+    GLFWwindow *window;
+    std::mutex mutex;
+    GLuint framebuffer, depth, color = 0;
+    int target_width = 0,
+        target_height = 0;
+    GLenum target_format = 0;
+};
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <string>
+#include <limits>
+#include <algorithm>
+#include "BitmapPlusPlus.hpp"
+
+namespace affine
+{
+    /*
+     * Colour adjustments and sharpening of rendered pixels, applied by the
+     * render while each pixel is produced instead of as passes over the
+     * output. The stored values (channels scaled to 0-1) are sharpened
+     * first, then mapped through the colour matrix and clamped, exactly as
+     * separate passes over the output image would. Gray formats take their
+     * value as R = G = B and keep the luma of the result.
+     */
+    struct PostProcess
+    {
+        // Rows R, G and B applied to [r g b 1]; the identity leaves colour as is
+        std::array<std::array<double, 4>, 3> matrix = {{{1, 0, 0, 0},
+                                                        {0, 1, 0, 0},
+                                                        {0, 0, 1, 0}}};
+
+        // Unsharp amount against the 3x3 box blur, 0 for none
+        double sharpen = 0;
+
+        bool colors() const
+        {
+            return matrix != PostProcess().matrix;
+        }
+
+        bool active() const
+        {
+            return colors() || sharpen != 0;
+        }
+    };
+
+    // Colour matrix of first followed by second; the sharpening of both is
+    // summed, as it is applied once before any colour change
+    inline PostProcess compose(const PostProcess &first, const PostProcess &second)
+    {
+        PostProcess result;
+
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                double value = c == 3 ? second.matrix[r][3] : 0;
+
+                for (int k = 0; k < 3; ++k)
+                    value += second.matrix[r][k] * first.matrix[k][c];
+
+                result.matrix[r][c] = value;
+            }
+        }
+
+        result.sharpen = first.sharpen + second.sharpen;
+        return result;
+    }
+
+    // 3x4 matrix r r r o g g g o b b b o, the offsets in 0-1 units
+    inline PostProcess colorMatrix(const std::vector<double> &values)
+    {
+        if (values.size() != 12)
+            throw bmp::Exception("Colour matrix must have 12 values");
+
+        PostProcess result;
+
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 4; ++c)
+                result.matrix[r][c] = values[r * 4 + c];
+        }
+
+        return result;
+    }
+
+    // Luma with the weights of the library's colour to gray conversion
+    inline PostProcess grayscale()
+    {
+        PostProcess result;
+
+        for (auto &row : result.matrix)
+            row = {0.299, 0.587, 0.114, 0};
+
+        return result;
+    }
+
+    // Adds brightness (-1 to 1) after scaling the distance from mid gray by contrast
+    inline PostProcess brightnessContrast(double brightness, double contrast)
+    {
+        PostProcess result;
+
+        for (int r = 0; r < 3; ++r)
+        {
+            result.matrix[r][r] = contrast;
+            result.matrix[r][3] = 0.5 - 0.5 * contrast + brightness;
+        }
+
+        return result;
+    }
+
+    // Colour rows for the channels of P, in 0-1 units: gray formats fold the
+    // matrix into the first row, applied to the value alone
+    template <class P>
+    std::array<std::array<double, 4>, 3> channelRows(const PostProcess &post)
+    {
+        std::array<std::array<double, 4>, 3> rows = post.matrix;
+
+        if constexpr (P::channels < 3)
+        {
+            const double luma[3] = {0.299, 0.587, 0.114};
+
+            rows[0] = {0, 0, 0, 0};
+
+            for (int r = 0; r < 3; ++r)
+            {
+                rows[0][0] += luma[r] * (post.matrix[r][0] + post.matrix[r][1] + post.matrix[r][2]);
+                rows[0][3] += luma[r] * post.matrix[r][3];
+            }
+        }
+
+        return rows;
+    }
+
+    // PostProcess prepared for the pixels of P, as run by CPURender
+    template <class P>
+    class PostKernel
+    {
+    public:
+        explicit PostKernel(const PostProcess &post)
+            : rows(channelRows<P>(post)),
+              adjusts(post.colors()),
+              amount(post.sharpen)
+        {
+            for (auto &row : rows)
+                row[3] = row[3] * MAX + 0.5;
+        }
+
+        bool colors() const { return adjusts; }
+
+        bool sharpens() const { return amount != 0; }
+
+        // Pixel through the colour matrix
+        P color(const P &pixel) const
+        {
+            P result = pixel;
+
+            for (int c = 0; c < COLORS; ++c)
+            {
+                double value = rows[c][3] + rows[c][0] * pixel[0];
+
+                if constexpr (COLORS == 3)
+                    value += rows[c][1] * pixel[1] + rows[c][2] * pixel[2];
+
+                result[c] = std::min<double>(std::max<double>(value, 0), MAX);
+            }
+
+            return result;
+        }
+
+        // Centre of the 3x3 neighbourhood n, given row by row, sharpened. With
+        // alpha, colour is sharpened premultiplied, so that transparent
+        // pixels lend it none
+        P sharpen(const P *const n[9]) const
+        {
+            double centre[P::channels],
+                blur[P::channels] = {},
+                value[P::channels];
+
+            for (int i = 0; i < 9; ++i)
+            {
+                premultiply(*n[i], value);
+
+                for (int c = 0; c < P::channels; ++c)
+                    blur[c] += value[c] / 9;
+            }
+
+            premultiply(*n[4], centre);
+
+            double sharp[P::channels];
+
+            for (int c = 0; c < P::channels; ++c)
+                sharp[c] = std::min<double>(std::max<double>(centre[c] + amount * (centre[c] - blur[c]), 0), MAX);
+
+            P result;
+            double alpha = P::has_alpha ? sharp[P::channels - 1] / MAX : 1;
+
+            if (alpha <= 0)
+                return result;
+
+            for (int c = 0; c < P::channels; ++c)
+                result[c] = std::min<double>(c < COLORS ? sharp[c] / alpha : sharp[c], MAX) + 0.5;
+
+            return result;
+        }
+
+    private:
+        static void premultiply(const P &pixel, double *values)
+        {
+            double alpha = P::has_alpha ? pixel[P::channels - 1] / MAX : 1;
+
+            for (int c = 0; c < P::channels; ++c)
+                values[c] = c < COLORS ? pixel[c] * alpha : pixel[c];
+        }
+
+        static constexpr double MAX = std::numeric_limits<typename P::channel_type>::max();
+        static constexpr int COLORS = P::has_alpha ? P::channels - 1 : P::channels;
+
+        std::array<std::array<double, 4>, 3> rows;
+        bool adjusts;
+        double amount;
+    };
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+/*
+ * Render progress shared by worker threads without locks: every worker adds
+ * to its own cache line sized counter and a reporter thread sums them at a low
+ * fixed frequency, so callbacks (console output) never run on a worker. Without
+ * a callback no thread is started and add() is a no-op.
+ */
+class Progress
+{
+public:
+    using Callback = std::function<void(double)>;
+
+    Progress(std::int64_t total, int slots, Callback callback,
+             std::chrono::milliseconds interval = std::chrono::milliseconds(100))
+        : total(std::max<std::int64_t>(total, 1)),
+          counters(callback ? slots : 0),
+          callback(callback)
+    {
+        if (callback)
+            reporter = std::thread([this, interval]
+                                   { run(interval); });
+    }
+
+    ~Progress()
+    {
+        finish();
+    }
+
+    void add(int slot, std::int64_t done)
+    {
+        if (!counters.empty())
+            counters[slot].value.fetch_add(done, std::memory_order_relaxed);
+    }
+
+    // Stops the reporter and reports completion
+    void finish()
+    {
+        if (!reporter.joinable())
+            return;
+
+        {
+            const std::unique_lock<std::mutex> lock(mutex);
+            stopped = true;
+        }
+
+        wake.notify_one();
+        reporter.join();
+
+        callback(1);
+    }
+
+private:
+    struct alignas(64) Counter
+    {
+        std::atomic<std::int64_t> value{0};
+    };
+
+    void run(std::chrono::milliseconds interval)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (!wake.wait_for(lock, interval, [this]
+                              { return stopped; }))
+        {
+            std::int64_t done = 0;
+
+            for (const auto &counter : counters)
+                done += counter.value.load(std::memory_order_relaxed);
+
+            callback(std::min(1.0, (double)done / total));
+        }
+    }
+
+    std::int64_t total;
+    std::vector<Counter> counters;
+    Callback callback;
+    std::thread reporter;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopped = false;
+};
+
+// Console progress bar, the CLI's progress callback
+inline void printProgress(const double progress)
+{
+    std::string bar(100, ' ');
+    int pos = 100 * progress;
+    std::fill(bar.begin(), bar.begin() + std::min(pos, 100), '=');
+    if (pos < 100)
+        bar[pos] = '>';
+
+    std::cout << "[" << bar << "] " << std::fixed << std::setprecision(1) << int(progress * 1000) / 10.0
+              << (progress >= 1 ? " %\n" : " %\r");
+    std::cout.flush();
+}
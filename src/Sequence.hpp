@@ -0,0 +1,475 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+#include <exception>
+#include <condition_variable>
+#include "Job.hpp"
+#include "ThreadPool.hpp"
+#include "OpenGL.hpp"
+#include "Tuning.hpp"
+#include "Memory.hpp"
+#include "affine.hpp"
+
+/*
+ * Saves images on a background thread so encoding and disk writes overlap
+ * rendering. At most capacity images wait in the queue; push() blocks beyond
+ * that. The first save failure is rethrown by push() or finish().
+ */
+class AsyncWriter
+{
+public:
+    explicit AsyncWriter(std::size_t capacity)
+        : capacity(capacity), writer([this]
+                                     { run(); })
+    {
+    }
+
+    ~AsyncWriter()
+    {
+        stop();
+    }
+
+    void push(affine::Image &&image, const std::string &filename)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        changed.wait(lock, [this]
+                     { return queue.size() < capacity || error; });
+
+        if (error)
+            std::rethrow_exception(error);
+
+        queue.push_back({std::move(image), filename});
+        changed.notify_all();
+    }
+
+    // Waits for the queued images to be written
+    void finish()
+    {
+        stop();
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    struct Item
+    {
+        affine::Image image;
+        std::string filename;
+    };
+
+    void stop()
+    {
+        {
+            const std::unique_lock<std::mutex> lock(mutex);
+            stopped = true;
+        }
+
+        changed.notify_all();
+
+        if (writer.joinable())
+            writer.join();
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true)
+        {
+            changed.wait(lock, [this]
+                         { return stopped || !queue.empty(); });
+
+            if (queue.empty())
+                return;
+
+            Item item = std::move(queue.front());
+            queue.pop_front();
+            changed.notify_all();
+
+            lock.unlock();
+
+            try
+            {
+                affine::save(item.image, item.filename);
+            }
+            catch (...)
+            {
+                lock.lock();
+                if (!error)
+                    error = std::current_exception();
+                queue.clear();
+                changed.notify_all();
+                continue;
+            }
+
+            lock.lock();
+        }
+    }
+
+    std::size_t capacity;
+    std::deque<Item> queue;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::exception_ptr error;
+    bool stopped = false;
+    std::thread writer;
+};
+
+// Output name of a frame: a pattern holding one %d or %0Nd (and %% for a
+// percent sign) such as frame_%04d.bmp, or the frame number appended before
+// the extension. The pattern is never used as a printf format
+inline std::string framePath(const std::string &pattern, int frame)
+{
+    char name[32];
+
+    if (pattern.find('%') != std::string::npos)
+    {
+        std::string result;
+        int conversions = 0;
+
+        auto invalid = [&]
+        {
+            return bmp::Exception("Invalid frame pattern " + pattern + ": use one %d or %0Nd, and %% for %");
+        };
+
+        for (std::size_t i = 0; i < pattern.size(); ++i)
+        {
+            if (pattern[i] != '%')
+            {
+                result += pattern[i];
+                continue;
+            }
+
+            if (i + 1 < pattern.size() && pattern[i + 1] == '%')
+            {
+                result += '%';
+                ++i;
+                continue;
+            }
+
+            // %d or %0Nd, N of at most two digits
+            std::size_t end = i + 1;
+            bool zeros = end < pattern.size() && pattern[end] == '0';
+            int digits = 0;
+
+            end += zeros;
+
+            while (end < pattern.size() && std::isdigit((unsigned char)pattern[end]) && digits < 2)
+                ++end, ++digits;
+
+            if (end >= pattern.size() || pattern[end] != 'd' || (zeros && !digits) || ++conversions > 1)
+                throw invalid();
+
+            int width = digits ? std::stoi(pattern.substr(end - digits, digits)) : 0;
+
+            std::snprintf(name, sizeof(name), zeros ? "%0*d" : "%*d", width, frame);
+            result += name;
+            i = end;
+        }
+
+        if (!conversions)
+            throw invalid();
+
+        return result;
+    }
+
+    std::size_t dot = pattern.find_last_of('.'),
+                slash = pattern.find_last_of("/\\");
+
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = pattern.size();
+
+    std::snprintf(name, sizeof(name), "_%04d", frame);
+    return pattern.substr(0, dot) + name + pattern.substr(dot);
+}
+
+// Transforms of all frames: the job's options with the --sweep parameters
+// interpolated over --frames, or followed by each line of the --sequence file
+inline std::vector<affine::Affine> sequenceFrames(const Job &job)
+{
+    std::vector<affine::Affine> frames;
+
+    if (!job.sequence.empty())
+    {
+        std::ifstream ifs(job.sequence);
+
+        if (!ifs)
+            throw bmp::Exception("Failed to read sequence " + job.sequence);
+
+        affine::Affine base = jobAffine(job);
+        std::string line;
+
+        while (std::getline(ifs, line))
+        {
+            std::istringstream is(line);
+            std::vector<std::string> words;
+            std::string word;
+
+            while (is >> word)
+                words.push_back(word);
+
+            if (words.empty() || words[0][0] == '#')
+                continue;
+
+            std::vector<affine::Affine> steps = {base};
+            std::vector<double> matrix;
+
+            for (const auto &w : words)
+            {
+                char *end;
+                double value = std::strtod(w.c_str(), &end);
+
+                if (*end)
+                    break;
+
+                matrix.push_back(value);
+            }
+
+            if (matrix.size() == words.size())
+                steps.push_back(affine::fromMatrix(matrix));
+            else
+            {
+                for (const auto &w : words)
+                    steps.push_back(affine::parseStep(w));
+            }
+
+            frames.push_back(affine::fold(steps));
+        }
+
+        return frames;
+    }
+
+    struct Sweep
+    {
+        double Job::*parameter;
+        int Job::*integer;
+        double from,
+            to;
+    };
+
+    std::vector<Sweep> sweeps;
+
+    for (const auto &spec : job.sweeps)
+    {
+        std::size_t first = spec.find(':'),
+                    second = first == std::string::npos ? first : spec.find(':', first + 1);
+
+        if (second == std::string::npos)
+            throw bmp::Exception("Invalid sweep " + spec);
+
+        // The whole bound must be a finite number
+        auto bound = [&spec](const std::string &text)
+        {
+            std::size_t used = 0;
+            double value = 0;
+
+            try
+            {
+                value = std::stod(text, &used);
+            }
+            catch (const std::exception &)
+            {
+                used = 0;
+            }
+
+            if (used == 0 || used != text.size() || !std::isfinite(value))
+                throw bmp::Exception("Invalid sweep " + spec);
+
+            return value;
+        };
+
+        std::string name = spec.substr(0, first);
+        Sweep sweep{nullptr, nullptr,
+                    bound(spec.substr(first + 1, second - first - 1)),
+                    bound(spec.substr(second + 1))};
+
+        if (name == "angle")
+            sweep.parameter = &Job::angle;
+        else if (name == "hsc" || name == "scale")
+            sweep.parameter = &Job::horizontal_scale;
+        else if (name == "vsc")
+            sweep.parameter = &Job::vertical_scale;
+        else if (name == "hsk")
+            sweep.parameter = &Job::horizontal_skew;
+        else if (name == "vsk")
+            sweep.parameter = &Job::vertical_skew;
+        else if (name == "x")
+            sweep.integer = &Job::x;
+        else if (name == "y")
+            sweep.integer = &Job::y;
+        else
+            throw bmp::Exception("Invalid sweep parameter " + name);
+
+        sweeps.push_back(sweep);
+
+        // scale sweeps both axes
+        if (name == "scale")
+            sweeps.push_back({&Job::vertical_scale, nullptr, sweep.from, sweep.to});
+    }
+
+    for (int i = 0; i < job.frames; ++i)
+    {
+        Job frame = job;
+        double t = job.frames > 1 ? (double)i / (job.frames - 1) : 0;
+
+        for (const auto &sweep : sweeps)
+        {
+            double value = sweep.from + (sweep.to - sweep.from) * t;
+
+            if (sweep.parameter)
+                frame.*sweep.parameter = value;
+            else
+                frame.*sweep.integer = std::lround(value);
+        }
+
+        frames.push_back(jobAffine(frame));
+    }
+
+    return frames;
+}
+
+/*
+ * Renders every frame of a sequence from one resident source: the input is
+ * loaded once and, on the GPU, uploaded once. CPU frames are rendered two at
+ * a time on one shared pool, so workers move on to the next frame's tiles
+ * while the last tiles of a frame finish, and outputs are written by an
+ * AsyncWriter.
+ */
+inline void renderSequence(const Job &job, Stats *stats)
+{
+    if (job.output == "-")
+        throw bmp::Exception("Sequence output must be a file name pattern");
+
+    if (affine::isPyramid(job.output))
+        throw bmp::Exception("Pyramid output is not available in sequence mode");
+
+    // Checks the output pattern before any frame is rendered
+    framePath(job.output, 0);
+
+    std::vector<affine::Affine> frames;
+
+    {
+        Stats::Scope scope(stats, "matrix_setup");
+
+        frames = sequenceFrames(job);
+    }
+
+    if (frames.empty())
+        throw bmp::Exception("Sequence has no frames");
+
+    std::unique_ptr<affine::Input> input;
+
+    {
+        Stats::Scope scope(stats, "load");
+
+        input.reset(new affine::Input(job.input, jobPixelFormat(job)));
+    }
+
+    affine::Region canvas = job.roi.width ? job.roi
+                                          : affine::outputRegion(input->view().width, input->view().height, frames[0]);
+
+    Job tuned = job;
+    tuneJob(tuned, (std::int64_t)canvas.width * canvas.height, frames.size());
+
+    bool gpu = tuned.device == 2;
+
+    std::unique_ptr<ThreadPool> pool;
+    std::unique_ptr<GPUContext> context;
+
+    if (gpu)
+    {
+        Stats::Scope scope(stats, "gpu_init");
+
+        context.reset(new GPUContext());
+    }
+    else
+        pool.reset(new ThreadPool(tuned.threads_number, job.numa));
+
+    int in_flight = gpu ? 1 : std::min<int>(2, frames.size());
+
+    // Frames in flight and queued for writing recycle each other's buffers
+    std::size_t frame_bytes = affine::bytesPerPixel(input->view().format) * canvas.width * canvas.height;
+    std::pmr::memory_resource *upstream = bmp::default_pixel_resource();
+    BufferPool buffers(4 * in_flight * frame_bytes, upstream ? upstream : std::pmr::new_delete_resource());
+
+    bmp::default_pixel_resource() = &buffers;
+
+    struct Restore
+    {
+        std::pmr::memory_resource *resource;
+        ~Restore() { bmp::default_pixel_resource() = resource; }
+    } restore{upstream};
+
+    AsyncWriter writer(2 * in_flight);
+    Progress progress(frames.size(), in_flight, job.quiet ? nullptr : printProgress);
+    std::atomic<int> next_frame(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    parallelRun(nullptr, in_flight, [&](int slot)
+                {
+                    try
+                    {
+                        for (int frame = next_frame++; frame < (int)frames.size(); frame = next_frame++)
+                        {
+                            affine::Options options;
+                            options.device = (affine::Device)tuned.device;
+                            options.threads = tuned.threads_number;
+                            options.tile_size = autoTileSize(input->view().format);
+                            options.stats = stats;
+                            options.pool = pool.get();
+                            options.gpu = context.get();
+                            options.roi = job.roi;
+                            options.layout = affine::parseSourceLayout(job.layout);
+                            options.edge = job.edge;
+                            options.border = job.border;
+                            options.linear = job.linear;
+                            options.post = jobPost(job);
+                            // Each frame of a window reads its own source footprint
+                            options.resident_source = gpu && frame > 0 && !job.roi.width;
+
+                            writer.push(affine::transform(input->view(), frames[frame], options),
+                                        framePath(job.output, frame));
+
+                            progress.add(slot, 1);
+                        }
+                    }
+                    catch (...)
+                    {
+                        const std::unique_lock<std::mutex> lock(error_mutex);
+                        if (!error)
+                            error = std::current_exception();
+                        next_frame = frames.size();
+                    } });
+
+    progress.finish();
+
+    if (error)
+        std::rethrow_exception(error);
+
+    Stats::Scope scope(stats, "save");
+
+    writer.finish();
+
+    if (stats)
+    {
+        stats->count("frames", frames.size());
+        stats->count("buffer_pool_hits", buffers.hits);
+        stats->count("buffer_pool_misses", buffers.misses);
+    }
+}
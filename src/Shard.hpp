@@ -0,0 +1,299 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "Sequence.hpp"
+#include "AsyncFile.hpp"
+#include "SharedImage.hpp"
+#include "TiledImage.hpp"
+#include "Stats.hpp"
+#include "affine.hpp"
+
+/*
+ * Sharded rendering: --shard i/N renders band i of N horizontal bands of the
+ * canvas (or of the --roi window) and writes it to a shard file named like a
+ * sequence frame of the output, so N processes, on one machine or several,
+ * can each render one band. Each process reads only the source its band
+ * samples from tiled (.atf) inputs; other inputs are loaded whole. --merge N assembles the N shard files into the
+ * final BMP. Rows are stored bottom-up there, so every band is one contiguous
+ * byte range of the file, written at its own offset.
+ */
+
+// Shard file: this header, then rows rows of format pixels, top row first
+struct ShardHeader
+{
+    char magic[4];        /* "AFSH" */
+    std::uint32_t format; /* PixelFormat */
+    std::int32_t width;   /* Width of the whole image */
+    std::int32_t height;  /* Height of the whole image */
+    std::int32_t y;       /* First row of the band in the whole image */
+    std::int32_t rows;    /* Rows of the band */
+    std::uint32_t shard;  /* Index of the band */
+    std::uint32_t shards; /* Number of bands */
+};
+
+// Band of rows [height * shard / shards, height * (shard + 1) / shards) of canvas
+inline affine::Region shardBand(const affine::Region &canvas, int shard, int shards)
+{
+    std::int64_t first = (std::int64_t)canvas.height * shard / shards,
+                 last = (std::int64_t)canvas.height * (shard + 1) / shards;
+
+    affine::Region band = canvas;
+    band.y += (int)first;
+    band.height = (int)(last - first);
+    return band;
+}
+
+// Writes view, the rendered band of canvas, as shard file filename
+inline void writeShard(const affine::ImageView &view, const affine::Region &canvas, const affine::Region &band,
+                       int shard, int shards, const std::string &filename)
+{
+    std::ofstream ofs(filename, std::ios::binary);
+
+    if (!ofs)
+        throw bmp::Exception("Failed to write shard " + filename);
+
+    ShardHeader header = {{'A', 'F', 'S', 'H'}, (std::uint32_t)view.format, canvas.width, canvas.height,
+                          band.y - canvas.y, view.height, (std::uint32_t)shard, (std::uint32_t)shards};
+
+    ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    std::size_t row = affine::bytesPerPixel(view.format) * view.width;
+
+    for (std::int32_t y = 0; y < view.height; ++y)
+        ofs.write(static_cast<const char *>(view.data) + view.stride * y, row);
+
+    if (!ofs)
+        throw bmp::Exception("Failed to write shard " + filename);
+}
+
+// Assembles the shards named by pattern (as written with --shard i/shards)
+// into the BMP output
+inline void mergeShards(const std::string &pattern, int shards, const std::string &output, Stats *stats)
+{
+#ifdef _WIN32
+    (void)pattern;
+    (void)shards;
+    (void)output;
+    (void)stats;
+    throw bmp::Exception("Merging shards is not supported on this platform");
+#else
+    if (output == "-" || affine::isSharedImage(output) || affine::isTiledImage(output) || affine::isPyramid(output) ||
+        bmp::detail::format_from_extension(output) != bmp::FileFormat::BMP)
+        throw bmp::Exception("Merged output must be a BMP file");
+
+    std::vector<std::unique_ptr<std::ifstream>> files;
+    std::vector<ShardHeader> headers;
+
+    for (int shard = 0; shard < shards; ++shard)
+    {
+        std::string name = framePath(pattern, shard);
+        std::unique_ptr<std::ifstream> ifs(new std::ifstream(name, std::ios::binary));
+        ShardHeader header;
+
+        if (!*ifs || !ifs->read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, "AFSH", 4) != 0)
+            throw bmp::Exception("Not a shard: " + name);
+
+        // Every band of the same image, in order and without gaps
+        const ShardHeader &first = headers.empty() ? header : headers[0];
+        std::int32_t expected = headers.empty() ? 0 : headers.back().y + headers.back().rows;
+
+        if (header.format > (std::uint32_t)affine::PixelFormat::RGBA8 || header.width <= 0 || header.height <= 0 ||
+            header.shard != (std::uint32_t)shard || header.shards != (std::uint32_t)shards ||
+            header.format != first.format || header.width != first.width || header.height != first.height ||
+            header.y != expected || header.rows < 0 || header.rows > header.height - header.y)
+            throw bmp::Exception("Shard " + name + " does not match shard " + std::to_string(shard) + "/" +
+                                 std::to_string(shards) + " of the image");
+
+        files.push_back(std::move(ifs));
+        headers.push_back(header);
+    }
+
+    const ShardHeader &last = headers.back();
+
+    if (last.y + last.rows != last.height)
+        throw bmp::Exception("Shards do not cover the image");
+
+    std::int32_t width = last.width,
+                 height = last.height;
+
+    auto fail = [&](const std::string &message)
+    {
+        throw bmp::Exception("mergeShards(\"" + output + "\"): " + message);
+    };
+
+    int fd = ::open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+        fail(std::strerror(errno));
+
+    struct Close
+    {
+        int fd;
+        ~Close() { ::close(fd); }
+    } close_output{fd};
+
+    // Positioned writes of up to depth batches of rows in flight
+    const unsigned depth = 4;
+    const std::size_t batch_bytes = 4 << 20;
+
+    struct Batch
+    {
+        std::vector<std::uint8_t> data;
+        std::uint64_t offset = 0;
+        bool busy = false;
+    };
+
+    // Declared before the queue, so the buffers outlive the writes it has in flight
+    std::vector<Batch> batches(depth);
+    std::int64_t bytes_written = 0;
+
+    IOBackend backend = defaultFileIO().backend == IOBackend::Stream ? IOBackend::Threads : defaultFileIO().backend;
+    std::unique_ptr<IOQueue> queue = makeIOQueue(backend, depth);
+
+    // Writes the rest of a short write in place
+    auto finish = [&](Batch &batch, std::int64_t result)
+    {
+        batch.busy = false;
+
+        if (result < 0)
+            fail(std::strerror(-result));
+
+        for (std::size_t done = result; done < batch.data.size();)
+        {
+            ssize_t written = pwrite(fd, batch.data.data() + done, batch.data.size() - done, batch.offset + done);
+
+            if (written < 0 && errno != EINTR)
+                fail(std::strerror(errno));
+
+            if (written > 0)
+                done += written;
+        }
+
+        bytes_written += batch.data.size();
+    };
+
+    auto wait = [&](Batch &batch)
+    {
+        while (batch.busy)
+        {
+            IOQueue::Completion completion = queue->wait();
+            finish(batches[completion.tag], completion.result);
+        }
+    };
+
+    Stats::Scope scope(stats, "merge");
+
+    auto merge = [&](auto pixel)
+    {
+        using P = decltype(pixel);
+        using Bitmap = bmp::BasicBitmap<P>;
+
+        const bmp::Buffer header = Bitmap::bmp_header(width, height);
+        const std::uint64_t row_size = Bitmap::bmp_row_size(width);
+
+        // Full size up front, so bands can land in any order
+        if (pwrite(fd, header.data(), header.size(), 0) != (ssize_t)header.size() ||
+            ftruncate(fd, header.size() + row_size * height) < 0)
+            fail(std::strerror(errno));
+
+        int batch_rows = (int)std::max<std::uint64_t>(1, batch_bytes / row_size);
+        std::vector<P> rows((std::size_t)width * batch_rows);
+        std::size_t next = 0;
+
+        for (int shard = 0; shard < shards; ++shard)
+        {
+            const ShardHeader &band = headers[shard];
+
+            for (std::int32_t y0 = 0; y0 < band.rows; y0 += batch_rows)
+            {
+                std::int32_t count = std::min(batch_rows, band.rows - y0),
+                             bottom = band.y + y0 + count - 1;
+
+                if (!files[shard]->read(reinterpret_cast<char *>(rows.data()),
+                                        sizeof(P) * width * count))
+                    fail("Truncated shard " + framePath(pattern, shard));
+
+                Batch &batch = batches[next];
+                next = (next + 1) % depth;
+
+                wait(batch);
+
+                // Bottom row of the batch comes first in the file
+                batch.data.resize(row_size * count);
+                batch.offset = header.size() + row_size * (height - 1 - bottom);
+
+                for (std::int32_t i = 0; i < count; ++i)
+                    Bitmap::encode_bmp_row(&rows[(std::size_t)width * (count - 1 - i)], width,
+                                           batch.data.data() + row_size * i);
+
+                batch.busy = true;
+                queue->submit(true, fd, batch.data.data(), batch.data.size(), batch.offset,
+                              &batch - batches.data());
+            }
+        }
+
+        for (auto &batch : batches)
+            wait(batch);
+    };
+
+    try
+    {
+        switch ((affine::PixelFormat)last.format)
+        {
+        case affine::PixelFormat::Gray8:
+            merge(bmp::Gray8());
+            break;
+        case affine::PixelFormat::Gray16:
+            merge(bmp::Gray16());
+            break;
+        case affine::PixelFormat::RGB8:
+            merge(bmp::RGB8());
+            break;
+        case affine::PixelFormat::RGB16:
+            merge(bmp::RGB16());
+            break;
+        case affine::PixelFormat::RGBA8:
+            merge(bmp::RGBA8());
+            break;
+        }
+    }
+    catch (...)
+    {
+        // Writes still in flight complete before anything is freed, and the
+        // output, already sized in full, is not left looking finished
+        for (auto pending = std::count_if(batches.begin(), batches.end(), [](const Batch &batch)
+                                          { return batch.busy; });
+             pending > 0; --pending)
+        {
+            try
+            {
+                queue->wait();
+            }
+            catch (...)
+            {
+                break;
+            }
+        }
+
+        ::unlink(output.c_str());
+        throw;
+    }
+
+    if (stats)
+    {
+        stats->count("shards", shards);
+        stats->count("bytes_written", bytes_written);
+    }
+#endif
+}
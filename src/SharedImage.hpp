@@ -0,0 +1,173 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include "affine.hpp"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace affine
+{
+    /*
+     * Raw image exchanged through shared memory: this header at offset 0 and
+     * rows of format pixels, top row first, stride bytes apart from offset on.
+     * Specs name either a POSIX shared memory object ("shm:/name") or an open
+     * descriptor inherited from the caller, e.g. a memfd ("fd:3").
+     */
+    struct SharedImageHeader
+    {
+        char magic[4];         /* "AFIM" */
+        std::uint32_t format;  /* PixelFormat */
+        std::int32_t width;    /* Width of image */
+        std::int32_t height;   /* Height of image */
+        std::uint64_t stride;  /* Bytes between rows */
+        std::uint64_t offset;  /* Offset of the top row */
+    };
+
+    // Start of the pixels written by SharedImage, cache line aligned
+    constexpr std::size_t SHARED_IMAGE_OFFSET = 64;
+
+    inline bool isSharedImage(const std::string &spec)
+    {
+        return spec.compare(0, 4, "shm:") == 0 || spec.compare(0, 3, "fd:") == 0;
+    }
+
+    // Mapping of a shared image; transform() reads its pixels in place
+    class SharedImage
+    {
+    public:
+        // Maps an existing shared image read only
+        explicit SharedImage(const std::string &spec)
+            : spec(spec)
+        {
+            map(open(false), false);
+
+            const SharedImageHeader &header = *static_cast<const SharedImageHeader *>(mapping);
+
+            if (size < sizeof(SharedImageHeader) || std::memcmp(header.magic, "AFIM", 4) != 0)
+                fail("Not a shared image");
+
+            if (header.format > (std::uint32_t)PixelFormat::RGBA8 || header.width <= 0 || header.height <= 0 ||
+                header.stride < bytesPerPixel((PixelFormat)header.format) * header.width ||
+                header.offset > size || (size - header.offset) / header.stride < (std::uint64_t)header.height)
+                fail("Invalid shared image header");
+        }
+
+        // Creates (or resizes) a shared image for the given pixels and maps it writable
+        SharedImage(const std::string &spec, PixelFormat format, std::int32_t width, std::int32_t height)
+            : spec(spec)
+        {
+            std::size_t stride = bytesPerPixel(format) * width;
+            int fd = open(true);
+
+#ifndef _WIN32
+            if (ftruncate(fd, SHARED_IMAGE_OFFSET + stride * height) < 0)
+            {
+                close(fd);
+                fail(std::strerror(errno));
+            }
+#endif
+
+            map(fd, true);
+
+            SharedImageHeader header = {{'A', 'F', 'I', 'M'}, (std::uint32_t)format, width, height,
+                                        stride, SHARED_IMAGE_OFFSET};
+            std::memcpy(mapping, &header, sizeof(header));
+        }
+
+        ~SharedImage()
+        {
+#ifndef _WIN32
+            if (mapping)
+                munmap(mapping, size);
+#endif
+        }
+
+        SharedImage(const SharedImage &) = delete;
+        SharedImage &operator=(const SharedImage &) = delete;
+
+        ImageView view() const
+        {
+            const SharedImageHeader &header = *static_cast<const SharedImageHeader *>(mapping);
+
+            return {(PixelFormat)header.format, header.width, header.height, (std::size_t)header.stride,
+                    static_cast<const std::uint8_t *>(mapping) + header.offset};
+        }
+
+        std::uint8_t *data()
+        {
+            return static_cast<std::uint8_t *>(mapping) + static_cast<const SharedImageHeader *>(mapping)->offset;
+        }
+
+    private:
+        [[noreturn]] void fail(const std::string &message) const
+        {
+            throw bmp::Exception("SharedImage(\"" + spec + "\"): " + message);
+        }
+
+        int open(bool write) const
+        {
+#ifdef _WIN32
+            (void)write;
+            fail("Shared memory images are not supported on this platform");
+#else
+            int fd;
+
+            if (spec.compare(0, 3, "fd:") == 0)
+                fd = dup(std::atoi(spec.c_str() + 3));
+            else
+            {
+                std::string name = spec.substr(4);
+
+                if (name.empty() || name[0] != '/')
+                    name = "/" + name;
+
+                fd = shm_open(name.c_str(), write ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+            }
+
+            if (fd < 0)
+                fail(std::strerror(errno));
+
+            return fd;
+#endif
+        }
+
+        void map(int fd, bool write)
+        {
+#ifndef _WIN32
+            struct stat st;
+
+            if (fstat(fd, &st) < 0 || st.st_size == 0)
+            {
+                close(fd);
+                fail("Empty shared memory object");
+            }
+
+            size = st.st_size;
+            mapping = mmap(NULL, size, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+
+            if (mapping == MAP_FAILED)
+            {
+                mapping = nullptr;
+                fail(std::strerror(errno));
+            }
+#else
+            (void)fd;
+            (void)write;
+#endif
+        }
+
+        std::string spec;
+        void *mapping = nullptr;
+        std::size_t size = 0;
+    };
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "BitmapPlusPlus.hpp"
+
+/*
+ * Line protocol of the transform server over a Unix domain socket. Every
+ * request is one line (a command and its arguments, double quotes group
+ * arguments with spaces) and is answered with one line:
+ *
+ *   transform <affine_transform arguments>  ->  ok <width> <height> <seconds>
+ *   stats                                   ->  ok <latency metrics as JSON>
+ *   shutdown                                ->  ok
+ *
+ * Failures are answered with "error <message>". Images may be passed as
+ * shared memory ("shm:/name") to avoid the filesystem.
+ */
+constexpr const char *DEFAULT_SOCKET = "/tmp/affine_transform.sock";
+
+inline sockaddr_un socketAddress(const std::string &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof(address.sun_path))
+        throw bmp::Exception("Socket path is too long: " + path);
+
+    std::strcpy(address.sun_path, path.c_str());
+
+    return address;
+}
+
+inline int connectSocket(const std::string &path)
+{
+    sockaddr_un address = socketAddress(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0 || connect(fd, (sockaddr *)&address, sizeof(address)) < 0)
+    {
+        std::string error = std::strerror(errno);
+
+        if (fd >= 0)
+            close(fd);
+
+        throw bmp::Exception("Failed to connect to " + path + ": " + error);
+    }
+
+    return fd;
+}
+
+// Listens on path, replacing a stale socket file left by a previous server
+inline int listenSocket(const std::string &path)
+{
+    sockaddr_un address = socketAddress(path);
+
+    unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0 || bind(fd, (sockaddr *)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        std::string error = std::strerror(errno);
+
+        if (fd >= 0)
+            close(fd);
+
+        throw bmp::Exception("Failed to listen on " + path + ": " + error);
+    }
+
+    return fd;
+}
+
+inline void writeAll(int fd, const std::string &data)
+{
+    std::size_t written = 0;
+
+    while (written < data.size())
+    {
+        ssize_t n = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            throw bmp::Exception(std::string("Failed to write to socket: ") + std::strerror(errno));
+
+        written += n;
+    }
+}
+
+// Buffered reader of newline terminated lines
+class LineReader
+{
+public:
+    explicit LineReader(int fd) : fd(fd) {}
+
+    // Returns false at the end of the stream
+    bool read(std::string &line)
+    {
+        while (true)
+        {
+            std::size_t end = buffer.find('\n');
+
+            if (end != std::string::npos)
+            {
+                line = buffer.substr(0, end);
+                buffer.erase(0, end + 1);
+
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+
+                return true;
+            }
+
+            char chunk[4096];
+            ssize_t n = ::read(fd, chunk, sizeof(chunk));
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n <= 0)
+                return false;
+
+            buffer.append(chunk, n);
+        }
+    }
+
+private:
+    int fd;
+    std::string buffer;
+};
+
+// Splits a request line into arguments
+inline std::vector<std::string> splitArgs(const std::string &line)
+{
+    std::vector<std::string> args;
+    std::string arg;
+    bool quoted = false,
+         started = false;
+
+    for (char c : line)
+    {
+        if (c == '"')
+        {
+            quoted = !quoted;
+            started = true;
+        }
+        else if (!quoted && (c == ' ' || c == '\t'))
+        {
+            if (started)
+                args.push_back(arg);
+
+            arg.clear();
+            started = false;
+        }
+        else
+        {
+            arg += c;
+            started = true;
+        }
+    }
+
+    if (quoted)
+        throw bmp::Exception("Unterminated quote in request");
+
+    if (started)
+        args.push_back(arg);
+
+    return args;
+}
+
+// Joins arguments into a request line, quoting those with spaces
+inline std::string joinArgs(const std::vector<std::string> &args)
+{
+    std::string line;
+
+    for (const auto &arg : args)
+    {
+        if (!line.empty())
+            line += ' ';
+
+        if (arg.empty() || arg.find_first_of(" \t") != std::string::npos)
+            line += '"' + arg + '"';
+        else
+            line += arg;
+    }
+
+    return line;
+}
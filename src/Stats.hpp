@@ -0,0 +1,172 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// CPU seconds consumed by the calling thread
+inline double threadCpuTime()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+    return ((std::uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) * 1e-7 +
+           ((std::uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime) * 1e-7;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// CPU seconds consumed by all threads of the process
+inline double processCpuTime()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    return ((std::uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) * 1e-7 +
+           ((std::uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime) * 1e-7;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+inline double wallTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Collects stage timings, per-thread and per-tile render timings and named
+ * counters. Workers accumulate locally and report once when they finish, so
+ * the mutex is never taken inside a render loop. A null Stats pointer disables
+ * collection everywhere.
+ */
+class Stats
+{
+public:
+    struct Stage
+    {
+        std::string name;
+        double wall,
+            cpu;
+    };
+
+    struct Thread
+    {
+        int id;
+        double wall,
+            cpu;
+        std::int64_t tiles,
+            pixels;
+    };
+
+    // Times the enclosing scope as a stage; does nothing without stats
+    class Scope
+    {
+    public:
+        Scope(Stats *stats, const char *name)
+            : stats(stats), name(name),
+              wall(stats ? wallTime() : 0), cpu(stats ? processCpuTime() : 0)
+        {
+        }
+
+        ~Scope()
+        {
+            if (stats)
+                stats->addStage(name, wallTime() - wall, processCpuTime() - cpu);
+        }
+
+    private:
+        Stats *stats;
+        const char *name;
+        double wall,
+            cpu;
+    };
+
+    void addStage(const std::string &name, double wall, double cpu)
+    {
+        const std::unique_lock<std::mutex> lock(mutex);
+        stages.push_back({name, wall, cpu});
+    }
+
+    void addThread(const Thread &thread, const std::vector<double> &tile_times)
+    {
+        const std::unique_lock<std::mutex> lock(mutex);
+        threads.push_back(thread);
+        tiles.insert(tiles.end(), tile_times.begin(), tile_times.end());
+    }
+
+    void count(const std::string &name, std::int64_t value)
+    {
+        const std::unique_lock<std::mutex> lock(mutex);
+        counters[name] += value;
+    }
+
+    void write(std::ostream &os)
+    {
+        const std::unique_lock<std::mutex> lock(mutex);
+
+        os << std::setprecision(9) << "{\n  \"stages\": [";
+        for (std::size_t i = 0; i < stages.size(); ++i)
+            os << (i ? "," : "") << "\n    {\"name\": \"" << stages[i].name
+               << "\", \"wall_seconds\": " << stages[i].wall
+               << ", \"cpu_seconds\": " << stages[i].cpu << "}";
+
+        os << "\n  ],\n  \"threads\": [";
+        std::sort(threads.begin(), threads.end(), [](const Thread &a, const Thread &b)
+                  { return a.id < b.id; });
+        for (std::size_t i = 0; i < threads.size(); ++i)
+            os << (i ? "," : "") << "\n    {\"id\": " << threads[i].id
+               << ", \"wall_seconds\": " << threads[i].wall
+               << ", \"cpu_seconds\": " << threads[i].cpu
+               << ", \"tiles\": " << threads[i].tiles
+               << ", \"pixels\": " << threads[i].pixels << "}";
+
+        os << "\n  ],\n  \"tiles\": {\"count\": " << tiles.size();
+        if (!tiles.empty())
+        {
+            std::sort(tiles.begin(), tiles.end());
+            double sum = 0;
+            for (double t : tiles)
+                sum += t;
+
+            os << ", \"min_seconds\": " << tiles.front()
+               << ", \"mean_seconds\": " << sum / tiles.size()
+               << ", \"p50_seconds\": " << tiles[tiles.size() / 2]
+               << ", \"p99_seconds\": " << tiles[tiles.size() * 99 / 100]
+               << ", \"max_seconds\": " << tiles.back();
+        }
+
+        os << "},\n  \"counters\": {";
+        bool first = true;
+        for (const auto &counter : counters)
+        {
+            os << (first ? "" : ",") << "\n    \"" << counter.first << "\": " << counter.second;
+            first = false;
+        }
+        os << "\n  }\n}" << std::endl;
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<Stage> stages;
+    std::vector<Thread> threads;
+    std::vector<double> tiles;
+    std::map<std::string, std::int64_t> counters;
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <functional>
+#include <exception>
+#include <condition_variable>
+#include "Numa.hpp"
+
+/*
+ * Fixed set of worker threads kept alive between renders. run() queues count
+ * jobs and blocks until all of them finished, so several callers may share
+ * one pool concurrently. A caller must not be one of the pool's own workers.
+ */
+class ThreadPool
+{
+public:
+    using Job = std::function<void(int)>;
+
+    // With numa, worker i is pinned to node i % nodes
+    explicit ThreadPool(int size, bool numa = false)
+    {
+        for (int i = 0; i < size; ++i)
+            workers.emplace_back([this, i, numa]
+                                 {
+                                     if (numa)
+                                         pinToNode(i);
+
+                                     work(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            const std::unique_lock<std::mutex> lock(mutex);
+            stopped = true;
+        }
+
+        wake.notify_all();
+
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    int size() const
+    {
+        return workers.size();
+    }
+
+    // Runs job(0) ... job(count - 1) on the workers; rethrows the first failure
+    void run(int count, const Job &job)
+    {
+        Batch batch;
+        batch.job = &job;
+        batch.remaining = count;
+
+        {
+            const std::unique_lock<std::mutex> lock(mutex);
+
+            for (int i = 0; i < count; ++i)
+                tasks.push_back({&batch, i});
+        }
+
+        wake.notify_all();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        batch.finished.wait(lock, [&batch]
+                            { return batch.remaining == 0; });
+
+        if (batch.error)
+            std::rethrow_exception(batch.error);
+    }
+
+private:
+    struct Batch
+    {
+        const Job *job;
+        int remaining;
+        std::exception_ptr error;
+        std::condition_variable finished;
+    };
+
+    struct Task
+    {
+        Batch *batch;
+        int index;
+    };
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true)
+        {
+            wake.wait(lock, [this]
+                      { return stopped || !tasks.empty(); });
+
+            if (tasks.empty())
+                return;
+
+            Task task = tasks.front();
+            tasks.pop_front();
+
+            lock.unlock();
+
+            std::exception_ptr error;
+
+            try
+            {
+                (*task.batch->job)(task.index);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            lock.lock();
+
+            if (error && !task.batch->error)
+                task.batch->error = error;
+
+            if (--task.batch->remaining == 0)
+                task.batch->finished.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<Task> tasks;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopped = false;
+};
+
+// Runs job(0) ... job(count - 1) concurrently, on the pool when given or on fresh threads
+inline void parallelRun(ThreadPool *pool, int count, const ThreadPool::Job &job)
+{
+    if (pool)
+    {
+        pool->run(count, job);
+        return;
+    }
+
+    std::vector<std::thread> threads(count);
+
+    for (int i = 0; i < count; ++i)
+        threads[i] = std::thread(job, i);
+
+    for (auto &t : threads)
+        t.join();
+}
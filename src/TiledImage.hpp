@@ -0,0 +1,208 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include "affine.hpp"
+#include "Lz4.hpp"
+
+namespace affine
+{
+    /*
+     * Native tiled raster (".atf"): this header, an index of tile_count
+     * TiledImageEntry records and the tiles, row-major from the top-left.
+     * A tile holds its rows of format pixels, top row first and clipped at
+     * the image edges, LZ4 block compressed unless that did not shrink it
+     * (size equals the raw size then). Tiles can be read in any order, so
+     * a render reads only those covering the source pixels it samples.
+     */
+    struct TiledImageHeader
+    {
+        char magic[4];           /* "AFTL" */
+        std::uint32_t format;    /* PixelFormat */
+        std::int32_t width;      /* Width of image */
+        std::int32_t height;     /* Height of image */
+        std::uint32_t tile_size; /* Width and height of full tiles */
+        std::uint32_t reserved;  /* Zero */
+    };
+
+    struct TiledImageEntry
+    {
+        std::uint64_t offset; /* Offset of the tile from the start of the file */
+        std::uint64_t size;   /* Stored bytes */
+    };
+
+    constexpr std::uint32_t TILED_IMAGE_TILE_SIZE = 256;
+
+    inline bool isTiledImage(const std::string &filename)
+    {
+        return filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".atf") == 0;
+    }
+
+    class TiledImage
+    {
+    public:
+        explicit TiledImage(const std::string &filename)
+            : filename(filename), ifs(filename, std::ios::binary)
+        {
+            if (!ifs)
+                fail("Failed to open file");
+
+            if (!ifs.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+                std::memcmp(header.magic, "AFTL", 4) != 0)
+                fail("Not a tiled image");
+
+            if (header.format > (std::uint32_t)PixelFormat::RGBA8 || header.width <= 0 || header.height <= 0 ||
+                header.tile_size == 0 || header.tile_size > 65536)
+                fail("Invalid tiled image header");
+
+            index.resize((std::size_t)columns() * rows());
+
+            if (!ifs.read(reinterpret_cast<char *>(index.data()), sizeof(TiledImageEntry) * index.size()))
+                fail("Truncated tile index");
+        }
+
+        PixelFormat format() const { return (PixelFormat)header.format; }
+
+        std::int32_t width() const { return header.width; }
+
+        std::int32_t height() const { return header.height; }
+
+        int columns() const { return (header.width + header.tile_size - 1) / header.tile_size; }
+
+        int rows() const { return (header.height + header.tile_size - 1) / header.tile_size; }
+
+        // Reads the tiles overlapping window into an image sized buffer with the given stride
+        void read(const Region &window, std::uint8_t *data, std::size_t stride)
+        {
+            int tile = header.tile_size,
+                first_column = std::max(0, window.x / tile),
+                first_row = std::max(0, window.y / tile),
+                last_column = std::min(columns() - 1, (window.x + window.width - 1) / tile),
+                last_row = std::min(rows() - 1, (window.y + window.height - 1) / tile);
+
+            std::size_t pixel_size = bytesPerPixel(format());
+            std::vector<std::uint8_t> stored, pixels;
+
+            for (int row = first_row; row <= last_row; ++row)
+            {
+                for (int column = first_column; column <= last_column; ++column)
+                {
+                    const TiledImageEntry &entry = index[(std::size_t)row * columns() + column];
+
+                    int x = column * tile,
+                        y = row * tile,
+                        tile_width = std::min(tile, header.width - x),
+                        tile_height = std::min(tile, header.height - y);
+
+                    std::size_t row_size = pixel_size * tile_width,
+                                raw_size = row_size * tile_height;
+
+                    if (entry.size > raw_size)
+                        fail("Invalid tile size");
+
+                    stored.resize(entry.size);
+
+                    if (!ifs.seekg(entry.offset) || !ifs.read(reinterpret_cast<char *>(stored.data()), entry.size))
+                        fail("Truncated tile");
+
+                    const std::uint8_t *source = stored.data();
+
+                    if (entry.size < raw_size)
+                    {
+                        pixels.resize(raw_size);
+                        lz4::decompress(stored.data(), stored.size(), pixels.data(), raw_size);
+                        source = pixels.data();
+                    }
+
+                    for (int i = 0; i < tile_height; ++i)
+                        std::memcpy(data + stride * (y + i) + pixel_size * x, source + row_size * i, row_size);
+
+                    ++tiles_read;
+                }
+            }
+        }
+
+        // Tiles read so far
+        std::int64_t tiles_read = 0;
+
+    private:
+        [[noreturn]] void fail(const std::string &message) const
+        {
+            throw bmp::Exception("TiledImage(\"" + filename + "\"): " + message);
+        }
+
+        std::string filename;
+        std::ifstream ifs;
+        TiledImageHeader header;
+        std::vector<TiledImageEntry> index;
+    };
+
+    inline void writeTiledImage(const ImageView &view, const std::string &filename,
+                                std::uint32_t tile_size = TILED_IMAGE_TILE_SIZE, bool compress = true)
+    {
+        std::ofstream ofs(filename, std::ios::binary);
+
+        auto fail = [&](const std::string &message)
+        {
+            throw bmp::Exception("writeTiledImage(\"" + filename + "\"): " + message);
+        };
+
+        if (!ofs)
+            fail("Failed to open file");
+
+        TiledImageHeader header = {{'A', 'F', 'T', 'L'}, (std::uint32_t)view.format, view.width, view.height, tile_size, 0};
+
+        int columns = (view.width + tile_size - 1) / tile_size,
+            rows = (view.height + tile_size - 1) / tile_size;
+
+        std::vector<TiledImageEntry> index((std::size_t)columns * rows);
+        std::uint64_t offset = sizeof(header) + sizeof(TiledImageEntry) * index.size();
+
+        ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        ofs.write(reinterpret_cast<const char *>(index.data()), sizeof(TiledImageEntry) * index.size());
+
+        std::size_t pixel_size = bytesPerPixel(view.format);
+        std::vector<std::uint8_t> pixels;
+
+        for (int row = 0; row < rows; ++row)
+        {
+            for (int column = 0; column < columns; ++column)
+            {
+                int x = column * tile_size,
+                    y = row * tile_size,
+                    tile_width = std::min<int>(tile_size, view.width - x),
+                    tile_height = std::min<int>(tile_size, view.height - y);
+
+                std::size_t row_size = pixel_size * tile_width;
+                pixels.resize(row_size * tile_height);
+
+                for (int i = 0; i < tile_height; ++i)
+                    std::memcpy(pixels.data() + row_size * i,
+                                static_cast<const std::uint8_t *>(view.data) + view.stride * (y + i) + pixel_size * x,
+                                row_size);
+
+                std::vector<std::uint8_t> packed;
+
+                if (compress)
+                    packed = lz4::compress(pixels.data(), pixels.size());
+
+                const std::vector<std::uint8_t> &stored = compress && packed.size() < pixels.size() ? packed : pixels;
+
+                ofs.write(reinterpret_cast<const char *>(stored.data()), stored.size());
+
+                index[(std::size_t)row * columns + column] = {offset, stored.size()};
+                offset += stored.size();
+            }
+        }
+
+        ofs.seekp(sizeof(header));
+        ofs.write(reinterpret_cast<const char *>(index.data()), sizeof(TiledImageEntry) * index.size());
+
+        if (!ofs)
+            fail("Failed to write file");
+    }
+}
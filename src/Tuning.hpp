@@ -0,0 +1,203 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <filesystem>
+#include "Job.hpp"
+#include "OpenGL.hpp"
+#include "affine.hpp"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/*
+ * Choices behind "--threads auto" and "--device auto". Thread count follows
+ * the hardware and the output size, tile size the L2 cache, and the device
+ * a profile of this machine: render cost per output pixel on one CPU thread
+ * and on the GPU, plus the GPU's setup time. The profile is measured once by
+ * a small benchmark and stored on disk (delete the file to measure again).
+ */
+struct Profile
+{
+    double cpu_pixel = 0,
+           gpu_pixel = 0,
+           gpu_setup = 0;
+    bool gpu = false;
+};
+
+// $AFFINE_PROFILE, or affine_transform/profile in the user's cache directory
+inline std::filesystem::path profilePath()
+{
+    if (const char *path = std::getenv("AFFINE_PROFILE"))
+        return path;
+
+    std::filesystem::path base;
+
+    if (const char *cache = std::getenv("XDG_CACHE_HOME"))
+        base = cache;
+    else if (const char *home = std::getenv("HOME"))
+        base = std::filesystem::path(home) / ".cache";
+    else if (const char *local = std::getenv("LOCALAPPDATA"))
+        base = local;
+    else
+        base = std::filesystem::temp_directory_path();
+
+    return base / "affine_transform" / "profile";
+}
+
+// Times a rotation of a 512x512 image on one CPU thread and on the GPU
+inline Profile calibrate()
+{
+    const int size = 512;
+
+    bmp::Bitmap bitmap(size, size);
+
+    for (int y = 0; y < size; ++y)
+        for (int x = 0; x < size; ++x)
+            bitmap.m_pixels[y * size + x] = bmp::Pixel(x / 2, y / 2, (x ^ y) & 0xff);
+
+    affine::Image image(std::move(bitmap));
+    affine::Affine transform = affine::rotation(30);
+    affine::Region canvas = affine::outputRegion(size, size, transform);
+    double pixels = (double)canvas.width * canvas.height;
+
+    affine::Image output;
+
+    auto best = [&](const affine::Options &options)
+    {
+        double seconds = 1e9;
+
+        for (int i = 0; i < 3; ++i)
+        {
+            double start = wallTime();
+            output = affine::transform(image.view(), transform, options);
+            seconds = std::min(seconds, wallTime() - start);
+        }
+
+        return seconds;
+    };
+
+    Profile profile;
+    profile.cpu_pixel = best(affine::Options()) / pixels;
+
+    bmp::Bitmap::Pixels reference = output.bitmap<bmp::Pixel>().m_pixels;
+
+    try
+    {
+        double start = wallTime();
+        GPUContext context;
+        profile.gpu_setup = wallTime() - start;
+
+        affine::Options options;
+        options.device = affine::Device::GPU;
+        options.gpu = &context;
+
+        profile.gpu_pixel = best(options) / pixels;
+
+        // A driver that renders garbage is no faster than one that fails
+        const auto &rendered = output.bitmap<bmp::Pixel>().m_pixels;
+        std::size_t mismatches = 0;
+
+        for (std::size_t i = 0; i < reference.size() && i < rendered.size(); ++i)
+        {
+            for (int c = 0; c < bmp::Pixel::channels; ++c)
+                mismatches += std::abs(reference[i][c] - rendered[i][c]) > 2;
+        }
+
+        profile.gpu = rendered.size() == reference.size() && mismatches * 100 < reference.size();
+    }
+    catch (const bmp::Exception &)
+    {
+        // No usable GPU: auto always picks the CPU
+    }
+
+    return profile;
+}
+
+// Stored profile of this machine, measured and stored first when missing
+inline Profile machineProfile()
+{
+    std::filesystem::path path = profilePath();
+    Profile profile;
+
+    {
+        std::ifstream ifs(path);
+        std::string version;
+
+        if (std::getline(ifs, version) && version == "affine_transform profile 1" &&
+            ifs >> profile.cpu_pixel >> profile.gpu_pixel >> profile.gpu_setup >> profile.gpu)
+            return profile;
+    }
+
+    profile = calibrate();
+
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+
+    std::ofstream ofs(path);
+    ofs << "affine_transform profile 1\n"
+        << profile.cpu_pixel << ' ' << profile.gpu_pixel << ' ' << profile.gpu_setup << ' ' << profile.gpu << '\n';
+
+    return profile;
+}
+
+// One thread per 128x128 output pixels, at most one per hardware thread:
+// smaller shares cost more to start than they save
+inline int autoThreads(std::int64_t pixels)
+{
+    std::int64_t hardware = std::max(1u, std::thread::hardware_concurrency());
+
+    return std::clamp<std::int64_t>(pixels / (128 * 128), 1, hardware);
+}
+
+// Largest power of two tile whose output and source pixels fill at most half
+// of the L2 cache
+inline int autoTileSize(affine::PixelFormat format)
+{
+    long cache = 0;
+
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+
+    if (cache <= 0)
+        cache = 256 * 1024;
+
+    std::size_t pixel_size = affine::bytesPerPixel(format);
+    int tile = 256;
+
+    while (tile > 16 && 2 * pixel_size * tile * tile > (std::size_t)cache / 2)
+        tile /= 2;
+
+    return tile;
+}
+
+// Faster device for frames renders of pixels each; setup is paid once
+// unless a GL context is already warm
+inline int autoDevice(const Profile &profile, std::int64_t pixels, int threads, int frames = 1, bool gpu_ready = false)
+{
+    if (!profile.gpu)
+        return 1;
+
+    double work = (double)pixels * frames,
+           cpu = work * profile.cpu_pixel / threads,
+           gpu = work * profile.gpu_pixel + (gpu_ready ? 0 : profile.gpu_setup);
+
+    return gpu < cpu ? 2 : 1;
+}
+
+// Resolves the job's automatic thread count and device for frames outputs of pixels each
+inline void tuneJob(Job &job, std::int64_t pixels, int frames = 1)
+{
+    if (!job.threads_number)
+        job.threads_number = autoThreads(pixels);
+
+    if (!job.device)
+        job.device = autoDevice(machineProfile(), pixels, job.threads_number, frames);
+}
@@ -0,0 +1,795 @@
+#include <iostream>
+#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include "affine.hpp"
+#include "matrix.hpp"
+#include "Converters.hpp"
+#include "SharedImage.hpp"
+#include "TiledImage.hpp"
+#include "Swizzle.hpp"
+#include "AsyncFile.hpp"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+namespace affine
+{
+    namespace
+    {
+        // Calls fn with a default constructed pixel of the given format
+        template <class F>
+        decltype(auto) dispatch(PixelFormat format, F fn)
+        {
+            switch (format)
+            {
+            case PixelFormat::Gray8:
+                return fn(bmp::Gray8());
+            case PixelFormat::Gray16:
+                return fn(bmp::Gray16());
+            case PixelFormat::RGB8:
+                return fn(bmp::RGB8());
+            case PixelFormat::RGB16:
+                return fn(bmp::RGB16());
+            case PixelFormat::RGBA8:
+                return fn(bmp::RGBA8());
+            }
+
+            throw bmp::Exception("Invalid pixel format");
+        }
+
+        // Calls fn with the CPURender edge policy of the given mode
+        template <class F>
+        decltype(auto) dispatchEdge(EdgeMode edge, F fn)
+        {
+            switch (edge)
+            {
+            case EdgeMode::Constant:
+                return fn(ConstantEdge());
+            case EdgeMode::Clamp:
+                return fn(ClampEdge());
+            case EdgeMode::Wrap:
+                return fn(WrapEdge());
+            case EdgeMode::Mirror:
+                return fn(MirrorEdge());
+            }
+
+            throw bmp::Exception("Invalid edge mode");
+        }
+
+        // Calls fn with std::true_type or std::false_type
+        template <class F>
+        decltype(auto) dispatchLinear(bool linear, F fn)
+        {
+            if (linear)
+                return fn(std::true_type());
+
+            return fn(std::false_type());
+        }
+
+        template <class P>
+        bmp::BasicView<P> typedView(const ImageView &view)
+        {
+            return {static_cast<const std::uint8_t *>(view.data), view.width, view.height, view.stride};
+        }
+
+        // Whole standard input, read once: pipes cannot seek, while the loaders do
+        const std::string &standardInput()
+        {
+            static const std::string data = []
+            {
+#ifdef _WIN32
+                _setmode(_fileno(stdin), _O_BINARY);
+#endif
+                std::ostringstream os;
+                os << std::cin.rdbuf();
+                return os.str();
+            }();
+
+            return data;
+        }
+
+        // Copies a view into an image of the given format
+        Image copy(const ImageView &view, PixelFormat format)
+        {
+            return dispatch(view.format, [&](auto native)
+                            {
+                                bmp::BasicBitmap<decltype(native)> bitmap(typedView<decltype(native)>(view));
+
+                                return dispatch(format, [&](auto pixel)
+                                                { return Image(bitmap.template convert<decltype(pixel)>()); }); });
+        }
+
+        // Perspective matrices must keep the whole source in front of the
+        // viewer: a corner mapped to w <= 0 has no place on the canvas. And
+        // every corner must land within the int coordinates of transformedBounds
+        void checkCanvas(std::int32_t width, std::int32_t height, const std::vector<std::vector<double>> &matrix)
+        {
+            for (int corner = 0; corner < 4; ++corner)
+            {
+                double x = corner & 1 ? width : 0,
+                       y = corner & 2 ? height : 0;
+
+                auto transformed = multiplyMatrices({{x, y, 1}}, matrix);
+                double w = transformed[0][2];
+
+                if (w <= 0)
+                    throw bmp::Exception("Perspective transform maps the image beyond the horizon");
+
+                if (!(std::abs(transformed[0][0] / w) < 1 << 30 && std::abs(transformed[0][1] / w) < 1 << 30))
+                    throw bmp::Exception("Transformed image is too large");
+            }
+        }
+
+        // Source pixels sampled for the output window of bounds, clipped to
+        // the source; empty when the window misses it
+        Region footprint(std::int32_t width, std::int32_t height,
+                         const std::vector<std::vector<double>> &invMatrix,
+                         const Bounds &bounds)
+        {
+            double min_x = INFINITY, min_y = INFINITY,
+                   max_x = -INFINITY, max_y = -INFINITY;
+
+            for (int corner = 0; corner < 4; ++corner)
+            {
+                double x = bounds.x_offset + (corner & 1 ? bounds.width : 0),
+                       y = bounds.y_offset + (corner & 2 ? bounds.height : 0);
+
+                auto coord = multiplyMatrices({{x, y, 1}}, invMatrix);
+                double w = coord[0][2];
+
+                // The window reaches the horizon: it may sample anything
+                if (w <= 0)
+                    return {0, 0, width, height};
+
+                min_x = std::min(min_x, coord[0][0] / w);
+                max_x = std::max(max_x, coord[0][0] / w);
+                min_y = std::min(min_y, coord[0][1] / w);
+                max_y = std::max(max_y, coord[0][1] / w);
+            }
+
+            // Samples lie half a pixel inside the corners, bilinear taps one pixel beyond them
+            int x0 = std::max<double>(0, std::floor(min_x - 0.5)),
+                y0 = std::max<double>(0, std::floor(min_y - 0.5)),
+                x1 = std::min<double>(width, std::floor(max_x - 0.5) + 2),
+                y1 = std::min<double>(height, std::floor(max_y - 0.5) + 2);
+
+            Region region;
+
+            if (x0 < x1 && y0 < y1)
+                region = {x0, y0, x1 - x0, y1 - y0};
+
+            return region;
+        }
+
+        // Bounds of the whole canvas, or of the options' window of it
+        Bounds outputBounds(std::int32_t width, std::int32_t height, const Affine &affine, const Region &roi)
+        {
+            Bounds bounds = transformedBounds(width, height, affine.matrix, affine.x, affine.y);
+
+            if (roi.width > 0)
+            {
+                bounds.x_offset += roi.x;
+                bounds.y_offset += roi.y;
+                bounds.width = roi.width;
+                bounds.height = roi.height;
+            }
+
+            return bounds;
+        }
+
+        template <class P>
+        bmp::BasicBitmap<P> render(const bmp::BasicView<P> &input, const Affine &affine, const Options &options)
+        {
+            std::vector<std::vector<double>> invMatrix;
+            Bounds bounds,
+                canvas;
+            bmp::BasicView<P> source = input;
+
+            {
+                Stats::Scope scope(options.stats, "bounds");
+
+                invMatrix = inverseMatrix(affine.matrix);
+                bounds = outputBounds(input.width, input.height, affine, options.roi);
+                canvas = outputBounds(input.width, input.height, affine, Region());
+
+                // Crops the source to the window's footprint; a resident GPU
+                // texture holds the whole source, and edges other than the
+                // constant one are those of the whole source. Perspectives
+                // are not cropped either: moving the origin through the
+                // divide would round windows differently from the canvas
+                Region window;
+
+                if (options.roi.width > 0 && !options.resident_source && options.edge == EdgeMode::Constant &&
+                    !isProjective(invMatrix))
+                {
+                    // Sharpening also samples the pixels around the window
+                    int apron = options.post.sharpen != 0;
+                    Bounds sampled = {bounds.width + 2 * apron, bounds.height + 2 * apron,
+                                      bounds.x_offset - apron, bounds.y_offset - apron};
+
+                    window = footprint(input.width, input.height, invMatrix, sampled);
+                }
+
+                if (window.width > 0)
+                {
+                    invMatrix[2][0] -= window.x;
+                    invMatrix[2][1] -= window.y;
+
+                    source = {input.data + input.stride * window.y + sizeof(P) * window.x,
+                              window.width, window.height, input.stride};
+                }
+            }
+
+            Stats::Scope scope(options.stats, "render");
+
+            P border = bmp::convert_pixel<P>(options.border);
+
+            if (options.device == Device::GPU)
+            {
+                return GPURender(source.width, source.height,
+                                 bounds.width, bounds.height,
+                                 bounds.x_offset, bounds.y_offset,
+                                 invMatrix, source, options.stats, options.gpu,
+                                 !options.resident_source, (int)options.edge, border, options.linear,
+                                 options.post, canvas);
+            }
+
+            // One kernel per edge policy and blending space, both inlined
+            // into its inner loop
+            auto cpu = [&](const auto &pixels)
+            {
+                return dispatchEdge(options.edge, [&](auto edge)
+                                    { return dispatchLinear(options.linear, [&](auto linear)
+                                                            { return CPURender<decltype(edge), linear>(source.width, source.height,
+                                                                                                      bounds.width, bounds.height,
+                                                                                                      bounds.x_offset, bounds.y_offset,
+                                                                                                      invMatrix, pixels,
+                                                                                                      options.threads, options.stats,
+                                                                                                      options.progress, options.tile_size,
+                                                                                                      options.pool, options.numa, border,
+                                                                                                      options.post, canvas); }); });
+            };
+
+            if (options.layout == SourceLayout::Rows)
+                return cpu(source);
+
+            std::unique_ptr<SwizzledImage<P>> swizzled;
+
+            {
+                Stats::Scope scope(options.stats, "swizzle");
+
+                swizzled.reset(new SwizzledImage<P>(source, options.layout));
+            }
+
+            return cpu(*swizzled);
+        }
+    }
+
+    Affine compose(const Affine &first, const Affine &second)
+    {
+        auto full = [](const Affine &affine)
+        {
+            auto matrix = affine.matrix;
+            matrix[2][0] += affine.x;
+            matrix[2][1] += affine.y;
+            return matrix;
+        };
+
+        auto matrix = multiplyMatrices(full(first), full(second));
+
+        Affine result;
+
+        // A translation before the divide moves the image by different
+        // amounts across the canvas, so it stays in the matrix
+        if (isProjective(matrix))
+        {
+            result.matrix = matrix;
+            return result;
+        }
+
+        result.x = std::lround(matrix[2][0]);
+        result.y = std::lround(matrix[2][1]);
+
+        matrix[2][0] = matrix[2][1] = 0;
+        result.matrix = matrix;
+
+        return result;
+    }
+
+    Affine fold(const std::vector<Affine> &steps)
+    {
+        Affine result;
+
+        for (const auto &step : steps)
+            result = compose(result, step);
+
+        return result;
+    }
+
+    Affine rotation(double angle)
+    {
+        Affine result;
+        result.matrix = genMatrix(angle, 1, 1, 1, 0, 0);
+        return result;
+    }
+
+    Affine scaling(double horizontal, double vertical)
+    {
+        Affine result;
+        result.matrix = genMatrix(0, horizontal, vertical, 1, 0, 0);
+        return result;
+    }
+
+    Affine skewing(double horizontal, double vertical)
+    {
+        double intpart;
+
+        if (std::modf(horizontal, &intpart) == 0.0 &&
+            ((int)intpart % 180) == 90)
+            throw bmp::Exception("Invalid horizontal skew");
+
+        if (std::modf(vertical, &intpart) == 0.0 &&
+            ((int)intpart % 180) == 90)
+            throw bmp::Exception("Invalid vertical skew");
+
+        Affine result;
+        result.matrix = genMatrix(0, 1, 1, 1, horizontal, vertical);
+        return result;
+    }
+
+    Affine translation(int x, int y)
+    {
+        Affine result;
+        result.x = x;
+        result.y = y;
+        return result;
+    }
+
+    Affine fromMatrix(const std::vector<double> &values)
+    {
+        if (values.size() != 6 && values.size() != 9)
+            throw bmp::Exception("Transform matrix is invalid");
+
+        Affine result;
+
+        if (values.size() == 9)
+        {
+            if (values[6] == 0 && values[7] == 0 && values[8] == 0)
+                throw bmp::Exception("Transform matrix is invalid");
+
+            // The perspective terms divide the translation as well
+            result.matrix = {
+                {values[0], values[1], values[6]},
+                {values[3], values[4], values[7]},
+                {values[2], values[5], values[8]}};
+
+            if (!isProjective(result.matrix))
+                return fromMatrix({values[0], values[1], values[2], values[3], values[4], values[5]});
+
+            return result;
+        }
+
+        result.matrix = {
+            {values[0], values[1], 0},
+            {values[3], values[4], 0},
+            {0, 0, 1}};
+
+        result.x = values[2], result.y = values[5];
+        return result;
+    }
+
+    Affine parseStep(const std::string &step)
+    {
+        std::vector<std::string> parts;
+        std::size_t start = 0,
+                    end;
+
+        do
+        {
+            end = step.find(':', start);
+            parts.push_back(step.substr(start, end - start));
+            start = end + 1;
+        } while (end != std::string::npos);
+
+        const std::string &name = parts[0];
+        std::vector<double> values;
+
+        for (std::size_t i = 1; i < parts.size(); ++i)
+        {
+            char *end;
+            double value = std::strtod(parts[i].c_str(), &end);
+
+            if (parts[i].empty() || *end)
+                throw bmp::Exception("Invalid transform step " + step);
+
+            values.push_back(value);
+        }
+
+        auto expect = [&](std::size_t min, std::size_t max)
+        {
+            if (values.size() < min || values.size() > max)
+                throw bmp::Exception("Invalid transform step " + step);
+        };
+
+        if (name == "rotate")
+        {
+            expect(1, 1);
+            return rotation(values[0]);
+        }
+
+        if (name == "scale")
+        {
+            expect(1, 2);
+            return scaling(values[0], values.back());
+        }
+
+        if (name == "skew")
+        {
+            expect(1, 2);
+            return skewing(values[0], values.size() > 1 ? values[1] : 0);
+        }
+
+        if (name == "translate")
+        {
+            expect(1, 2);
+            return translation(std::lround(values[0]), values.size() > 1 ? std::lround(values[1]) : 0);
+        }
+
+        if (name == "hflip" || name == "vflip")
+        {
+            expect(0, 0);
+            return name == "hflip" ? scaling(-1, 1) : scaling(1, -1);
+        }
+
+        if (name == "matrix")
+            return fromMatrix(values);
+
+        throw bmp::Exception("Unknown transform step " + step);
+    }
+
+    Region outputRegion(std::int32_t width, std::int32_t height, const Affine &affine)
+    {
+        checkCanvas(width, height, affine.matrix);
+
+        Bounds bounds = transformedBounds(width, height, affine.matrix, affine.x, affine.y);
+
+        Region region;
+        region.width = bounds.width;
+        region.height = bounds.height;
+        return region;
+    }
+
+    Region sourceRegion(std::int32_t width, std::int32_t height, const Affine &affine, const Region &roi)
+    {
+        Region region;
+        region.width = width;
+        region.height = height;
+
+        if (roi.width <= 0)
+            return region;
+
+        checkCanvas(width, height, affine.matrix);
+
+        return footprint(width, height, inverseMatrix(affine.matrix), outputBounds(width, height, affine, roi));
+    }
+
+    std::int32_t Image::width() const
+    {
+        return std::visit([](const auto &bitmap)
+                          { return bitmap.width(); },
+                          storage);
+    }
+
+    std::int32_t Image::height() const
+    {
+        return std::visit([](const auto &bitmap)
+                          { return bitmap.height(); },
+                          storage);
+    }
+
+    ImageView Image::view() const
+    {
+        return std::visit([this](const auto &bitmap)
+                          {
+                              auto view = bitmap.view();
+                              return ImageView{format(), view.width, view.height, view.stride, view.data}; },
+                          storage);
+    }
+
+    std::size_t bytesPerPixel(PixelFormat format)
+    {
+        return dispatch(format, [](auto pixel)
+                        { return sizeof(pixel); });
+    }
+
+    PixelFormat parsePixelFormat(const std::string &name)
+    {
+        for (auto format : {PixelFormat::Gray8, PixelFormat::Gray16, PixelFormat::RGB8, PixelFormat::RGB16, PixelFormat::RGBA8})
+        {
+            if (pixelFormatName(format) == name)
+                return format;
+        }
+
+        throw bmp::Exception("Invalid pixel format " + name);
+    }
+
+    std::string pixelFormatName(PixelFormat format)
+    {
+        switch (format)
+        {
+        case PixelFormat::Gray8:
+            return "gray8";
+        case PixelFormat::Gray16:
+            return "gray16";
+        case PixelFormat::RGB8:
+            return "rgb8";
+        case PixelFormat::RGB16:
+            return "rgb16";
+        case PixelFormat::RGBA8:
+            return "rgba8";
+        }
+
+        throw bmp::Exception("Invalid pixel format");
+    }
+
+    SourceLayout parseSourceLayout(const std::string &name)
+    {
+        if (name == "rows")
+            return SourceLayout::Rows;
+
+        if (name == "blocks")
+            return SourceLayout::Blocks;
+
+        if (name == "morton")
+            return SourceLayout::Morton;
+
+        throw bmp::Exception("Invalid source layout " + name);
+    }
+
+    EdgeMode parseEdgeMode(const std::string &name)
+    {
+        for (auto edge : {EdgeMode::Constant, EdgeMode::Clamp, EdgeMode::Wrap, EdgeMode::Mirror})
+        {
+            if (edgeModeName(edge) == name)
+                return edge;
+        }
+
+        throw bmp::Exception("Invalid edge mode " + name);
+    }
+
+    std::string edgeModeName(EdgeMode edge)
+    {
+        switch (edge)
+        {
+        case EdgeMode::Constant:
+            return "constant";
+        case EdgeMode::Clamp:
+            return "clamp";
+        case EdgeMode::Wrap:
+            return "wrap";
+        case EdgeMode::Mirror:
+            return "mirror";
+        }
+
+        throw bmp::Exception("Invalid edge mode");
+    }
+
+    PixelFormat probePixelFormat(const std::string &filename, bool alpha)
+    {
+        if (isSharedImage(filename))
+        {
+            PixelFormat format = SharedImage(filename).view().format;
+            return alpha ? PixelFormat::RGBA8 : format;
+        }
+
+        if (isTiledImage(filename))
+        {
+            PixelFormat format = TiledImage(filename).format();
+            return alpha ? PixelFormat::RGBA8 : format;
+        }
+
+        bmp::ImageInfo info;
+
+        if (filename == "-")
+        {
+            std::istringstream is(standardInput());
+            info = bmp::probe(is, "<stdin>");
+        }
+        else
+            info = bmp::probe(filename);
+
+        if (alpha || info.channels == 4)
+            return PixelFormat::RGBA8;
+
+        if (info.channels == 1)
+            return info.bit_depth == 16 ? PixelFormat::Gray16 : PixelFormat::Gray8;
+
+        return info.bit_depth == 16 ? PixelFormat::RGB16 : PixelFormat::RGB8;
+    }
+
+    Region probeRegion(const std::string &filename)
+    {
+        Region region;
+
+        if (isSharedImage(filename))
+        {
+            ImageView view = SharedImage(filename).view();
+            region.width = view.width;
+            region.height = view.height;
+        }
+        else if (isTiledImage(filename))
+        {
+            TiledImage tiled(filename);
+            region.width = tiled.width();
+            region.height = tiled.height();
+        }
+        else
+        {
+            bmp::ImageInfo info;
+
+            if (filename == "-")
+            {
+                std::istringstream is(standardInput());
+                info = bmp::probe(is, "<stdin>");
+            }
+            else
+                info = bmp::probe(filename);
+
+            region.width = info.width;
+            region.height = info.height;
+        }
+
+        return region;
+    }
+
+    Image load(const std::string &filename, PixelFormat format)
+    {
+        if (isSharedImage(filename))
+            return copy(SharedImage(filename).view(), format);
+
+        if (isTiledImage(filename))
+        {
+            TiledImage tiled(filename);
+
+            return dispatch(tiled.format(), [&](auto native)
+                            {
+                                bmp::BasicBitmap<decltype(native)> bitmap(tiled.width(), tiled.height());
+                                Region whole = {0, 0, tiled.width(), tiled.height()};
+
+                                tiled.read(whole, reinterpret_cast<std::uint8_t *>(bitmap.m_pixels.data()),
+                                           sizeof(native) * tiled.width());
+
+                                Image image(std::move(bitmap));
+                                return tiled.format() == format ? image : copy(image.view(), format); });
+        }
+
+        return dispatch(format, [&](auto pixel)
+                        {
+                            bmp::BasicBitmap<decltype(pixel)> bitmap;
+
+                            if (filename == "-")
+                            {
+                                std::istringstream is(standardInput());
+                                bitmap.load(is, "<stdin>");
+                            }
+                            else
+                                loadBitmap(bitmap, filename);
+
+                            return Image(std::move(bitmap)); });
+    }
+
+    void save(const Image &image, const std::string &filename)
+    {
+        if (isSharedImage(filename))
+        {
+            ImageView view = image.view();
+            SharedImage shared(filename, view.format, view.width, view.height);
+
+            std::size_t row = bytesPerPixel(view.format) * view.width;
+
+            for (std::int32_t y = 0; y < view.height; ++y)
+                std::memcpy(shared.data() + row * y, static_cast<const std::uint8_t *>(view.data) + view.stride * y, row);
+
+            return;
+        }
+
+        if (isTiledImage(filename))
+        {
+            writeTiledImage(image.view(), filename);
+            return;
+        }
+
+        if (filename == "-")
+        {
+#ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            std::visit([](const auto &bitmap)
+                       { bitmap.save(std::cout, bmp::FileFormat::BMP); },
+                       image.storage);
+            std::cout.flush();
+            return;
+        }
+
+        std::visit([&](const auto &bitmap)
+                   { saveBitmap(bitmap, filename); },
+                   image.storage);
+    }
+
+    Input::Input(const std::string &filename, PixelFormat format, const Affine &affine, const Region &roi)
+    {
+        if (isTiledImage(filename) && roi.width > 0)
+        {
+            TiledImage tiled(filename);
+
+            if (tiled.format() == format)
+            {
+                Region window = sourceRegion(tiled.width(), tiled.height(), affine, roi);
+
+                // calloc leaves large blocks to lazily zeroed pages, so only the
+                // pages of the tiles read are ever touched
+                std::size_t stride = bytesPerPixel(format) * tiled.width();
+                sparse.reset(static_cast<std::uint8_t *>(std::calloc(stride * tiled.height(), 1)));
+
+                if (!sparse)
+                    throw bmp::Exception("Failed to allocate " + filename);
+
+                if (window.width > 0)
+                    tiled.read(window, sparse.get(), stride);
+
+                sparse_view = {format, tiled.width(), tiled.height(), stride, sparse.get()};
+                return;
+            }
+        }
+
+        if (isSharedImage(filename))
+        {
+            shared.reset(new SharedImage(filename));
+
+            if (shared->view().format == format)
+                return;
+
+            image = copy(shared->view(), format);
+            shared.reset();
+        }
+        else
+            image = load(filename, format);
+    }
+
+    Input::~Input() = default;
+
+    ImageView Input::view() const
+    {
+        if (sparse)
+            return sparse_view;
+
+        return shared ? shared->view() : image.view();
+    }
+
+    Image transform(const ImageView &input, const Affine &affine, const Options &options)
+    {
+        std::size_t pixel_size = bytesPerPixel(input.format);
+
+        if (!input.data || input.width <= 0 || input.height <= 0)
+            throw bmp::Exception("affine::transform: Input image is empty");
+
+        if (input.stride < pixel_size * input.width || input.stride % pixel_size)
+            throw bmp::Exception("affine::transform: Invalid input stride " + std::to_string(input.stride));
+
+        if (options.threads < 1 || options.tile_size < 1)
+            throw bmp::Exception("affine::transform: Invalid threads count or tile size");
+
+        if (options.roi.width < 0 || options.roi.height < 0 || (options.roi.width > 0) != (options.roi.height > 0))
+            throw bmp::Exception("affine::transform: Invalid region of interest");
+
+        checkCanvas(input.width, input.height, affine.matrix);
+
+        return dispatch(input.format, [&](auto pixel)
+                        {
+                            using P = decltype(pixel);
+                            return Image(render(typedView<P>(input), affine, options)); });
+    }
+}
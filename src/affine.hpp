@@ -0,0 +1,258 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <variant>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <cstdlib>
+#include "BitmapPlusPlus.hpp"
+#include "Stats.hpp"
+#include "Progress.hpp"
+#include "PostProcess.hpp"
+
+class ThreadPool;
+class GPUContext;
+
+namespace affine
+{
+    class SharedImage;
+}
+
+/*
+ * libaffine: in-memory affine transforms of images. Errors are reported by
+ * throwing bmp::Exception.
+ */
+namespace affine
+{
+    enum class PixelFormat
+    {
+        Gray8,
+        Gray16,
+        RGB8,
+        RGB16,
+        RGBA8
+    };
+
+    enum class Device
+    {
+        CPU = 1,
+        GPU = 2
+    };
+
+    // Order of the source pixels read by CPU renders (see Swizzle.hpp); GPU
+    // textures are laid out by the driver
+    enum class SourceLayout
+    {
+        Rows,
+        Blocks,
+        Morton
+    };
+
+    // What samples outside the source read: the border colour, or the
+    // nearest, repeated or reflected source pixel
+    enum class EdgeMode
+    {
+        Constant,
+        Clamp,
+        Wrap,
+        Mirror
+    };
+
+    // Non-owning, type-erased view of caller pixels (rows top first, stride in bytes)
+    struct ImageView
+    {
+        PixelFormat format;
+        std::int32_t width,
+            height;
+        std::size_t stride;
+        const void *data;
+    };
+
+    // Owning image, backed by the bitmap of its pixel format
+    class Image
+    {
+    public:
+        using Storage = std::variant<bmp::GrayBitmap8,
+                                     bmp::GrayBitmap16,
+                                     bmp::RGBBitmap8,
+                                     bmp::RGBBitmap16,
+                                     bmp::Bitmap>;
+
+        Image() = default;
+
+        template <class P>
+        explicit Image(bmp::BasicBitmap<P> &&bitmap) : storage(std::move(bitmap)) {}
+
+        PixelFormat format() const { return (PixelFormat)storage.index(); }
+
+        std::int32_t width() const;
+
+        std::int32_t height() const;
+
+        ImageView view() const;
+
+        template <class P>
+        bmp::BasicBitmap<P> &bitmap() { return std::get<bmp::BasicBitmap<P>>(storage); }
+
+        template <class P>
+        const bmp::BasicBitmap<P> &bitmap() const { return std::get<bmp::BasicBitmap<P>>(storage); }
+
+        Storage storage;
+    };
+
+    // Row-vector transform ([x y 1] * matrix) as built by genMatrix, plus the
+    // translation that grows the output canvas like the CLI's -x/-y. A third
+    // column other than 0 0 1 makes it a perspective: [u v w] maps to u/w, v/w
+    struct Affine
+    {
+        std::vector<std::vector<double>> matrix = {{1, 0, 0},
+                                                   {0, 1, 0},
+                                                   {0, 0, 1}};
+        int x = 0,
+            y = 0;
+    };
+
+    /*
+     * Building blocks of transform chains. Steps apply in the order given, so
+     * a chain is folded into a single matrix and the image is resampled once.
+     * Translations carry through later steps and are rounded to whole pixels,
+     * except in chains with a perspective, where they stay in the matrix.
+     */
+    Affine compose(const Affine &first, const Affine &second);
+
+    Affine fold(const std::vector<Affine> &steps);
+
+    Affine rotation(double angle);
+
+    Affine scaling(double horizontal, double vertical);
+
+    // Skew angles in degrees; throws for odd multiples of 90
+    Affine skewing(double horizontal, double vertical);
+
+    Affine translation(int x, int y);
+
+    // 2x3 matrix a b x c d y, as given to --matrix, or a perspective
+    // a b x c d y g h i whose last row is the divisor: w = g*x + h*y + i.
+    // The whole image must map in front of the horizon (w > 0), transform()
+    // and the region functions throw otherwise
+    Affine fromMatrix(const std::vector<double> &values);
+
+    // Parses "rotate:A", "scale:S[:V]", "skew:H[:V]", "translate:X[:Y]",
+    // "hflip", "vflip" or "matrix:a:b:x:c:d:y[:g:h:i]"
+    Affine parseStep(const std::string &step);
+
+    // Window of the output canvas, in pixels from its top-left corner
+    struct Region
+    {
+        int x = 0,
+            y = 0,
+            width = 0,
+            height = 0;
+    };
+
+    // Whole output canvas of an input of the given size
+    Region outputRegion(std::int32_t width, std::int32_t height, const Affine &affine);
+
+    // Source pixels sampled by the roi window of affine's output (the whole
+    // input when roi is empty)
+    Region sourceRegion(std::int32_t width, std::int32_t height, const Affine &affine, const Region &roi);
+
+    struct Options
+    {
+        Device device = Device::CPU;
+        int threads = 1;
+        int tile_size = 64;
+        // Renders only this window of the canvas (and reads only the source
+        // pixels it maps from); an empty region renders the whole canvas
+        Region roi;
+        // Copies the source into this layout before a CPU render, so reads
+        // stay local whatever the rotation
+        SourceLayout layout = SourceLayout::Rows;
+        EdgeMode edge = EdgeMode::Constant;
+        // Colour of EdgeMode::Constant, converted to the pixel format
+        bmp::Pixel border = bmp::Transparent;
+        // Blends 8-bit colour in linear light, taking it as sRGB encoded
+        bool linear = false;
+        // Colour adjustments and sharpening of the rendered pixels
+        PostProcess post;
+        Stats *stats = nullptr;
+        Progress::Callback progress = nullptr;
+        // Warm workers and GL context to reuse; fresh ones per call when null
+        ThreadPool *pool = nullptr;
+        GPUContext *gpu = nullptr;
+        // Pins fresh render threads to NUMA nodes round-robin (pools pin their own)
+        bool numa = false;
+        // The input is the one passed to the previous GPU render on this
+        // context, so its texture is still resident and the upload is skipped
+        bool resident_source = false;
+    };
+
+    std::size_t bytesPerPixel(PixelFormat format);
+
+    PixelFormat parsePixelFormat(const std::string &name);
+
+    std::string pixelFormatName(PixelFormat format);
+
+    // "rows", "blocks" or "morton"
+    SourceLayout parseSourceLayout(const std::string &name);
+
+    // "constant", "clamp", "wrap" or "mirror"
+    EdgeMode parseEdgeMode(const std::string &name);
+
+    std::string edgeModeName(EdgeMode edge);
+
+    /*
+     * Images are named by a file path, "-" for a BMP/PNM stream on stdin or
+     * stdout (BMP is written), or a shared memory spec ("shm:/name", "fd:N")
+     * holding a raw image as described in SharedImage.hpp. Paths ending in
+     * ".atf" are tiled images as described in TiledImage.hpp.
+     */
+
+    // Native pixel format of an image (RGBA8 when alpha is requested)
+    PixelFormat probePixelFormat(const std::string &filename, bool alpha = false);
+
+    // Whole image, sized from its header without loading the pixels
+    Region probeRegion(const std::string &filename);
+
+    Image load(const std::string &filename, PixelFormat format);
+
+    void save(const Image &image, const std::string &filename);
+
+    // Source of transform(): shared images of the requested format are mapped
+    // and read in place, anything else is loaded. Given the roi to be rendered,
+    // tiled images of the requested format read only the tiles it samples
+    class Input
+    {
+    public:
+        Input(const std::string &filename, PixelFormat format,
+              const Affine &affine = Affine(), const Region &roi = Region());
+
+        ~Input();
+
+        ImageView view() const;
+
+    private:
+        Image image;
+        std::unique_ptr<SharedImage> shared;
+        std::unique_ptr<std::uint8_t, decltype(&std::free)> sparse{nullptr, &std::free};
+        ImageView sparse_view = {};
+    };
+
+    // Renders input through affine into a new image of the same pixel format
+    Image transform(const ImageView &input, const Affine &affine, const Options &options = Options());
+
+    /*
+     * Deep Zoom pyramid output: filename ("name.dzi") receives the index and
+     * name_files/<level>/<column>_<row>.bmp the tiles, level 0 being 1x1.
+     * Full resolution tiles are rendered one window at a time and every
+     * level above is averaged from the tiles below it, so the whole output
+     * image is never held in memory. With options.roi set, the pyramid
+     * covers only that window of the canvas.
+     */
+    bool isPyramid(const std::string &filename);
+
+    void renderPyramid(const ImageView &input, const Affine &affine, const Options &options,
+                       const std::string &filename, int tile_size = 256);
+}
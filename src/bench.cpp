@@ -0,0 +1,498 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <filesystem>
+#include <math.h>
+#include <algorithm>
+#include "matrix.hpp"
+#include "BitmapPlusPlus.hpp"
+#include <boost/program_options.hpp>
+#include "Converters.hpp"
+#include "Swizzle.hpp"
+#include "AsyncFile.hpp"
+
+namespace po = boost::program_options;
+
+struct Result
+{
+    std::string name,
+        format,
+        transform;
+    int threads,
+        width,
+        height;
+    double seconds,
+        megapixels_per_second,
+        ns_per_pixel,
+        efficiency;
+};
+
+struct Transform
+{
+    std::string name;
+    std::vector<std::vector<double>> matrix;
+};
+
+std::uint32_t hash(std::uint32_t x, std::uint32_t y, std::uint32_t c)
+{
+    std::uint32_t h = x * 0x9E3779B1u ^ y * 0x85EBCA77u ^ c * 0xC2B2AE3Du;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 12;
+    return h;
+}
+
+// Gradients with per-pixel noise, so neither caches nor branch predictors see a flat image
+template <class P>
+bmp::BasicBitmap<P> generateImage(int width, int height)
+{
+    using channel_type = typename P::channel_type;
+    constexpr double max = std::numeric_limits<channel_type>::max();
+
+    bmp::BasicBitmap<P> image(width, height);
+
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            P pixel;
+
+            for (int c = 0; c < P::channels; ++c)
+            {
+                double gradient = c % 2 ? (double)x / width : (double)y / height,
+                       noise = (hash(x, y, c) & 0xff) / 255.0;
+
+                pixel[c] = (channel_type)(max * (0.75 * gradient + 0.25 * noise));
+            }
+
+            if constexpr (P::has_alpha)
+                pixel[P::channels - 1] = (channel_type)max;
+
+            image[x + (std::size_t)width * y] = pixel;
+        }
+    }
+
+    return image;
+}
+
+template <class F>
+double measure(int repeat, F fn)
+{
+    double best = std::numeric_limits<double>::max();
+
+    for (int i = 0; i < repeat; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto end = std::chrono::steady_clock::now();
+
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+
+    return best;
+}
+
+Result makeResult(const std::string &name, const std::string &format, const std::string &transform,
+                  int threads, int width, int height, double seconds)
+{
+    double pixels = (double)width * height;
+
+    return {name, format, transform, threads, width, height, seconds,
+            pixels / seconds / 1e6, seconds * 1e9 / pixels, 1};
+}
+
+template <class P>
+void benchFormat(const std::string &format, int width, int height,
+                 const std::vector<Transform> &transforms,
+                 const std::vector<int> &threads,
+                 int repeat, std::vector<Result> &results)
+{
+    auto input = generateImage<P>(width, height);
+    auto view = input.view();
+
+    for (const auto &transform : transforms)
+    {
+        auto invMatrix = inverseMatrix(transform.matrix);
+        auto bounds = transformedBounds(width, height, transform.matrix, 0, 0);
+
+        std::size_t first = results.size();
+
+        for (int threads_number : threads)
+        {
+            double seconds = measure(repeat, [&]
+                                     { CPURender(width, height,
+                                                 bounds.width, bounds.height,
+                                                 bounds.x_offset, bounds.y_offset,
+                                                 invMatrix, view,
+                                                 threads_number, nullptr, nullptr); });
+
+            results.push_back(makeResult("render", format, transform.name,
+                                         threads_number, bounds.width, bounds.height, seconds));
+        }
+
+        // Efficiency relative to the smallest thread count measured
+        const Result &base = results[first];
+
+        for (std::size_t i = first; i < results.size(); ++i)
+            results[i].efficiency = base.seconds * base.threads / (results[i].seconds * results[i].threads);
+    }
+
+    auto path = std::filesystem::temp_directory_path() /
+                ("affine_bench_" + format + (sizeof(typename P::channel_type) == 2 ? ".pnm" : ".bmp"));
+
+    double save = measure(repeat, [&]
+                          { input.save(path.string()); });
+
+    results.push_back(makeResult("save", format, "-", 1, width, height, save));
+
+    double load = measure(repeat, [&]
+                          { bmp::BasicBitmap<P> image(path.string()); });
+
+    results.push_back(makeResult("load", format, "-", 1, width, height, load));
+
+    std::filesystem::remove(path);
+}
+
+// Rotations from 0 to 90 degrees read from each source layout; the copy into
+// a swizzled layout is reported on its own, as it is paid once per source
+template <class P>
+void benchLayouts(const std::string &format, int width, int height, int threads_number,
+                  int repeat, std::vector<Result> &results)
+{
+    auto input = generateImage<P>(width, height);
+    auto view = input.view();
+
+    const std::pair<const char *, affine::SourceLayout> layouts[] = {{"rows", affine::SourceLayout::Rows},
+                                                                     {"blocks", affine::SourceLayout::Blocks},
+                                                                     {"morton", affine::SourceLayout::Morton}};
+
+    for (const auto &layout : layouts)
+    {
+        std::unique_ptr<affine::SwizzledImage<P>> swizzled;
+
+        if (layout.second != affine::SourceLayout::Rows)
+        {
+            double seconds = measure(repeat, [&]
+                                     { swizzled.reset(new affine::SwizzledImage<P>(view, layout.second)); });
+
+            results.push_back(makeResult(std::string("swizzle_") + layout.first, format, "-",
+                                         1, width, height, seconds));
+        }
+
+        for (int angle = 0; angle <= 90; angle += 15)
+        {
+            auto matrix = genMatrix(angle, 1, 1, 1, 0, 0);
+            auto invMatrix = inverseMatrix(matrix);
+            auto bounds = transformedBounds(width, height, matrix, 0, 0);
+
+            auto render = [&](const auto &source)
+            {
+                return measure(repeat, [&]
+                               { CPURender(width, height,
+                                           bounds.width, bounds.height,
+                                           bounds.x_offset, bounds.y_offset,
+                                           invMatrix, source,
+                                           threads_number, nullptr, nullptr); });
+            };
+
+            double seconds = swizzled ? render(*swizzled) : render(view);
+
+            results.push_back(makeResult(std::string("layout_") + layout.first, format,
+                                         "rotate" + std::to_string(angle),
+                                         threads_number, bounds.width, bounds.height, seconds));
+        }
+    }
+}
+
+// Raw file throughput of each I/O backend, buffered and with O_DIRECT: an
+// RGBA8 image sized file written and read back one row per call, as the
+// codecs do; MP/s counts its 4 byte pixels
+void benchIO(int width, int height, int repeat, std::vector<Result> &results)
+{
+    auto path = (std::filesystem::temp_directory_path() / "affine_bench_io.raw").string();
+    std::vector<char> row((std::size_t)width * 4, 1);
+
+    for (IOBackend backend : {IOBackend::Stream, IOBackend::Threads, IOBackend::Uring})
+    {
+        for (bool direct : {false, true})
+        {
+            if (backend == IOBackend::Stream && direct)
+                continue;
+
+            FileIOOptions options;
+            options.backend = backend;
+            options.direct = direct;
+
+            std::string name = backend == IOBackend::Stream ? "stream" : backend == IOBackend::Threads ? "threads"
+                                                                                                      : "uring";
+
+            if (direct)
+                name += "+direct";
+
+            try
+            {
+                auto run = [&](std::ios::openmode mode)
+                {
+                    std::unique_ptr<std::streambuf> buffer;
+                    bool open = false;
+
+                    if (backend == IOBackend::Stream)
+                    {
+                        auto file = std::make_unique<std::filebuf>();
+                        open = file->open(path, mode | std::ios::binary);
+                        buffer = std::move(file);
+                    }
+#ifndef _WIN32
+                    else
+                    {
+                        auto file = std::make_unique<AsyncFileBuf>(path, mode, options);
+                        open = file->isOpen();
+                        buffer = std::move(file);
+                    }
+#endif
+
+                    if (!open)
+                        throw bmp::Exception("Failed to open " + path);
+
+                    for (int y = 0; y < height; ++y)
+                    {
+                        std::streamsize done = mode & std::ios::out ? buffer->sputn(row.data(), row.size())
+                                                                    : buffer->sgetn(row.data(), row.size());
+
+                        if (done != (std::streamsize)row.size())
+                            throw bmp::Exception("I/O benchmark failed on " + path);
+                    }
+                };
+
+                double write = measure(repeat, [&]
+                                       { run(std::ios::out); });
+
+                results.push_back(makeResult("io_write", "rgba8", name, 1, width, height, write));
+
+                double read = measure(repeat, [&]
+                                      { run(std::ios::in); });
+
+                results.push_back(makeResult("io_read", "rgba8", name, 1, width, height, read));
+            }
+            catch (const bmp::Exception &e)
+            {
+                std::cerr << "Skipping " << name << ": " << e.what() << std::endl;
+            }
+        }
+    }
+
+    std::filesystem::remove(path);
+}
+
+Result benchMatrixSetup(int width, int height, int repeat)
+{
+    const int iterations = 10000;
+    volatile double sink = 0;
+
+    double seconds = measure(repeat, [&]
+                             {
+                                 for (int i = 0; i < iterations; ++i)
+                                 {
+                                     auto matrix = genMatrix(i % 360, 1.5, 0.75, 1, 10, 5);
+                                     auto invMatrix = inverseMatrix(matrix);
+                                     auto bounds = transformedBounds(width, height, matrix, 3, 4);
+
+                                     sink = invMatrix[0][0] + bounds.width;
+                                 } });
+
+    return {"matrix_setup", "-", "-", 1, 1, 1, seconds / iterations, 0, seconds * 1e9 / iterations, 1};
+}
+
+void printTable(const std::vector<Result> &results)
+{
+    std::cout << std::left
+              << std::setw(16) << "benchmark"
+              << std::setw(8) << "format"
+              << std::setw(18) << "transform"
+              << std::right
+              << std::setw(8) << "threads"
+              << std::setw(14) << "output"
+              << std::setw(12) << "time ms"
+              << std::setw(10) << "MP/s"
+              << std::setw(10) << "ns/px"
+              << std::setw(8) << "eff" << std::endl;
+
+    for (const auto &r : results)
+    {
+        std::ostringstream size;
+        size << r.width << "x" << r.height;
+
+        std::cout << std::left
+                  << std::setw(16) << r.name
+                  << std::setw(8) << r.format
+                  << std::setw(18) << r.transform
+                  << std::right << std::fixed
+                  << std::setw(8) << r.threads
+                  << std::setw(14) << size.str()
+                  << std::setw(12) << std::setprecision(3) << r.seconds * 1e3
+                  << std::setw(10) << std::setprecision(1) << r.megapixels_per_second
+                  << std::setw(10) << std::setprecision(2) << r.ns_per_pixel
+                  << std::setw(8) << std::setprecision(2) << r.efficiency << std::endl;
+    }
+}
+
+void printJson(std::ostream &os, const std::vector<Result> &results, int width, int height, int repeat)
+{
+    os << "{\n"
+       << "  \"hardware_concurrency\": " << std::thread::hardware_concurrency() << ",\n"
+       << "  \"width\": " << width << ",\n"
+       << "  \"height\": " << height << ",\n"
+       << "  \"repeat\": " << repeat << ",\n"
+       << "  \"results\": [\n";
+
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+        const auto &r = results[i];
+
+        os << "    {\"benchmark\": \"" << r.name << "\", \"format\": \"" << r.format
+           << "\", \"transform\": \"" << r.transform << "\", \"threads\": " << r.threads
+           << ", \"width\": " << r.width << ", \"height\": " << r.height
+           << std::setprecision(9)
+           << ", \"seconds\": " << r.seconds
+           << ", \"megapixels_per_second\": " << r.megapixels_per_second
+           << ", \"ns_per_pixel\": " << r.ns_per_pixel
+           << ", \"efficiency\": " << r.efficiency << "}"
+           << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+
+    os << "  ]\n"
+       << "}" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int width,
+        height,
+        repeat;
+
+    std::vector<int> default_threads;
+
+    for (int t = 1; t < (int)std::thread::hardware_concurrency(); t *= 2)
+        default_threads.push_back(t);
+
+    default_threads.push_back(std::max(1u, std::thread::hardware_concurrency()));
+
+    po::options_description desc("Allowed options");
+    desc
+        .add_options()                                                                                                       // prettier-ignore
+        ("help,h", "produce help message")                                                                                   // prettier-ignore
+        ("width,W", po::value<int>(&width)->default_value(2048), "synthetic image width")                                    // prettier-ignore
+        ("height,H", po::value<int>(&height)->default_value(2048), "synthetic image height")                                 // prettier-ignore
+        ("repeat,r", po::value<int>(&repeat)->default_value(3), "repetitions per case (best time is reported)")              // prettier-ignore
+        ("threads,t", po::value<std::vector<int>>()->multitoken(), "thread counts to run (default: powers of two up to all)") // prettier-ignore
+        ("formats,f", po::value<std::vector<std::string>>()->multitoken(), "pixel formats to run (default: all)")            // prettier-ignore
+        ("layouts,l", "also sweep rotations 0-90 over row-major, block-linear and Morton sources (size them past the last-level cache)") // prettier-ignore
+        ("io,i", "also measure file throughput of the stream, thread and io_uring backends")                                // prettier-ignore
+        ("json,j", po::value<std::string>()->implicit_value("-"), "write JSON results to a file (or stdout with -)");        // prettier-ignore
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << desc << std::endl
+                  << "Usage: bench options" << std::endl;
+        return 1;
+    }
+
+    if (width <= 0 || height <= 0 || repeat <= 0)
+    {
+        std::cout << "Invalid benchmark size" << std::endl;
+        return 1;
+    }
+
+    auto threads = vm.count("threads") ? vm["threads"].as<std::vector<int>>() : default_threads;
+    std::sort(threads.begin(), threads.end());
+
+    if (threads.front() <= 0)
+    {
+        std::cout << "Invalid threads count" << std::endl;
+        return 1;
+    }
+
+    auto formats = vm.count("formats") ? vm["formats"].as<std::vector<std::string>>()
+                                       : std::vector<std::string>{"gray8", "gray16", "rgb8", "rgb16", "rgba8"};
+
+    std::vector<Transform> transforms = {
+        {"identity", genMatrix(0, 1, 1, 1, 0, 0)},
+        {"rotate30", genMatrix(30, 1, 1, 1, 0, 0)},
+        {"rotate90", genMatrix(90, 1, 1, 1, 0, 0)},
+        {"scale0.5", genMatrix(0, 0.5, 0.5, 1, 0, 0)},
+        {"rotate45_scale2", genMatrix(45, 2, 2, 1, 0, 0)},
+        {"skew20", genMatrix(0, 1, 1, 1, 20, 0)},
+        {"keystone", {{1, 0, 0.0002}, {0, 1, 0.0001}, {0, 0, 1}}}};
+
+    std::vector<Result> results;
+
+    try
+    {
+        for (const auto &format : formats)
+        {
+            auto run = [&](auto pixel)
+            {
+                using P = decltype(pixel);
+
+                benchFormat<P>(format, width, height, transforms, threads, repeat, results);
+
+                if (vm.count("layouts"))
+                    benchLayouts<P>(format, width, height, threads.back(), repeat, results);
+            };
+
+            if (format == "gray8")
+                run(bmp::Gray8());
+            else if (format == "gray16")
+                run(bmp::Gray16());
+            else if (format == "rgb8")
+                run(bmp::RGB8());
+            else if (format == "rgb16")
+                run(bmp::RGB16());
+            else if (format == "rgba8")
+                run(bmp::RGBA8());
+            else
+            {
+                std::cout << "Invalid pixel format " << format << std::endl;
+                return 1;
+            }
+        }
+    }
+    catch (const bmp::Exception &e)
+    {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+
+    if (vm.count("io"))
+        benchIO(width, height, repeat, results);
+
+    results.push_back(benchMatrixSetup(width, height, repeat));
+
+    if (!vm.count("json") || vm["json"].as<std::string>() != "-")
+        printTable(results);
+
+    if (vm.count("json"))
+    {
+        std::string path = vm["json"].as<std::string>();
+
+        if (path == "-")
+            printJson(std::cout, results, width, height, repeat);
+        else
+        {
+            std::ofstream ofs(path);
+            printJson(ofs, results, width, height, repeat);
+        }
+    }
+
+    return 0;
+}
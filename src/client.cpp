@@ -0,0 +1,139 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <cstdlib>
+#include "Socket.hpp"
+#include "Stats.hpp"
+
+// Sends the same request repeat times over one connection, recording latencies
+void runConnection(const std::string &socket_path, const std::string &request, int repeat, bool print,
+                   std::vector<double> &latencies, int &errors, std::mutex &mutex)
+{
+    int fd = connectSocket(socket_path);
+    LineReader reader(fd);
+    std::string response;
+
+    for (int i = 0; i < repeat; ++i)
+    {
+        double start = wallTime();
+
+        writeAll(fd, request + "\n");
+
+        if (!reader.read(response))
+        {
+            close(fd);
+            throw bmp::Exception("Server closed the connection");
+        }
+
+        double latency = wallTime() - start;
+
+        const std::unique_lock<std::mutex> lock(mutex);
+
+        if (response.compare(0, 2, "ok") == 0)
+            latencies.push_back(latency);
+        else
+            ++errors;
+
+        if (print || response.compare(0, 2, "ok") != 0)
+            std::cout << response << std::endl;
+    }
+
+    close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string socket_path = DEFAULT_SOCKET;
+    int repeat = 1,
+        concurrency = 1;
+
+    // Client options come first, everything from the command on is the request
+    int arg = 1;
+
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        std::string name = argv[arg];
+
+        if (name == "-s" || name == "--socket")
+            socket_path = argv[arg + 1];
+        else if (name == "-n" || name == "--repeat")
+            repeat = std::atoi(argv[arg + 1]);
+        else if (name == "-c" || name == "--concurrency")
+            concurrency = std::atoi(argv[arg + 1]);
+        else
+            break;
+    }
+
+    if (arg >= argc || argv[arg][0] == '-' || repeat <= 0 || concurrency <= 0)
+    {
+        std::cout << "Usage: affine_client [-s socket] [-n repeat] [-c concurrency] command [arguments]" << std::endl
+                  << std::endl
+                  << "Commands:" << std::endl
+                  << "  transform input output [affine_transform options]" << std::endl
+                  << "  stats" << std::endl
+                  << "  shutdown" << std::endl
+                  << std::endl
+                  << "With -n or -c the request is sent repeat times on each of concurrency" << std::endl
+                  << "connections and client side latencies are reported." << std::endl;
+        return 1;
+    }
+
+    std::string request = joinArgs(std::vector<std::string>(argv + arg, argv + argc));
+    bool single = repeat == 1 && concurrency == 1;
+
+    std::vector<double> latencies;
+    int errors = 0;
+    std::mutex mutex;
+
+    std::vector<std::thread> threads;
+    std::vector<std::string> failures(concurrency);
+
+    double start = wallTime();
+
+    for (int i = 0; i < concurrency; ++i)
+    {
+        threads.emplace_back([&, i]
+                             {
+                                 try
+                                 {
+                                     runConnection(socket_path, request, repeat, single, latencies, errors, mutex);
+                                 }
+                                 catch (const bmp::Exception &e)
+                                 {
+                                     failures[i] = e.what();
+                                 } });
+    }
+
+    for (auto &t : threads)
+        t.join();
+
+    double elapsed = wallTime() - start;
+
+    for (const auto &failure : failures)
+    {
+        if (!failure.empty())
+        {
+            std::cout << failure << std::endl;
+            return 1;
+        }
+    }
+
+    if (!single && !latencies.empty())
+    {
+        std::sort(latencies.begin(), latencies.end());
+
+        std::cout << std::fixed << std::setprecision(3)
+                  << "requests " << latencies.size() + errors << ", errors " << errors
+                  << ", " << latencies.size() / elapsed << " req/s" << std::endl
+                  << "latency ms: min " << latencies.front() * 1e3
+                  << ", p50 " << latencies[latencies.size() / 2] * 1e3
+                  << ", p99 " << latencies[latencies.size() * 99 / 100] * 1e3
+                  << ", max " << latencies.back() * 1e3 << std::endl;
+    }
+
+    return errors ? 1 : 0;
+}
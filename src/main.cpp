@@ -1,267 +1,186 @@
 #include <iostream>
 #include <vector>
-#include <math.h>
-#include <algorithm>
-#include "matrix.hpp"
-#include "BitmapPlusPlus.hpp"
-#include <boost/program_options.hpp>
-#include "Converters.hpp"
-
-namespace po = boost::program_options;
-
-template <class T, class F>
-decltype(auto) map(const std::vector<T> a, const F fn)
-{
-    std::vector<decltype(fn(a[0]))> result = {};
-    std::transform(a.cbegin(), a.cend(), std::back_inserter(result), fn);
-    return result;
-}
-
-std::vector<po::option> ignore_numbers(std::vector<std::string> &args)
-{
-    std::vector<po::option> result;
-    int pos = 0;
-    while (!args.empty())
-    {
-        const auto &arg = args[0];
-        double num;
-        if (boost::conversion::try_lexical_convert(arg, num))
-        {
-            result.push_back(po::option());
-            po::option &opt = result.back();
-
-            opt.position_key = pos++;
-            opt.value.push_back(arg);
-            opt.original_tokens.push_back(arg);
-
-            args.erase(args.begin());
-        }
-        else
-            break;
-    }
-
-    return result;
-}
-
-std::vector<std::vector<double>> genMatrix(double angle,
-                                           double horizontal_scale,
-                                           double vertical_scale,
-                                           double scale,
-                                           double horizontal_skew,
-                                           double vertical_skew)
-{
-    angle *= M_PI / 180;
-    horizontal_skew *= M_PI / 180;
-    vertical_skew *= M_PI / 180;
-
-    double
-        a = horizontal_scale * cos(angle),
-        b = -horizontal_scale * (sin(angle) + tan(horizontal_skew)),
-        c = vertical_scale * (sin(angle) + tan(vertical_skew)),
-        d = vertical_scale * cos(angle);
-
-    return {{a, b, 0},
-            {c, d, 0},
-            {0, 0, 1}};
-}
+#include <fstream>
+#include <memory>
+#include "Job.hpp"
+#include "Sequence.hpp"
+#include "Shard.hpp"
+#include "Cache.hpp"
+#include "Tuning.hpp"
+#include "Memory.hpp"
+#include "affine.hpp"
 
 int main(int argc, char *argv[])
 {
-    double angle,
-        horizontal_scale,
-        vertical_scale,
-        scale,
-        horizontal_skew,
-        vertical_skew;
-
-    int threads_number,
-        device,
-        x,
-        y;
-
-    po::options_description desc("Allowed options");
-    desc
-        .add_options()                                                                                                        // prettier-ignore
-        ("help,h", "produce help message")                                                                                    // prettier-ignore
-        ("angle,a", po::value<double>(&angle)->default_value(0), "rotation angle")                                            // prettier-ignore
-        ("hsc", po::value<double>(&horizontal_scale)->default_value(1), "horizontal scale factor")                            // prettier-ignore
-        ("vsc", po::value<double>(&vertical_scale)->default_value(1), "vertical scale factor")                                // prettier-ignore
-        ("scale,s", po::value<double>(&scale), "scale factor (overrides hsc and vsc)")                                        // prettier-ignore
-        ("hsk", po::value<double>(&horizontal_skew)->default_value(0), "horizontal skew angle")                               // prettier-ignore
-        ("vsk", po::value<double>(&vertical_skew)->default_value(0), "vertical skew angle")                                   // prettier-ignore
-        ("xtranslate,x", po::value<int>(&x)->default_value(0), "x translate")                                                 // prettier-ignore
-        ("ytranslate,y", po::value<int>(&y)->default_value(0), "y translate")                                                 // prettier-ignore
-        ("hf", "horizontal flip")                                                                                             // prettier-ignore
-        ("vf", "vertical flip")                                                                                               // prettier-ignore
-        ("matrix,m", po::value<std::vector<double>>()->multitoken(), "transformation matrix (2x3) (overrides all options)")   // prettier-ignore
-        ("device,d", po::value<int>(&device)->default_value(1), "render device: 1) CPU 2) GPU")                               // prettier-ignore
-        ("threads,t", po::value<int>(&threads_number)->default_value(1), "threads count (available only for CPU rendering)"); // prettier-ignore
-
-    po::options_description hidden;
-    hidden.add_options()                           // prettier-ignore
-        ("input-file", po::value<std::string>())   // prettier-ignore
-        ("output-file", po::value<std::string>()); // prettier-ignore
-
-    po::options_description options;
-    options.add(desc);
-    options.add(hidden);
-
-    po::positional_options_description positional;
-    positional.add("input-file", 1);
-    positional.add("output-file", 1);
-
-    po::variables_map vm;
-    po::store(po::command_line_parser(argc, argv)
-                  .extra_style_parser(ignore_numbers)
-                  .allow_unregistered()
-                  .options(options)
-                  .positional(positional)
-                  .run(),
-              vm);
-
-    po::notify(vm);
-
-    if (vm.count("help"))
-    {
-        std::cout << desc << std::endl
-                  << "Usage: affine_transform.exe input output options" << std::endl;
-        return 1;
-    }
-
-    if (!vm.count("input-file"))
-    {
-        std::cout << "Provide input file" << std::endl;
-        return 1;
-    }
-
-    if (!vm.count("output-file"))
-    {
-        std::cout << "Provide output file" << std::endl;
-        return 1;
-    }
-
-    std::vector<std::vector<double>> matrix;
+    double start_wall = wallTime(),
+           start_cpu = processCpuTime();
 
-    if (!vm.count("matrix"))
+    try
     {
-        if (vm.count("scale"))
-            horizontal_scale = vertical_scale = vm["scale"].as<double>();
-
-        if (vm.count("hf"))
-            horizontal_scale *= -1;
-
-        if (vm.count("vf"))
-            vertical_scale *= -1;
-
-        double intpart;
+        Job job = parseJob(std::vector<std::string>(argv + 1, argv + argc));
 
-        if (std::modf(horizontal_skew, &intpart) == 0.0 &&
-            ((int)intpart % 180) == 90)
+        if (job.help)
         {
-            std::cout << "Invalid horizontal skew" << std::endl;
+            std::cout << jobOptions() << std::endl
+                      << "Usage: affine_transform.exe input output options" << std::endl;
             return 1;
         }
 
-        if (std::modf(vertical_skew, &intpart) == 0.0 &&
-            ((int)intpart % 180) == 90)
-        {
-            std::cout << "Invalid vertical skew" << std::endl;
-            return 1;
-        }
+        std::unique_ptr<Stats> stats;
 
-        matrix = genMatrix(
-            angle,
-            horizontal_scale,
-            vertical_scale,
-            scale,
-            horizontal_skew,
-            vertical_skew);
-    }
-    else
-    {
-        auto vector = vm["matrix"].as<std::vector<double>>();
-
-        if (vector.size() != 6)
+        if (!job.stats.empty())
         {
-            std::cout << "Transform matrix is invalid" << std::endl;
-            return 1;
+            stats.reset(new Stats());
+            stats->addStage("parse", wallTime() - start_wall, processCpuTime() - start_cpu);
         }
 
-        matrix = {
-            {vector[0], vector[1], 0},
-            {vector[3], vector[4], 0},
-            {0, 0, 1}};
-
-        x = vector[2], y = vector[5];
-    }
-
-    auto invMatrix = inverseMatrix(matrix);
-
-    try
-    {
-        bmp::Bitmap input;
-
-        input.load(vm["input-file"].as<std::string>());
-
-        double width = input.width(),
-               height = input.height();
-
-        std::vector<std::vector<std::vector<double>>> corners = {
-            {{0, 0, 1}},
-            {{width, 0, 1}},
-            {{0, height, 1}},
-            {{width, height, 1}}};
-
-        auto transformedCorners = map(corners, [matrix](const auto corner)
-                                      { return multiplyMatrices(corner, matrix); });
-
-        auto xs = map(transformedCorners, [](const auto corner)
-                      { return (int)ceil(corner[0][0]); }),
-             ys = map(transformedCorners, [](const auto corner)
-                      { return (int)ceil(corner[0][1]); });
-
-        auto horizontal = std::minmax_element(std::begin(xs), std::end(xs)),
-             vertical = std::minmax_element(std::begin(ys), std::end(ys));
+        static HugePageResource huge_pages;
 
-        int new_width = *horizontal.second - *horizontal.first + std::abs(x),
-            new_height = *vertical.second - *vertical.first + std::abs(y),
-            x_offset = *horizontal.first - std::max(0, x),
-            y_offset = *vertical.first - std::max(0, y);
+        if (job.hugepages)
+            bmp::default_pixel_resource() = &huge_pages;
 
-        std::string out = vm["output-file"].as<std::string>();
+        defaultFileIO().backend = job.io;
+        defaultFileIO().direct = job.direct_io;
 
-        bmp::Bitmap output;
+        // Keep stdout clean when the image is streamed to it
+        bool streamed = job.output == "-";
+        std::ostream &console = streamed ? std::cerr : std::cout;
 
-        if (device == 1)
-        {
-            output = CPURender(width, height,
-                               new_width, new_height,
-                               x_offset, y_offset,
-                               invMatrix, input,
-                               threads_number);
-        }
-        else if (device == 2)
-        {
-            output = GPURender(width, height,
-                               new_width, new_height,
-                               x_offset, y_offset,
-                               invMatrix, input);
-        }
+        if (job.merge)
+            mergeShards(job.input, job.merge, job.output, stats.get());
+        else if (job.frames || !job.sequence.empty())
+            renderSequence(job, stats.get());
         else
         {
-            std::cout << "Invalid render device" << std::endl;
-            return 1;
+            affine::Affine transform;
+
+            {
+                Stats::Scope scope(stats.get(), "matrix_setup");
+
+                transform = jobAffine(job);
+            }
+
+            affine::PixelFormat format = jobPixelFormat(job);
+            affine::Region whole;
+            std::string shard_path;
+
+            // Every shard splits the same canvas, so it is sized from the
+            // input header before only this band is loaded and rendered
+            if (job.shards)
+            {
+                affine::Region source = affine::probeRegion(job.input);
+                whole = job.roi.width ? job.roi : affine::outputRegion(source.width, source.height, transform);
+
+                if (whole.height < job.shards)
+                    throw bmp::Exception("Fewer output rows than shards");
+
+                job.roi = shardBand(whole, job.shard, job.shards);
+                shard_path = framePath(job.output, job.shard);
+            }
+
+            std::unique_ptr<ResultCache> cache;
+            std::string key;
+            bool cached = false;
+
+            if (!job.cache.empty() && ResultCache::cacheable(job))
+            {
+                Stats::Scope scope(stats.get(), "cache_lookup");
+
+                // The key holds the device that renders, so auto is resolved
+                // first, from the canvas size in the input header
+                affine::Region source = affine::probeRegion(job.input);
+                affine::Region canvas = job.roi.width ? job.roi : affine::outputRegion(source.width, source.height, transform);
+
+                tuneJob(job, (std::int64_t)canvas.width * canvas.height);
+
+                cache.reset(new ResultCache(job.cache, (std::uint64_t)job.cache_size << 20));
+                key = cache->key(job, transform, format);
+                cached = cache->fetch(key, job.output);
+            }
+
+            if (!cached)
+            {
+                std::unique_ptr<affine::Input> input;
+
+                {
+                    Stats::Scope scope(stats.get(), "load");
+
+                    input.reset(new affine::Input(job.input, format, transform, jobSourceWindow(job)));
+                }
+
+                affine::ImageView view = input->view();
+                affine::Region canvas = job.roi.width ? job.roi : affine::outputRegion(view.width, view.height, transform);
+
+                tuneJob(job, (std::int64_t)canvas.width * canvas.height);
+
+                affine::Options options;
+                options.device = (affine::Device)job.device;
+                options.threads = job.threads_number;
+                options.tile_size = autoTileSize(format);
+                options.roi = job.roi;
+                options.layout = affine::parseSourceLayout(job.layout);
+                options.edge = job.edge;
+                options.border = job.border;
+                options.linear = job.linear;
+                options.post = jobPost(job);
+                options.numa = job.numa;
+                options.stats = stats.get();
+                options.progress = job.quiet || streamed ? nullptr : printProgress;
+
+                if (affine::isPyramid(job.output))
+                {
+                    Stats::Scope scope(stats.get(), "pyramid");
+
+                    affine::renderPyramid(input->view(), transform, options, job.output);
+                }
+                else
+                {
+                    affine::Image output = affine::transform(input->view(), transform, options);
+
+                    Stats::Scope scope(stats.get(), "save");
+
+                    if (job.shards)
+                        writeShard(output.view(), whole, job.roi, job.shard, job.shards, shard_path);
+                    else
+                        affine::save(output, job.output);
+                }
+
+                if (cache)
+                {
+                    Stats::Scope scope(stats.get(), "cache_store");
+
+                    cache->store(key, job.output);
+                }
+            }
+
+            if (cache && stats)
+            {
+                stats->count("cache_hits", cache->total_hits);
+                stats->count("cache_misses", cache->total_misses);
+            }
         }
 
-        output.save(out);
+        if (!streamed)
+            std::cout << "Done" << std::endl;
 
-        std::cout << "Done" << std::endl;
+        if (stats)
+        {
+            stats->addStage("total", wallTime() - start_wall, processCpuTime() - start_cpu);
+
+            if (job.stats == "-")
+                stats->write(console);
+            else
+            {
+                std::ofstream ofs(job.stats);
+                stats->write(ofs);
+            }
+        }
 
         return 0;
     }
-    catch (const bmp::Exception &e)
+    catch (const std::exception &e)
     {
-        std::cout << e.what() << std::endl;
+        std::cerr << e.what() << std::endl;
         return 1;
     }
 }
@@ -1,7 +1,11 @@
+#pragma once
+
 #include <iostream>
 #include <vector>
+#include <math.h>
+#include <algorithm>
 
-void printMatrix(const std::vector<std::vector<double>> &matrix)
+inline void printMatrix(const std::vector<std::vector<double>> &matrix)
 {
     for (const auto &row : matrix)
     {
@@ -13,7 +17,7 @@ void printMatrix(const std::vector<std::vector<double>> &matrix)
     std::cout << std::endl;
 }
 
-std::vector<std::vector<double>> inverseMatrix(const std::vector<std::vector<double>> &matrix)
+inline std::vector<std::vector<double>> inverseMatrix(const std::vector<std::vector<double>> &matrix)
 {
     int n = matrix.size();
     std::vector<std::vector<double>> tempMatrix = matrix;
@@ -52,7 +56,7 @@ std::vector<std::vector<double>> inverseMatrix(const std::vector<std::vector<dou
     return identityMatrix;
 }
 
-std::vector<std::vector<double>> multiplyMatrices(const std::vector<std::vector<double>> &firstMatrix,
+inline std::vector<std::vector<double>> multiplyMatrices(const std::vector<std::vector<double>> &firstMatrix,
                                                   const std::vector<std::vector<double>> &secondMatrix)
 {
     int rowFirst = firstMatrix.size();
@@ -72,4 +76,70 @@ std::vector<std::vector<double>> multiplyMatrices(const std::vector<std::vector<
     }
 
     return result;
+}
+
+inline std::vector<std::vector<double>> genMatrix(double angle,
+                                           double horizontal_scale,
+                                           double vertical_scale,
+                                           double scale,
+                                           double horizontal_skew,
+                                           double vertical_skew)
+{
+    angle *= M_PI / 180;
+    horizontal_skew *= M_PI / 180;
+    vertical_skew *= M_PI / 180;
+
+    double
+        a = horizontal_scale * cos(angle),
+        b = -horizontal_scale * (sin(angle) + tan(horizontal_skew)),
+        c = vertical_scale * (sin(angle) + tan(vertical_skew)),
+        d = vertical_scale * cos(angle);
+
+    return {{a, b, 0},
+            {c, d, 0},
+            {0, 0, 1}};
+}
+
+// Whether the third column (row-vector convention) carries perspective terms
+inline bool isProjective(const std::vector<std::vector<double>> &matrix)
+{
+    return matrix[0][2] != 0 || matrix[1][2] != 0 || matrix[2][2] != 1;
+}
+
+struct Bounds
+{
+    int width,
+        height,
+        x_offset,
+        y_offset;
+};
+
+inline Bounds transformedBounds(double width, double height,
+                         const std::vector<std::vector<double>> &matrix,
+                         int x, int y)
+{
+    std::vector<std::vector<std::vector<double>>> corners = {
+        {{0, 0, 1}},
+        {{width, 0, 1}},
+        {{0, height, 1}},
+        {{width, height, 1}}};
+
+    std::vector<int> xs, ys;
+
+    for (const auto &corner : corners)
+    {
+        auto transformed = multiplyMatrices(corner, matrix);
+        double w = transformed[0][2];
+
+        xs.push_back((int)ceil(transformed[0][0] / w));
+        ys.push_back((int)ceil(transformed[0][1] / w));
+    }
+
+    auto horizontal = std::minmax_element(std::begin(xs), std::end(xs)),
+         vertical = std::minmax_element(std::begin(ys), std::end(ys));
+
+    return {*horizontal.second - *horizontal.first + std::abs(x),
+            *vertical.second - *vertical.first + std::abs(y),
+            *horizontal.first - std::max(0, x),
+            *vertical.first - std::max(0, y)};
 }
\ No newline at end of file
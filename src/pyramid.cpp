@@ -0,0 +1,322 @@
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <atomic>
+#include "affine.hpp"
+#include "ThreadPool.hpp"
+#include "OpenGL.hpp"
+#include "Converters.hpp"
+
+namespace affine
+{
+    namespace
+    {
+        // Tile of the level above from its (up to) four children, averaging
+        // each 2x2 block of child pixels that lies inside the image, in
+        // linear light when asked like the render. Colour is averaged
+        // weighted by alpha, as the render samples, so transparent pixels
+        // lend their parents none
+        template <bool linear, class P>
+        bmp::BasicBitmap<P> downsample(const bmp::BasicBitmap<P> *children[4], int tile_size, int width, int height)
+        {
+            using channel_type = typename P::channel_type;
+
+            constexpr bool decoded = linear && sizeof(channel_type) == 1;
+            constexpr int colors = P::has_alpha ? P::channels - 1 : P::channels;
+
+            bmp::BasicBitmap<P> parent(width, height);
+
+            for (int y = 0; y < height; ++y)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    std::uint64_t sum[P::channels] = {};
+                    std::uint64_t count = 0,
+                                  weight = 0;
+
+                    for (int dy = 0; dy < 2; ++dy)
+                    {
+                        for (int dx = 0; dx < 2; ++dx)
+                        {
+                            int cx = 2 * x + dx,
+                                cy = 2 * y + dy;
+
+                            const bmp::BasicBitmap<P> *child = children[(cy >= tile_size) * 2 + (cx >= tile_size)];
+
+                            cx %= tile_size;
+                            cy %= tile_size;
+
+                            if (!child || cx >= child->width() || cy >= child->height())
+                                continue;
+
+                            const P &pixel = child->m_pixels[(std::size_t)child->width() * cy + cx];
+                            std::uint64_t alpha = P::has_alpha ? pixel[P::channels - 1] : 1;
+
+                            for (int c = 0; c < colors; ++c)
+                                sum[c] += (decoded ? srgb_tables.decode[pixel[c]] : pixel[c]) * alpha;
+
+                            if constexpr (P::has_alpha)
+                                sum[P::channels - 1] += alpha;
+
+                            weight += alpha;
+                            ++count;
+                        }
+                    }
+
+                    P &pixel = parent.m_pixels[(std::size_t)width * y + x];
+
+                    if (!weight)
+                        continue;
+
+                    for (int c = 0; c < colors; ++c)
+                    {
+                        if (decoded)
+                            pixel[c] = srgb_tables.toEncoded((double)sum[c] / weight);
+                        else
+                            pixel[c] = (channel_type)((sum[c] + weight / 2) / weight);
+                    }
+
+                    if constexpr (P::has_alpha)
+                        pixel[P::channels - 1] = (channel_type)((sum[P::channels - 1] + count / 2) / count);
+                }
+            }
+
+            return parent;
+        }
+
+        class Pyramid
+        {
+        public:
+            Pyramid(const ImageView &input, const Affine &affine, const Options &options,
+                    const std::string &filename, int tile_size)
+                : input(input), affine(affine), options(options), tile_size(tile_size)
+            {
+                std::size_t dot = filename.find_last_of('.');
+                directory = filename.substr(0, dot) + "_files";
+
+                // The --roi window of the canvas when given, as in a plain render
+                canvas = options.roi.width ? options.roi : outputRegion(input.width, input.height, affine);
+
+                // Level sizes from 1x1 up to the full canvas, halved with rounding up
+                Region level = canvas;
+
+                while (true)
+                {
+                    levels.insert(levels.begin(), level);
+
+                    if (level.width == 1 && level.height == 1)
+                        break;
+
+                    level.width = (level.width + 1) / 2;
+                    level.height = (level.height + 1) / 2;
+                }
+
+                std::ofstream ofs(filename);
+
+                ofs << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                    << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" TileSize=\"" << tile_size
+                    << "\" Overlap=\"0\" Format=\"bmp\">\n"
+                    << "  <Size Width=\"" << canvas.width << "\" Height=\"" << canvas.height << "\"/>\n"
+                    << "</Image>\n";
+
+                if (!ofs)
+                    throw bmp::Exception("Failed to write pyramid index " + filename);
+
+                for (std::size_t level = 0; level < levels.size(); ++level)
+                    std::filesystem::create_directories(directory + "/" + std::to_string(level));
+            }
+
+            void run()
+            {
+                // Subtrees below a level with enough tiles to keep every worker busy
+                // are built depth first, holding only a few tiles per level in memory
+                std::unique_ptr<ThreadPool> own_pool;
+                ThreadPool *pool = options.pool;
+
+                if (!pool && options.threads > 1 && options.device == Device::CPU)
+                {
+                    own_pool.reset(new ThreadPool(options.threads, options.numa));
+                    pool = own_pool.get();
+                }
+
+                if (options.device == Device::GPU && !options.gpu)
+                {
+                    context.reset(new GPUContext());
+                    this->options.gpu = context.get();
+                }
+
+                int workers = pool ? pool->size() : 1,
+                    cut = levels.size() - 1;
+
+                for (int level = 0; level < (int)levels.size(); ++level)
+                {
+                    if (columns(level) * rows(level) >= 4 * workers)
+                    {
+                        cut = level;
+                        break;
+                    }
+                }
+
+                int base = levels.size() - 1;
+                Progress progress((std::int64_t)columns(base) * rows(base), workers, options.progress);
+
+                std::vector<Image> tiles(columns(cut) * rows(cut));
+
+                auto build = [&](int i)
+                {
+                    tiles[i] = subtree(cut, i % columns(cut), i / columns(cut), progress, i % workers);
+                };
+
+                if (pool)
+                    pool->run(tiles.size(), build);
+                else
+                {
+                    for (int i = 0; i < (int)tiles.size(); ++i)
+                        build(i);
+                }
+
+                progress.finish();
+
+                for (int level = cut - 1; level >= 0; --level)
+                {
+                    std::vector<Image> above(columns(level) * rows(level));
+
+                    for (int row = 0; row < rows(level); ++row)
+                    {
+                        for (int column = 0; column < columns(level); ++column)
+                        {
+                            const Image *children[4] = {};
+
+                            for (int i = 0; i < 4; ++i)
+                            {
+                                int x = 2 * column + i % 2,
+                                    y = 2 * row + i / 2;
+
+                                if (x < columns(level + 1) && y < rows(level + 1))
+                                    children[i] = &tiles[y * columns(level + 1) + x];
+                            }
+
+                            above[row * columns(level) + column] = merge(level, column, row, children);
+                        }
+                    }
+
+                    tiles = std::move(above);
+                }
+
+                if (options.stats)
+                {
+                    options.stats->count("levels", levels.size());
+                    options.stats->count("tiles", saved);
+                }
+            }
+
+        private:
+            int columns(int level) const
+            {
+                return (levels[level].width + tile_size - 1) / tile_size;
+            }
+
+            int rows(int level) const
+            {
+                return (levels[level].height + tile_size - 1) / tile_size;
+            }
+
+            Image subtree(int level, int column, int row, Progress &progress, int slot)
+            {
+                if (level + 1 == (int)levels.size())
+                {
+                    Options tile = options;
+                    tile.threads = 1;
+                    tile.pool = nullptr;
+                    tile.stats = nullptr;
+                    tile.progress = nullptr;
+                    tile.numa = false;
+                    tile.roi.x = canvas.x + column * tile_size;
+                    tile.roi.y = canvas.y + row * tile_size;
+                    tile.roi.width = std::min(tile_size, levels[level].width - column * tile_size);
+                    tile.roi.height = std::min(tile_size, levels[level].height - row * tile_size);
+
+                    Image image = transform(input, affine, tile);
+                    store(level, column, row, image);
+                    progress.add(slot, 1);
+
+                    return image;
+                }
+
+                Image children[4];
+                const Image *pointers[4] = {};
+
+                for (int i = 0; i < 4; ++i)
+                {
+                    int x = 2 * column + i % 2,
+                        y = 2 * row + i / 2;
+
+                    if (x < columns(level + 1) && y < rows(level + 1))
+                    {
+                        children[i] = subtree(level + 1, x, y, progress, slot);
+                        pointers[i] = &children[i];
+                    }
+                }
+
+                return merge(level, column, row, pointers);
+            }
+
+            Image merge(int level, int column, int row, const Image *children[4])
+            {
+                int width = std::min(tile_size, levels[level].width - column * tile_size),
+                    height = std::min(tile_size, levels[level].height - row * tile_size);
+
+                Image image = std::visit([&](const auto &first)
+                                         {
+                                             using Bitmap = std::decay_t<decltype(first)>;
+
+                                             const Bitmap *bitmaps[4] = {};
+
+                                             for (int i = 0; i < 4; ++i)
+                                                 if (children[i])
+                                                     bitmaps[i] = &std::get<Bitmap>(children[i]->storage);
+
+                                             if (options.linear)
+                                                 return Image(downsample<true>(bitmaps, tile_size, width, height));
+
+                                             return Image(downsample<false>(bitmaps, tile_size, width, height)); },
+                                         children[0]->storage);
+
+                store(level, column, row, image);
+
+                return image;
+            }
+
+            void store(int level, int column, int row, const Image &image)
+            {
+                save(image, directory + "/" + std::to_string(level) + "/" +
+                                std::to_string(column) + "_" + std::to_string(row) + ".bmp");
+                ++saved;
+            }
+
+            ImageView input;
+            Affine affine;
+            Options options;
+            int tile_size;
+            std::string directory;
+            Region canvas;
+            std::vector<Region> levels;
+            std::unique_ptr<GPUContext> context;
+            std::atomic<std::int64_t> saved{0};
+        };
+    }
+
+    bool isPyramid(const std::string &filename)
+    {
+        return filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".dzi") == 0;
+    }
+
+    void renderPyramid(const ImageView &input, const Affine &affine, const Options &options,
+                       const std::string &filename, int tile_size)
+    {
+        if (tile_size < 1)
+            throw bmp::Exception("affine::renderPyramid: Invalid tile size");
+
+        Pyramid(input, affine, options, filename, tile_size).run();
+    }
+}
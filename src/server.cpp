@@ -0,0 +1,475 @@
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <list>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <poll.h>
+#include <signal.h>
+#include <boost/program_options.hpp>
+#include "Job.hpp"
+#include "Socket.hpp"
+#include "ThreadPool.hpp"
+#include "OpenGL.hpp"
+#include "Tuning.hpp"
+#include "Memory.hpp"
+#include "affine.hpp"
+
+namespace po = boost::program_options;
+
+// Written to by SIGINT/SIGTERM and the shutdown command to stop the accept loop
+int stop_pipe[2] = {-1, -1};
+
+void requestStop(int)
+{
+    ssize_t n = write(stop_pipe[1], "", 1);
+    (void)n;
+}
+
+// Request latencies, summarised over the most recent requests
+class Latency
+{
+public:
+    void begin()
+    {
+        const std::unique_lock<std::mutex> lock(mutex);
+        peak = std::max(peak, ++in_flight);
+    }
+
+    void end(bool ok, double latency, double render)
+    {
+        const std::unique_lock<std::mutex> lock(mutex);
+
+        --in_flight;
+        ++requests;
+
+        if (!ok)
+        {
+            ++errors;
+            return;
+        }
+
+        if (latencies.size() < window)
+        {
+            latencies.push_back(latency);
+            renders.push_back(render);
+        }
+        else
+        {
+            latencies[next] = latency;
+            renders[next] = render;
+        }
+
+        next = (next + 1) % window;
+    }
+
+    void write(std::ostream &os)
+    {
+        const std::unique_lock<std::mutex> lock(mutex);
+
+        os << std::setprecision(9)
+           << "{\"uptime_seconds\": " << wallTime() - started
+           << ", \"requests\": " << requests
+           << ", \"errors\": " << errors
+           << ", \"in_flight\": " << in_flight
+           << ", \"peak_in_flight\": " << peak
+           << ", \"latency\": ";
+        summary(os, latencies);
+        os << ", \"render\": ";
+        summary(os, renders);
+        os << "}";
+    }
+
+private:
+    static constexpr std::size_t window = 4096;
+
+    static void summary(std::ostream &os, std::vector<double> values)
+    {
+        os << "{\"count\": " << values.size();
+
+        if (!values.empty())
+        {
+            std::sort(values.begin(), values.end());
+            double sum = 0;
+            for (double v : values)
+                sum += v;
+
+            os << ", \"mean_seconds\": " << sum / values.size()
+               << ", \"p50_seconds\": " << values[values.size() / 2]
+               << ", \"p90_seconds\": " << values[values.size() * 90 / 100]
+               << ", \"p99_seconds\": " << values[values.size() * 99 / 100]
+               << ", \"max_seconds\": " << values.back();
+        }
+
+        os << "}";
+    }
+
+    std::mutex mutex;
+    double started = wallTime();
+    std::int64_t requests = 0,
+                 errors = 0,
+                 in_flight = 0,
+                 peak = 0;
+    std::vector<double> latencies,
+        renders;
+    std::size_t next = 0;
+};
+
+/*
+ * Accepts connections on a Unix domain socket and serves every connection on
+ * its own thread. CPU renders share one warm thread pool, GPU renders share
+ * one GL context created at startup (and are serialized on it).
+ */
+class Server
+{
+public:
+    Server(const std::string &path, int threads, bool gpu, bool numa)
+        : path(path), pool(threads, numa)
+    {
+        // Measured first: calibration opens and terminates its own GL context
+        if (gpu)
+        {
+            profile = machineProfile();
+            context.reset(new GPUContext());
+        }
+
+        listener = listenSocket(path);
+    }
+
+    ~Server()
+    {
+        close(listener);
+        unlink(path.c_str());
+    }
+
+    // Serves until requestStop(), then lets open connections finish their current request
+    void run()
+    {
+        pollfd fds[] = {{listener, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+
+        while (true)
+        {
+            if (poll(fds, 2, -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+
+            if (fds[1].revents)
+                break;
+
+            int fd = accept(listener, NULL, NULL);
+
+            if (fd < 0)
+                continue;
+
+            connections.remove_if([](const std::unique_ptr<Connection> &connection)
+                                  {
+                                      if (!connection->done)
+                                          return false;
+
+                                      connection->thread.join();
+                                      close(connection->fd);
+                                      return true; });
+
+            auto connection = std::make_unique<Connection>();
+            connection->fd = fd;
+            connection->thread = std::thread([this, c = connection.get()]
+                                             {
+                                                 serve(c->fd);
+                                                 c->done = true; });
+
+            connections.push_back(std::move(connection));
+        }
+
+        for (auto &connection : connections)
+        {
+            if (!connection->done)
+                shutdown(connection->fd, SHUT_RD);
+        }
+
+        for (auto &connection : connections)
+        {
+            connection->thread.join();
+            close(connection->fd);
+        }
+
+        connections.clear();
+    }
+
+    Latency latency;
+
+private:
+    struct Connection
+    {
+        int fd;
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+
+    void serve(int fd)
+    {
+        LineReader reader(fd);
+        std::string line;
+
+        while (reader.read(line))
+        {
+            if (line.empty())
+                continue;
+
+            double start = wallTime(),
+                   render = 0;
+            std::string response;
+            bool ok = true;
+
+            latency.begin();
+
+            try
+            {
+                response = "ok" + handle(splitArgs(line), render);
+            }
+            catch (const std::exception &e)
+            {
+                ok = false;
+                response = std::string("error ") + e.what();
+                std::replace(response.begin(), response.end(), '\n', ' ');
+            }
+
+            latency.end(ok, wallTime() - start, render);
+
+            try
+            {
+                writeAll(fd, response + "\n");
+            }
+            catch (const bmp::Exception &)
+            {
+                return;
+            }
+        }
+    }
+
+    std::string handle(std::vector<std::string> args, double &render)
+    {
+        if (args.empty())
+            throw bmp::Exception("Empty request");
+
+        std::string command = args.front();
+        args.erase(args.begin());
+
+        if (command == "stats")
+        {
+            std::ostringstream os;
+            latency.write(os);
+            return " " + os.str();
+        }
+
+        if (command == "shutdown")
+        {
+            requestStop(0);
+            return "";
+        }
+
+        if (command != "transform")
+            throw bmp::Exception("Unknown command " + command);
+
+        Job job = parseJob(args);
+
+        if (job.help)
+            throw bmp::Exception("Help is only available from affine_transform --help");
+
+        if (job.input == "-" || job.output == "-")
+            throw bmp::Exception("Streaming through stdin/stdout is not available over the socket, use shm:/name");
+
+        if (job.frames || !job.sequence.empty())
+            throw bmp::Exception("Sequence mode is only available from affine_transform");
+
+        if (job.shards || job.merge)
+            throw bmp::Exception("Sharded rendering is only available from affine_transform");
+
+        if (affine::isPyramid(job.output))
+            throw bmp::Exception("Pyramid output is only available from affine_transform");
+
+        if (job.device == 2 && !context)
+            throw bmp::Exception("GPU device is disabled, start the server with --gpu");
+
+        std::unique_ptr<Stats> stats;
+
+        if (!job.stats.empty())
+            stats.reset(new Stats());
+
+        affine::Affine transform;
+
+        {
+            Stats::Scope scope(stats.get(), "matrix_setup");
+
+            transform = jobAffine(job);
+        }
+
+        std::unique_ptr<affine::Input> input;
+
+        {
+            Stats::Scope scope(stats.get(), "load");
+
+            input.reset(new affine::Input(job.input, jobPixelFormat(job), transform, jobSourceWindow(job)));
+        }
+
+        affine::Options options;
+        options.threads = job.threads_given ? job.threads_number : pool.size();
+
+        // Without a context auto renders on the CPU, with one it is warm
+        if (!job.device)
+        {
+            affine::ImageView view = input->view();
+            affine::Region canvas = job.roi.width ? job.roi : affine::outputRegion(view.width, view.height, transform);
+
+            job.device = context ? autoDevice(profile, (std::int64_t)canvas.width * canvas.height, options.threads, 1, true) : 1;
+        }
+
+        options.device = (affine::Device)job.device;
+        options.tile_size = autoTileSize(input->view().format);
+        options.roi = job.roi;
+        options.layout = affine::parseSourceLayout(job.layout);
+        options.edge = job.edge;
+        options.border = job.border;
+        options.linear = job.linear;
+        options.post = jobPost(job);
+        options.stats = stats.get();
+        options.pool = &pool;
+        options.gpu = context.get();
+
+        double render_start = wallTime();
+
+        affine::Image output = affine::transform(input->view(), transform, options);
+
+        render = wallTime() - render_start;
+
+        {
+            Stats::Scope scope(stats.get(), "save");
+
+            affine::save(output, job.output);
+        }
+
+        if (stats)
+        {
+            if (job.stats == "-")
+            {
+                const std::unique_lock<std::mutex> lock(output_mutex);
+                stats->write(std::cout);
+            }
+            else
+            {
+                std::ofstream ofs(job.stats);
+                stats->write(ofs);
+            }
+        }
+
+        std::ostringstream os;
+        os << std::setprecision(9) << " " << output.width() << " " << output.height() << " " << render;
+        return os.str();
+    }
+
+    std::string path;
+    ThreadPool pool;
+    std::unique_ptr<GPUContext> context;
+    Profile profile;
+    int listener;
+    std::list<std::unique_ptr<Connection>> connections;
+    std::mutex output_mutex;
+};
+
+int main(int argc, char *argv[])
+{
+    std::string socket_path,
+        io;
+    int threads_number,
+        buffer_pool;
+
+    po::options_description desc("Allowed options");
+    desc
+        .add_options()                                                                                                                  // prettier-ignore
+        ("help,h", "produce help message")                                                                                              // prettier-ignore
+        ("socket,s", po::value<std::string>(&socket_path)->default_value(DEFAULT_SOCKET), "Unix domain socket to listen on")            // prettier-ignore
+        ("threads,t", po::value<int>(&threads_number)->default_value(std::max(1u, std::thread::hardware_concurrency())), "worker threads") // prettier-ignore
+        ("gpu,g", "create a GL context at startup and accept GPU renders")                                                               // prettier-ignore
+        ("numa", "pin worker threads to NUMA nodes round-robin")                                                                         // prettier-ignore
+        ("hugepages", "allocate images 64-byte aligned, large ones on transparent huge pages")                                           // prettier-ignore
+        ("io", po::value<std::string>(&io)->default_value("auto"), "image file I/O: auto, uring, threads, stream")                     // prettier-ignore
+        ("direct-io", "read and write image files with O_DIRECT, bypassing the page cache")                                             // prettier-ignore
+        ("buffer-pool", po::value<int>(&buffer_pool)->default_value(512), "megabytes of freed image buffers kept for reuse");            // prettier-ignore
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << desc << std::endl
+                  << "Usage: affine_server options" << std::endl;
+        return 1;
+    }
+
+    if (threads_number <= 0)
+    {
+        std::cout << "Invalid threads count" << std::endl;
+        return 1;
+    }
+
+    if (buffer_pool < 0)
+    {
+        std::cout << "Invalid buffer pool size" << std::endl;
+        return 1;
+    }
+
+    // Requests recycle the image buffers of earlier ones
+    static HugePageResource huge_pages;
+    static BufferPool buffers((std::size_t)buffer_pool << 20,
+                              vm.count("hugepages") ? &huge_pages : std::pmr::new_delete_resource());
+
+    bmp::default_pixel_resource() = &buffers;
+
+    try
+    {
+        defaultFileIO().backend = parseIOBackend(io);
+        defaultFileIO().direct = vm.count("direct-io");
+    }
+    catch (const bmp::Exception &e)
+    {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+
+    if (pipe(stop_pipe) < 0)
+    {
+        std::cout << "Failed to create pipe" << std::endl;
+        return 1;
+    }
+
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+    signal(SIGPIPE, SIG_IGN);
+
+    try
+    {
+        Server server(socket_path, threads_number, vm.count("gpu"), vm.count("numa"));
+
+        std::cout << "Listening on " << socket_path << std::endl;
+
+        server.run();
+
+        server.latency.write(std::cout);
+        std::cout << std::endl;
+    }
+    catch (const bmp::Exception &e)
+    {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include "BitmapPlusPlus.hpp"
+#include "AsyncFile.hpp"
+
+/*
+ * Large-file BMP variant: files past the threshold store 0 in file_size and
+ * size_image, and still load. A small image with the threshold lowered goes
+ * through the whole save/load path; a sparse file past 4 GB checks the
+ * header, probe and reads at 64 bit offsets without the memory of loading it.
+ *
+ * Usage: large_bmp_test [directory for the scratch files]
+ */
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+// file_size and size_image fields of the BMP file filename
+static void sizeFields(const std::string &filename, std::uint32_t &file_size, std::uint32_t &size_image)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    bmp::BitmapHeader header{};
+    ifs.read(reinterpret_cast<char *>(&header), sizeof(header));
+    file_size = header.file_size;
+    size_image = header.size_image;
+}
+
+static void roundTrip(const std::string &dir, IOBackend backend)
+{
+    const std::string filename = dir + "/large_bmp_small.bmp";
+    const FileIOOptions saved = defaultFileIO();
+    defaultFileIO().backend = backend;
+
+    bmp::Bitmap image(61, 47);
+
+    for (std::int32_t y = 0; y < image.height(); ++y)
+        for (std::int32_t x = 0; x < image.width(); ++x)
+            image.set(x, y, bmp::Pixel(x * 4, y * 5, (x ^ y) & 0xff, 255 - x));
+
+    std::uint32_t file_size, size_image;
+
+    // Below the threshold the sizes are stored as usual
+    saveBitmap(image, filename);
+    sizeFields(filename, file_size, size_image);
+    check(file_size != 0 && size_image != 0, "sizes of a small BMP");
+
+    bmp::large_file_threshold() = 1024;
+    saveBitmap(image, filename);
+    bmp::large_file_threshold() = 0xFFFFFFFFu;
+
+    sizeFields(filename, file_size, size_image);
+    check(file_size == 0 && size_image == 0, "sizes of a large-file BMP are 0");
+
+    bmp::Bitmap loaded;
+    loadBitmap(loaded, filename);
+    check(loaded == image, "large-file BMP loads back unchanged");
+
+    std::remove(filename.c_str());
+    defaultFileIO() = saved;
+}
+
+static void sparse(const std::string &dir)
+{
+    const std::string filename = dir + "/large_bmp_sparse.bmp";
+    const std::int32_t width = 32768,
+                       height = 40000;
+
+    const bmp::Buffer header = bmp::Bitmap::bmp_header(width, height);
+    const std::uint64_t row_size = bmp::Bitmap::bmp_row_size(width),
+                        size = header.size() + row_size * height;
+
+    check(size > 0xFFFFFFFFull, "sparse image passes 4 GB");
+
+    // Top row, the last one in the file
+    std::vector<bmp::Pixel> top(width);
+
+    for (std::int32_t x = 0; x < width; ++x)
+        top[x] = bmp::Pixel(x & 0xff, x >> 8, 7, 200);
+
+    bmp::Buffer line(row_size);
+    bmp::Bitmap::encode_bmp_row(top.data(), width, line.data());
+
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0 || pwrite(fd, header.data(), header.size(), 0) != (ssize_t)header.size() ||
+        ftruncate(fd, size) < 0 || pwrite(fd, line.data(), row_size, size - row_size) != (ssize_t)row_size)
+    {
+        check(false, "writing sparse file " + filename);
+        if (fd >= 0)
+            ::close(fd);
+        std::remove(filename.c_str());
+        return;
+    }
+
+    ::close(fd);
+
+    std::uint32_t file_size, size_image;
+    sizeFields(filename, file_size, size_image);
+    check(file_size == 0 && size_image == 0, "sizes of the sparse BMP are 0");
+
+    const bmp::ImageInfo info = bmp::probe(filename);
+    check(info.width == width && info.height == height && info.channels == 4, "probe of the sparse BMP");
+
+    // The top row through the stream and the asynchronous reader
+    for (IOBackend backend : {IOBackend::Stream, IOBackend::Threads})
+    {
+        std::ifstream ifs;
+        FileIOOptions options;
+        options.backend = backend;
+        AsyncFileBuf buffer(filename, std::ios::in, options);
+        std::istream async(&buffer);
+
+        if (backend == IOBackend::Stream)
+            ifs.open(filename, std::ios::binary);
+
+        std::istream &is = backend == IOBackend::Stream ? static_cast<std::istream &>(ifs) : async;
+        const bmp::detail::BmpLayout layout = bmp::detail::read_bmp_layout(is, filename);
+        const std::uint64_t offset = layout.header.offset_bits + row_size * (height - 1);
+
+        bmp::Buffer read(row_size);
+        is.seekg(offset);
+        is.read(reinterpret_cast<char *>(read.data()), row_size);
+
+        check(is && (std::uint64_t)is.tellg() == size, "position after the top row past 4 GB");
+        check(read == line, "top row read back past 4 GB");
+    }
+
+    std::remove(filename.c_str());
+}
+
+int main(int argc, char **argv)
+{
+    const std::string dir = argc > 1 ? argv[1] : ".";
+
+    try
+    {
+        roundTrip(dir, IOBackend::Stream);
+        roundTrip(dir, IOBackend::Threads);
+        sparse(dir);
+    }
+    catch (const std::exception &e)
+    {
+        check(false, e.what());
+    }
+
+    if (failures)
+        return 1;
+
+    std::cout << "Done" << std::endl;
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include <iostream>
+#include <string>
+#include <filesystem>
+#include "affine.hpp"
+
+/*
+ * Upper pyramid levels average colour weighted by alpha, as the render
+ * samples: a tile half opaque red, half transparent must shrink to red at
+ * half alpha, not to a darker red.
+ *
+ * Usage: pyramid_alpha_test [directory for the scratch files]
+ */
+
+int main(int argc, char **argv)
+{
+    const std::string dir = argc > 1 ? argv[1] : ".",
+                      filename = dir + "/pyramid_alpha.dzi";
+
+    try
+    {
+        // Left column opaque red, right column transparent green
+        bmp::Bitmap image(2, 2);
+
+        for (std::int32_t y = 0; y < 2; ++y)
+        {
+            image.set(0, y, bmp::Pixel(255, 0, 0, 255));
+            image.set(1, y, bmp::Pixel(0, 255, 0, 0));
+        }
+
+        affine::Image input(std::move(image));
+        affine::renderPyramid(input.view(), affine::Affine(), affine::Options(), filename, 2);
+
+        bmp::Bitmap top(dir + "/pyramid_alpha_files/0/0_0.bmp");
+        const bmp::Pixel pixel = top.get(0, 0);
+
+        std::filesystem::remove_all(dir + "/pyramid_alpha_files");
+        std::filesystem::remove(filename);
+
+        if (!(pixel == bmp::Pixel(255, 0, 0, 128)))
+        {
+            std::cerr << "FAILED: top level pixel is " << (int)pixel.r << ',' << (int)pixel.g << ','
+                      << (int)pixel.b << ',' << (int)pixel.a << ", expected 255,0,0,128" << std::endl;
+            return 1;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "FAILED: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Done" << std::endl;
+    return 0;
+}
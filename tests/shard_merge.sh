@@ -0,0 +1,41 @@
+#!/bin/sh
+# Renders an image as N shards, merges them and compares the result with a
+# single render of the whole image, byte for byte.
+#
+# Usage: shard_merge.sh affine_transform [directory for the scratch files]
+
+set -e
+
+binary=$1
+dir=${2:-.}/shard_merge
+shards=3
+
+rm -rf "$dir"
+mkdir -p "$dir"
+
+# 173x131 RGB8 input of random pixels
+printf 'P6\n173 131\n255\n' > "$dir/input.ppm"
+head -c $((173 * 131 * 3)) /dev/urandom >> "$dir/input.ppm"
+
+for args in "-a 30" "-a 45 -s 1.3 --edge mirror -t 2" "-a 20 --roi 10,5,90,120 --sharpen 0.5"
+do
+    "$binary" "$dir/input.ppm" "$dir/whole.bmp" $args -q
+
+    shard=0
+    while [ $shard -lt $shards ]
+    do
+        "$binary" "$dir/input.ppm" "$dir/band_%d.shard" $args -q --shard $shard/$shards
+        shard=$((shard + 1))
+    done
+
+    "$binary" "$dir/band_%d.shard" "$dir/merged.bmp" --merge $shards -q
+
+    if ! cmp "$dir/whole.bmp" "$dir/merged.bmp"
+    then
+        echo "Merged shards differ from the whole render with $args"
+        exit 1
+    fi
+done
+
+rm -rf "$dir"
+echo "Done"